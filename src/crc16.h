@@ -0,0 +1,47 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Modbus CRC16 (poly 0xA001 reflected, init 0xFFFF).
+//
+// The engine is picked at compile time, e.g. add_definitions(-DCRC16_ENGINE=1)
+//   CRC16_ENGINE_BITWISE - 8 shift/xor per byte, no table
+//   CRC16_ENGINE_TABLE   - one 256 entry lookup per byte, 512 bytes of table
+//   CRC16_ENGINE_SLICE4  - 4 bytes per step, 2KB of tables
+//   CRC16_ENGINE_SLICE8  - 8 bytes per step, 4KB of tables
+#define CRC16_ENGINE_BITWISE 0
+#define CRC16_ENGINE_TABLE 1
+#define CRC16_ENGINE_SLICE4 4
+#define CRC16_ENGINE_SLICE8 8
+
+#ifndef CRC16_ENGINE
+#define CRC16_ENGINE CRC16_ENGINE_SLICE8
+#endif
+
+#define CRC16_INIT 0xFFFF
+
+// Streaming interface, crc can be updated as bytes arrive:
+//   uint16_t crc = crc16_init();
+//   crc = crc16_update(crc, chunk1, len1);
+//   crc = crc16_update(crc, chunk2, len2);
+//   crc = crc16_final(crc);
+static inline uint16_t crc16_init(void)
+{
+    return CRC16_INIT;
+}
+
+uint16_t crc16_update(uint16_t crc, const uint8_t *data, size_t len);
+
+static inline uint16_t crc16_final(uint16_t crc)
+{
+    return crc;
+}
+
+// one shot crc of a buffer with the selected engine
+uint16_t crc16(const uint8_t *data, size_t len);
+
+// reference bit by bit implementation, always available regardless of engine
+uint16_t crc16_bitwise(uint16_t crc, const uint8_t *data, size_t len);
+
+// name of the engine selected at compile time
+const char *crc16_engine_name(void);
@@ -1,9 +1,29 @@
 ﻿#include <unistd.h>
 #include <string.h>
 
+#include "led.h"
+
+#ifdef MODBUS_HOST
+// no leds on host, keep the interface so callers don't need to care
+
+int led_open(int i)
+{
+    return i < NUM_LEDS ? 0 : -1;
+}
+
+int led_set_color(int i, int color)
+{
+    return 0;
+}
+
+void led_close(int i)
+{
+}
+
+#else
+
 #include <applibs/gpio.h>
 #include <applibs/log.h>
-#include "led.h"
 
 #include <hw/sample_hardware.h>
 
@@ -27,12 +47,15 @@ int led_open(int i)
             return -1;
         }
     }
+    leds[i].color = Led_Colors_Off;
     return 0;
 }
 
 int led_set_color(int i, int color)
 {
-    int result;
+    int result = 0;
+
+    if (i >= NUM_LEDS || leds[i].color == color) return result;
 
     for (int c = 0; c < NUM_CHANNELS; c++) {
         bool isOn = (int)color & (0x1 << c);
@@ -43,6 +66,7 @@ int led_set_color(int i, int color)
             Log_Debug("ERROR: Cannot change RGB LED %d color.\n", i);
         }
     }
+    leds[i].color = color;
     return result;
 }
 
@@ -56,5 +80,9 @@ void led_close(int i)
             GPIO_SetValue(ledFd, LED_OFF); // off
             close(ledFd);
         }
+        leds[i].channel[c] = -1;
     }
-}
\ No newline at end of file
+    leds[i].color = Led_Colors_Off;
+}
+
+#endif // MODBUS_HOST
@@ -3,23 +3,29 @@
 #include <time.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#ifndef MODBUS_HOST
 #include <applibs/gpio.h>
+#endif
 
 #define NUM_CHANNELS 3
 
 #define NUM_LEDS 2
 
+#ifndef MODBUS_HOST
 #define LED_ON GPIO_Value_High
 #define LED_OFF GPIO_Value_Low
+#endif
 
 struct led_t {
     int channel[NUM_CHANNELS];
+    int color; // last color set, GPIOs are only written on change
 };
 
 
 #define RGBLED_INIT_VALUE               \
     {                                   \
-        .channel = { -1, -1, -1 } \
+        .channel = { -1, -1, -1 }, \
+        .color = Led_Colors_Off   \
     }
 
 
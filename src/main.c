@@ -5,17 +5,32 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <time.h>
 #include <string.h>
-#include <applibs/log.h>
-#include <applibs/networking.h>
+#include <stdlib.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 
+#include "platform.h"
 #include "led.h"
 #include "modbus.h"
+#include "modbus_plan.h"
+#include "modbus_change.h"
+#include "modbus_sched.h"
+#include "modbus_bench.h"
+#include "modbus_gateway.h"
+#include "modbus_trace.h"
+#include "utils.h"
+#ifdef MODBUS_HOST
+#include "modbus_sim.h"
+#endif
 
+#ifndef MODBUS_HOST
+#include <applibs/networking.h>
 #include <hw/sample_hardware.h>
+#endif
 
 
 #define BAUD_RATE    19200
@@ -23,43 +38,251 @@
 #define SLAVE_ID     1
 #define REGISTER_ADDR 1840
 #define REGISTER_COUNT 100
+#define REGISTER_GAP  4
+// the first registers are alarms, polled faster than the rest
+#define ALARM_COUNT   10
+#define ALARM_PERIOD_MS 500
+#define SCAN_PERIOD_MS  5000
 
+#ifdef MODBUS_HOST
+#define TTY_PATH     "/dev/ttyUSB0"
+#define BENCH_ITERATIONS 1000
+#define BENCH_QUANTITY 10
+#define SIM_REGISTERS 4096
+static const char *tty_path = TTY_PATH;
+#else
 #define UART_PORT    SAMPLE_AILINK_UART1
+#endif
 
-int test_modbus(void)
+static uint16_t regs[REGISTER_COUNT];
+static modbus_point_t points[REGISTER_COUNT];
+
+// the device and plans live for the whole run, each scan only transfers
+// frames and reopens the uart if the link broke
+static struct modbus_device_t *device;
+static modbus_plan_t *alarm_plan;
+static modbus_plan_t *plan;
+static modbus_change_detector_t *changes;
+static mb_sched_t *sched;
+
+void modbus_session_stop(void);
+static void on_scan(mb_sched_t *scheduler, int group, int result, void *ctx);
+
+int modbus_session_start(void)
 {
     Log_Debug("\n\nmodbus test\n");
-    struct modbus_device_t *device = modbus_create_device(UART_PORT, BAUD_RATE);
+#ifdef MODBUS_HOST
+    device = modbus_create_device_tty(tty_path, BAUD_RATE);
+#else
+    device = modbus_create_device(UART_PORT, BAUD_RATE);
+#endif
 
     if (!device) {
         Log_Debug("Failed to create modbus device\n");
         return -1;
     }
 
+    // a failed open is retried by the first transactions after the backoff
     if (modbus_open(device, SLAVE_ID, TIMEOUT_MS) != 0) {
-        Log_Debug("Failed to open modbus device\n");
+        Log_Debug("Failed to open modbus device, retry later\n");
+    }
+
+    for (int i = 0; i < REGISTER_COUNT; i++) {
+        points[i].slave_id = SLAVE_ID;
+        points[i].reg_type = HOLDING_REGISTER;
+        points[i].addr = (uint16_t)(REGISTER_ADDR + i);
+        points[i].value = &regs[i];
+        points[i].result = DEVICE_E_INVALID; // not read yet, no change to report
+    }
+
+    alarm_plan = modbus_plan_create(points, ALARM_COUNT, REGISTER_GAP);
+    plan = modbus_plan_create(points + ALARM_COUNT, REGISTER_COUNT - ALARM_COUNT, REGISTER_GAP);
+    changes = modbus_change_create(points, REGISTER_COUNT);
+    sched = mb_sched_create(device, TIMEOUT_MS);
+    if (!alarm_plan || !plan || !changes || !sched || mb_sched_add_group(sched, alarm_plan, ALARM_PERIOD_MS) < 0 ||
+        mb_sched_add_group(sched, plan, SCAN_PERIOD_MS) < 0) {
+        modbus_session_stop();
+        return -1;
+    }
+    sched->on_scan = on_scan;
+    return 0;
+}
+
+static void on_scan(mb_sched_t *scheduler, int group, int err, void *ctx)
+{
+    const modbus_health_t *health = modbus_get_health(device);
+    if (err)
+        Log_Debug("Scan %d failed:%s, session state %d, %u reopens\n", group, strerr(err), health->state,
+                  health->reopens);
+
+    // only log what changed since the last poll
+    int n = modbus_change_update(changes, timer_monotonic_us());
+    for (int i = 0; i < n; i++) {
+        const modbus_change_t *change = &changes->changes[i];
+        Log_Debug("%d.%u: %u -> %u\n", change->slave_id, change->addr, change->old_value, change->new_value);
+    }
+}
+
+int test_modbus(void)
+{
+    return mb_sched_run(sched, 0);
+}
+
+void modbus_session_stop(void)
+{
+    mb_sched_destroy(sched);
+    sched = NULL;
+    modbus_plan_destroy(alarm_plan);
+    alarm_plan = NULL;
+    modbus_plan_destroy(plan);
+    plan = NULL;
+    modbus_change_destroy(changes);
+    changes = NULL;
+    if (device) {
+        modbus_close(device);
         modbus_destroy_device(device);
+        device = NULL;
+    }
+}
+
+
+#ifdef MODBUS_HOST
+static const char *pcap_path;
+
+// write the frames traced last to pcap_path, if set
+static void save_capture(void)
+{
+    if (!pcap_path)
+        return;
+    int fd = open(pcap_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        Log_Debug("Failed to open %s:%s\n", pcap_path, strerror(errno));
+        return;
+    }
+    if (mb_trace_write_pcap(fd) == DEVICE_OK)
+        Log_Debug("Capture written to %s\n", pcap_path);
+    close(fd);
+}
+
+// run the benchmark suite against the in-process slave simulator, over its
+// pty or as modbus tcp on loopback. sim_baud_rate paces the simulated rtu
+// slave, 0 measures the stack alone
+int bench_modbus(int iterations, unsigned int sim_baud_rate, unsigned int latency_us, bool tcp)
+{
+    // every rtu frame goes through the crc engine, a wrong crc fails the run
+    if (!tcp && modbus_bench_crc(iterations * 100) != 0)
+        return -1;
+
+    modbus_sim_config_t config = {
+        .slave_id = SLAVE_ID,
+        .nregs = SIM_REGISTERS,
+        .baud_rate = sim_baud_rate,
+        .latency_us = latency_us,
+    };
+    modbus_sim_t *sim = modbus_sim_create(&config);
+    if (!sim || (tcp && modbus_sim_listen_tcp(sim, 0) != DEVICE_OK) || modbus_sim_start(sim) != DEVICE_OK) {
+        Log_Debug("Failed to start slave simulator\n");
+        modbus_sim_destroy(sim);
         return -1;
     }
 
-    for (uint16_t i = REGISTER_ADDR; i < REGISTER_ADDR + REGISTER_COUNT; i++) {
-        uint16_t reg;
-        mb_read_register(device, SLAVE_ID, HOLDING_REGISTER, i, 1, &reg, TIMEOUT_MS);
+    struct modbus_device_t *device = tcp ? modbus_create_device_tcp("127.0.0.1", modbus_sim_tcp_port(sim))
+                                         : modbus_create_device_tty(modbus_sim_path(sim), BAUD_RATE);
+    if (!device || modbus_open(device, SLAVE_ID, TIMEOUT_MS) != 0) {
+        Log_Debug("Failed to open modbus device on %s\n", modbus_sim_path(sim));
+        modbus_destroy_device(device);
+        modbus_sim_destroy(sim);
+        return -1;
     }
 
+    modbus_bench_result_t results[MODBUS_BENCH_MAX_RESULTS];
+    int count = modbus_bench_run(device, SLAVE_ID, REGISTER_ADDR, BENCH_QUANTITY, iterations, TIMEOUT_MS, results);
+    modbus_bench_print(results, count);
+    modbus_print_metrics(device);
+    save_capture();
+
     modbus_close(device);
     modbus_destroy_device(device);
+    modbus_sim_destroy(sim);
     return 0;
 }
 
+// bridge modbus tcp clients on port to the rtu bus on tty, all unit ids
+int gateway_modbus(const char *path, uint16_t port)
+{
+    struct modbus_device_t *device = modbus_create_device_tty(path, BAUD_RATE);
+    if (!device || modbus_open(device, SLAVE_ID, TIMEOUT_MS) != 0) {
+        Log_Debug("Failed to open modbus device on %s\n", path);
+        modbus_destroy_device(device);
+        return -1;
+    }
 
-int main(void )
+    mb_gateway_t *gateway = mb_gateway_create("0.0.0.0", port);
+    if (!gateway || mb_gateway_add_bus(gateway, device, 1, 247) < 0) {
+        mb_gateway_destroy(gateway);
+        modbus_destroy_device(device);
+        return -1;
+    }
+
+    Log_Debug("Gateway listening on port %u for %s\n", mb_gateway_port(gateway), path);
+    int result = mb_gateway_run(gateway, 0);
+    mb_gateway_print_stats(gateway);
+    save_capture();
+
+    mb_gateway_destroy(gateway);
+    modbus_close(device);
+    modbus_destroy_device(device);
+    return result;
+}
+#endif
+
+
+int main(int argc, char *argv[])
 {
     Log_Debug("Application starting 2\n");
 
-    while (1) {
-		test_modbus();
-        sleep(5);
+#ifdef MODBUS_HOST
+    // host build: modbus_test [-v] [--pcap file] [tty]
+    //             modbus_test --bench [iterations] [sim baud rate] [sim latency us]
+    //             modbus_test --bench-tcp [iterations] [sim latency us]
+    //             modbus_test --gateway tty [port]
+    //             -v logs every frame as hex
+    //             --pcap saves the last frames of a bench or gateway run
+    if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+        log_set_level(LOG_LEVEL_TRACE);
+        argc--;
+        argv++;
+    }
+    if (argc > 2 && strcmp(argv[1], "--pcap") == 0) {
+        pcap_path = argv[2];
+        argc -= 2;
+        argv += 2;
     }
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        int iterations = argc > 2 ? atoi(argv[2]) : BENCH_ITERATIONS;
+        unsigned int sim_baud_rate = argc > 3 ? (unsigned int)atoi(argv[3]) : 0;
+        unsigned int latency_us = argc > 4 ? (unsigned int)atoi(argv[4]) : 0;
+        return bench_modbus(iterations, sim_baud_rate, latency_us, false);
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-tcp") == 0) {
+        int iterations = argc > 2 ? atoi(argv[2]) : BENCH_ITERATIONS;
+        unsigned int latency_us = argc > 3 ? (unsigned int)atoi(argv[3]) : 0;
+        return bench_modbus(iterations, 0, latency_us, true);
+    }
+    if (argc > 2 && strcmp(argv[1], "--gateway") == 0) {
+        uint16_t port = argc > 3 ? (uint16_t)atoi(argv[3]) : MODBUS_TCP_DEFAULT_PORT;
+        return gateway_modbus(argv[2], port);
+    }
+    if (argc > 1)
+        tty_path = argv[1];
+#endif
+
+    if (modbus_session_start() != 0)
+        return -1;
+
+    // scans run for ever, each group on its own period
+    test_modbus();
+
+    modbus_session_stop();
     return 0;
 }
\ No newline at end of file
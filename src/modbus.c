@@ -5,12 +5,14 @@
 #include <strings.h>
 
 #include "modbus.h"
+#include "modbus_cache.h"
+#include "modbus_pdu.h"
+#include "modbus_value.h"
 #include "utils.h"
-#include <applibs/log.h>
+#include "platform.h"
 
 
-static int parse_read_response(modbus_device_t *self, uint8_t *request, uint8_t *response, int len_rsp,
-                               uint16_t *regs)
+int mb_check_read_response(const uint8_t *request, const uint8_t *response, int len_rsp)
 {
     // minimum 2 bytes, even in error case
     if (len_rsp < 2) {
@@ -27,33 +29,25 @@ static int parse_read_response(modbus_device_t *self, uint8_t *request, uint8_t
     // if succeed, server echo back function code
     if (function_rsp == function_req) {
         uint8_t byte_count = response[1];
-        uint8_t *payload = response + 2;
 
         if (byte_count + 2 != len_rsp) {
             Log_Debug("byte count not match header\n");
             return DEVICE_E_PROTOCOL;
         }
 
-        if (function == FC_READ_INPUT_REGISTERS || function == FC_READ_HOLDING_REGISTERS) {
+        if (function == FC_READ_INPUT_REGISTERS || function == FC_READ_HOLDING_REGISTERS ||
+            function == FC_READ_WRITE_REGISTERS) {
             // check bytes received match requested
             if (byte_count != 2 * quantity_req) {
                 Log_Debug("byte count not match requested\n");
                 return DEVICE_E_PROTOCOL;
             }
-
-            for (uint16_t i = 0; i < quantity_req; i++) {
-                regs[i] = (uint16_t)((payload[i * 2] << 8) + payload[i * 2 + 1]);
-            }
         } else if (function == FC_READ_COILS || function == FC_READ_DISCRETE_INPUTS) {
             // check bytes received match requested
             if (byte_count != (quantity_req + 7) / 8) {
                 Log_Debug("byte count not match request\n");
                 return DEVICE_E_PROTOCOL;
             }
-
-            for (uint16_t i = 0; i < quantity_req; i++) {
-                regs[i] = payload[i / 8] & (0x01u << (i % 8)) ? 1 : 0;
-            }
         }
     } else if (function_rsp == (function_req | 0x80)) {
         // server echo back function code with LSB set when something wrong
@@ -68,43 +62,97 @@ static int parse_read_response(modbus_device_t *self, uint8_t *request, uint8_t
     return DEVICE_OK;
 }
 
-static int handle_read_request(modbus_device_t *self, uint8_t slave_id, uint8_t function_code, uint16_t addr,
-                               uint16_t quantity, uint16_t *regs, int32_t timeout)
+int mb_parse_read_response(const uint8_t *request, const uint8_t *response, int len_rsp, uint16_t *regs)
 {
-    uint8_t request[5];
-    uint8_t response[MODBUS_MAX_PDU_SIZE];
+    int err = mb_check_read_response(request, response, len_rsp);
+    if (err)
+        return err;
 
+    uint8_t function = response[0];
+    uint16_t quantity_req = (uint16_t)((request[3] << 8) + request[4]);
+    const uint8_t *payload = response + 2;
+
+    if (function == FC_READ_INPUT_REGISTERS || function == FC_READ_HOLDING_REGISTERS ||
+        function == FC_READ_WRITE_REGISTERS) {
+        mb_decode_u16(payload, quantity_req, regs);
+    } else if (function == FC_READ_COILS || function == FC_READ_DISCRETE_INPUTS) {
+        mb_unpack_bits(payload, 0, quantity_req, regs);
+    }
+    return DEVICE_OK;
+}
+
+int mb_encode_read_request(uint8_t *request, uint8_t function_code, uint16_t addr, uint16_t quantity)
+{
     request[0] = function_code;          // MODBUS FUNCTION CODE
     request[1] = (uint8_t)((addr >> 8) & 0xFF);     // START REGISTER (Hi)
     request[2] = (uint8_t)(addr & 0xFF);            // START REGISTER (Lo)
     request[3] = (uint8_t)((quantity >> 8) & 0xFF); // NUMBER OF REGISTERS (Hi)
     request[4] = (uint8_t)(quantity & 0xFF);        // NUMBER OF REGISTERS (Lo)
+    return MODBUS_READ_REQUEST_FRAME_LENGTH;
+}
 
-    // send request
+// send the request encoded in adu and wait for its response. The request is
+// encoded in place and *response points into the transport receive buffer,
+// no pdu is copied around.
+static int device_transact(modbus_device_t *self, uint8_t slave_id, modbus_adu_t *adu, int len_req,
+                           const uint8_t **response, int *len_rsp, modbus_timing_t *timing, int32_t timeout)
+{
     struct timespec poll_sw;
     timer_stopwatch_start(&poll_sw);
-    int err = modbus_rtu_send_request(self->rtu, slave_id, request, MODBUS_READ_REQUEST_FRAME_LENGTH, timeout);
+
+    memset(timing, 0, sizeof(*timing));
+    *response = NULL;
+    *len_rsp = 0;
+    uint64_t start_us = timer_monotonic_us();
+    uint16_t tid = 0;
+    int err = self->tcp ? modbus_tcp_send_adu(self->tcp, slave_id, adu, len_req, &tid, timeout)
+                        : modbus_rtu_send_adu(self->rtu, slave_id, adu, len_req, timeout);
     if (err) {
         Log_Debug("Failed to send request:%s\n", strerr(err));
         return err;
     }
+    uint64_t sent_us = timer_monotonic_us();
 
-    // recv response
-    int len_rsp;
     // sending is not a blocked operation, so only use timeout for receiving
     int elapse_ms = timer_stopwatch_stop(&poll_sw);
-    err = modbus_rtu_recv_response(self->rtu, slave_id, response, &len_rsp, timeout - elapse_ms);
+    if (self->tcp) {
+        uint16_t rsp_tid;
+        const uint8_t *request;
+        do {
+            err = modbus_tcp_recv_pdu(self->tcp, &rsp_tid, &request, response, len_rsp,
+                                      timeout - (int)timer_stopwatch_stop(&poll_sw));
+        } while (err == DEVICE_OK && rsp_tid != tid);
+        if (err)
+            modbus_tcp_cancel(self->tcp);
+        timing->send_us = sent_us - start_us;
+        timing->frame_us = timer_monotonic_us() - sent_us;
+    } else if (slave_id == MODBUS_BROADCAST_ID) {
+        // nobody answers, the next request waits for the slaves instead
+        modbus_rtu_broadcast_sent(self->rtu);
+        modbus_rtu_get_timing(self->rtu, timing);
+    } else {
+        err = modbus_rtu_recv_pdu(self->rtu, slave_id, response, len_rsp, timeout - elapse_ms);
+        modbus_rtu_get_timing(self->rtu, timing);
+    }
     if (err) {
         Log_Debug("Failed to receive response:%s\n", strerr(err));
-        return err;
     }
+    return err;
+}
+
+static int handle_request(modbus_device_t *self, uint8_t slave_id, modbus_adu_t *adu, int len_req, uint16_t *regs,
+                          int32_t timeout);
 
-    // parse reponse
-    return parse_read_response(self, request, response, len_rsp, regs);
+static int handle_read_request(modbus_device_t *self, uint8_t slave_id, uint8_t function_code, uint16_t addr,
+                               uint16_t quantity, uint16_t *regs, int32_t timeout)
+{
+    modbus_adu_t adu;
+    int len_req = mb_encode_read_request(MODBUS_ADU_PDU(&adu), function_code, addr, quantity);
+    return handle_request(self, slave_id, &adu, len_req, regs, timeout);
 }
 
 
-static int parse_write_response(modbus_device_t *self, uint8_t *request, uint8_t *response, int len_rsp)
+int mb_parse_write_response(const uint8_t *request, const uint8_t *response, int len_rsp)
 {
     // minimum 2 bytes, even in error case
     if (len_rsp < 2) {
@@ -117,6 +165,13 @@ static int parse_write_response(modbus_device_t *self, uint8_t *request, uint8_t
 
     // if succeed, server echo back function code
     if (function_rsp == function_req) {
+        // address and quantity or value, mask write echoes its masks too
+        int len_echo = function_req == FC_MASK_WRITE_REGISTER ? 7 : 5;
+        if (len_rsp != len_echo || memcmp(request + 5, response + 5, (size_t)(len_echo - 5)) != 0) {
+            Log_Debug("Invalid packet received\n");
+            return DEVICE_E_PROTOCOL;
+        }
+
         uint16_t addr_req = (uint16_t)((request[1] << 8) + request[2]);
         uint16_t addr_rsp = (uint16_t)((response[1] << 8) + response[2]);
         uint16_t quantity_req = (uint16_t)((request[3] << 8) + request[4]);
@@ -140,12 +195,14 @@ static int parse_write_response(modbus_device_t *self, uint8_t *request, uint8_t
 }
 
 
-static int handle_write_request(modbus_device_t *self, uint8_t slave_id, uint8_t function_code, uint16_t addr,
-                                uint16_t quantity, uint16_t *regs, int32_t timeout)
+int mb_encode_write_request(uint8_t *request, uint8_t function_code, uint16_t addr, uint16_t quantity,
+                            const uint16_t *regs)
 {
-    uint8_t request[MODBUS_MAX_PDU_SIZE];
-    uint8_t response[MODBUS_MAX_PDU_SIZE];
-
+    if (function_code == FC_WRITE_SINGLE_COIL || function_code == FC_WRITE_SINGLE_REGISTER) {
+        // the value takes the place of the quantity, a coil is on with 0xFF00
+        uint16_t value = function_code == FC_WRITE_SINGLE_REGISTER ? regs[0] : regs[0] ? 0xFF00 : 0x0000;
+        return mb_encode_read_request(request, function_code, addr, value);
+    }
 
     request[0] = function_code;          // MODBUS FUNCTION CODE
     request[1] = (uint8_t)((addr >> 8) & 0xFF);     // START REGISTER (Hi)
@@ -153,17 +210,11 @@ static int handle_write_request(modbus_device_t *self, uint8_t slave_id, uint8_t
     request[3] = (uint8_t)((quantity >> 8) & 0xFF); // NUMBER OF REGISTERS (Hi)
     request[4] = (uint8_t)(quantity & 0xFF);        // NUMBER OF REGISTERS (Lo)
 
+    request[5] = 0; // BYTE COUNT
     if (function_code == FC_WRITE_COILS) {
         request[5] = (uint8_t)((quantity + 7) / 8); // BYTE COUNT
-        for (int i = 0; i < quantity; i++) {
-            int byte_i = i / 8;
-            int bit_i = i % 8;
-
-            if (regs[i])
-                request[6 + byte_i] |= (uint8_t)(1 << bit_i);
-            else
-                request[6 + byte_i] &= (uint8_t)(~(1 << bit_i));
-        }
+        memset(request + 6, 0, request[5]);
+        mb_pack_bits(regs, quantity, request + 6, 0);
     } else if (function_code == FC_WRITE_HOLDING_REGISTERS) {
         request[5] = (uint8_t)(quantity * 2); // BYTE COUNT
         unsigned char *output = (request + 6);
@@ -174,31 +225,177 @@ static int handle_write_request(modbus_device_t *self, uint8_t slave_id, uint8_t
     }
 
     // all write request has 6 bytes header plus addtional data
-    struct timespec poll_sw;
-    timer_stopwatch_start(&poll_sw);
-    uint8_t len_req = (uint8_t)(6 + request[5]);
-    int err = modbus_rtu_send_request(self->rtu, slave_id, request, len_req, timeout);
-    if (err) {
-        Log_Debug("Failed to send request:%s\n", strerr(err));
-        return err;
+    return 6 + request[5];
+}
+
+int mb_encode_write_bits_request(uint8_t *request, uint16_t addr, uint16_t quantity, const uint8_t *bits)
+{
+    if (quantity == 1)
+        return mb_encode_read_request(request, FC_WRITE_SINGLE_COIL, addr, bits[0] & 0x01 ? 0xFF00 : 0x0000);
+
+    mb_encode_read_request(request, FC_WRITE_COILS, addr, quantity);
+    request[5] = (uint8_t)((quantity + 7) / 8); // BYTE COUNT
+    memcpy(request + 6, bits, request[5]);
+    // bits past quantity in the last byte must be 0
+    if (quantity % 8)
+        request[5 + request[5]] &= (uint8_t)((1 << (quantity % 8)) - 1);
+    return 6 + request[5];
+}
+
+int mb_encode_mask_write_request(uint8_t *request, uint16_t addr, uint16_t and_mask, uint16_t or_mask)
+{
+    mb_encode_read_request(request, FC_MASK_WRITE_REGISTER, addr, and_mask);
+    request[5] = (uint8_t)(or_mask >> 8);
+    request[6] = (uint8_t)(or_mask & 0xFF);
+    return 7;
+}
+
+int mb_encode_read_write_request(uint8_t *request, uint16_t read_addr, uint16_t read_quantity, uint16_t write_addr,
+                                 uint16_t write_quantity, const uint16_t *regs)
+{
+    mb_encode_read_request(request, FC_READ_WRITE_REGISTERS, read_addr, read_quantity);
+    request[5] = (uint8_t)(write_addr >> 8);
+    request[6] = (uint8_t)(write_addr & 0xFF);
+    request[7] = (uint8_t)(write_quantity >> 8);
+    request[8] = (uint8_t)(write_quantity & 0xFF);
+    request[9] = (uint8_t)(write_quantity * 2); // BYTE COUNT
+    for (int i = 0; i < write_quantity; i++) {
+        request[10 + 2 * i] = (uint8_t)(regs[i] >> 8);
+        request[11 + 2 * i] = (uint8_t)(regs[i] & 0xFF);
     }
+    return 10 + request[9];
+}
 
+// send the request encoded in adu, check the response and decode it into
+// regs for reads, or check the echo for writes when regs is NULL. rtu
+// broadcasts complete once sent.
+static int handle_request(modbus_device_t *self, uint8_t slave_id, modbus_adu_t *adu, int len_req, uint16_t *regs,
+                          int32_t timeout)
+{
+    const uint8_t *request = MODBUS_ADU_PDU(adu);
+    uint8_t function_code = request[0];
+    const uint8_t *response;
     int len_rsp;
-    int elapse_ms = timer_stopwatch_stop(&poll_sw);
-    err = modbus_rtu_recv_response(self->rtu, slave_id, response, &len_rsp, timeout - elapse_ms);
+    bool broadcast = self->rtu && slave_id == MODBUS_BROADCAST_ID;
+
+    if (broadcast && !mb_broadcast_allowed(function_code)) {
+        Log_Debug("Function 0x%02x can't be broadcast\n", function_code);
+        return DEVICE_E_INVALID;
+    }
+
+    modbus_timing_t timing;
+
+    int err = device_transact(self, slave_id, adu, len_req, &response, &len_rsp, &timing, timeout);
+    if (err == DEVICE_OK && !broadcast)
+        err = regs ? mb_parse_read_response(request, response, len_rsp, regs)
+                   : mb_parse_write_response(request, response, len_rsp);
+
+    modbus_record_transaction(self, slave_id, function_code, err, &timing);
+    return err;
+}
+
+// like handle_request for a read, without decoding: *data points to the
+// register bytes of the response in the transport receive buffer
+static int handle_read_raw(modbus_device_t *self, uint8_t slave_id, uint8_t function_code, uint16_t addr,
+                           uint16_t quantity, const uint8_t **data, int32_t timeout)
+{
+    if (self->rtu && slave_id == MODBUS_BROADCAST_ID)
+        return DEVICE_E_INVALID;
+
+    modbus_adu_t adu;
+    const uint8_t *request = MODBUS_ADU_PDU(&adu);
+    int len_req = mb_encode_read_request(MODBUS_ADU_PDU(&adu), function_code, addr, quantity);
+    const uint8_t *response;
+    int len_rsp;
+    modbus_timing_t timing;
+
+    int err = device_transact(self, slave_id, &adu, len_req, &response, &len_rsp, &timing, timeout);
+    if (err == DEVICE_OK)
+        err = mb_check_read_response(request, response, len_rsp);
+    if (err == DEVICE_OK)
+        *data = response + 2;
+
+    modbus_record_transaction(self, slave_id, function_code, err, &timing);
+    return err;
+}
+
+static int handle_write_request(modbus_device_t *self, uint8_t slave_id, uint8_t function_code, uint16_t addr,
+                                uint16_t quantity, uint16_t *regs, int32_t timeout)
+{
+    modbus_adu_t adu;
+    int len_req = mb_encode_write_request(MODBUS_ADU_PDU(&adu), function_code, addr, quantity, regs);
+    return handle_request(self, slave_id, &adu, len_req, NULL, timeout);
+}
+
+
+static int device_open(modbus_device_t *self)
+{
+    return self->tcp ? modbus_tcp_open(self->tcp) : modbus_rtu_open(self->rtu);
+}
+
+static int device_close(modbus_device_t *self)
+{
+    return self->tcp ? modbus_tcp_close(self->tcp) : modbus_rtu_close(self->rtu);
+}
+
+
+// link failures close the uart or socket, the next call after the backoff reopens it
+static void session_backoff(modbus_device_t *self)
+{
+    device_close(self);
+    self->health.state = MB_SESSION_BACKOFF;
+    self->reopen_at_us = timer_monotonic_us() + (uint64_t)self->backoff_ms * 1000;
+
+    self->backoff_ms *= 2;
+    if (self->backoff_ms > self->backoff_max_ms)
+        self->backoff_ms = self->backoff_max_ms;
+}
+
+static int session_ready(modbus_device_t *self)
+{
+    if (self->health.state == MB_SESSION_ONLINE)
+        return DEVICE_OK;
+    if (self->health.state == MB_SESSION_CLOSED)
+        return DEVICE_E_INVALID;
+    if (timer_monotonic_us() < self->reopen_at_us)
+        return DEVICE_E_BROKEN;
+
+    int err = device_open(self);
     if (err) {
-        Log_Debug("Failed to receive response:%s\n", strerr(err));
+        Log_Debug("Failed to reopen device:%s\n", strerr(err));
+        self->health.reopen_failures++;
+        session_backoff(self);
+        return DEVICE_E_BROKEN;
+    }
+
+    Log_Debug("Device reopened\n");
+    self->health.reopens++;
+    self->health.state = MB_SESSION_ONLINE;
+    return DEVICE_OK;
+}
+
+static int session_result(modbus_device_t *self, int err)
+{
+    self->health.transactions++;
+    self->health.last_error = err;
+    if (err == DEVICE_OK) {
+        self->health.consecutive_errors = 0;
+        self->backoff_ms = self->backoff_min_ms;
         return err;
     }
 
-    return parse_write_response(self, request, response, len_rsp);
+    self->health.errors++;
+    self->health.consecutive_errors++;
+    // timeouts and exceptions are the slave's business, the link is fine
+    if (err == DEVICE_E_BROKEN || err == DEVICE_E_IO)
+        session_backoff(self);
+    return err;
 }
 
 
 // --------------------- public interface ---------------------------------------
 
-int mb_read_register(modbus_device_t *self, uint8_t slave_id, uint8_t reg_type, uint16_t addr, uint16_t quantity,
-                     uint16_t *regs, int32_t timeout)
+uint8_t mb_read_function(uint8_t reg_type)
 {
     uint8_t fc = 0;
     switch (reg_type) {
@@ -214,65 +411,497 @@ int mb_read_register(modbus_device_t *self, uint8_t slave_id, uint8_t reg_type,
     case HOLDING_REGISTER:
         fc = FC_READ_HOLDING_REGISTERS;
     }
+    return fc;
+}
 
-    if (fc != 0)
-        return handle_read_request(self, slave_id, fc, addr, quantity, regs, timeout);
-    else
-        return DEVICE_E_INVALID;
+uint8_t mb_read_type(uint8_t function_code)
+{
+    uint8_t reg_type = INVALID;
+    switch (function_code) {
+    case FC_READ_COILS:
+        reg_type = COIL;
+        break;
+    case FC_READ_DISCRETE_INPUTS:
+        reg_type = DISCRETE_INPUT;
+        break;
+    case FC_READ_INPUT_REGISTERS:
+        reg_type = INPUT_REGISTER;
+        break;
+    case FC_READ_HOLDING_REGISTERS:
+        reg_type = HOLDING_REGISTER;
+    }
+    return reg_type;
 }
 
-int mb_write_register(modbus_device_t *self, uint8_t slave_id, uint8_t reg_type, uint16_t addr, uint16_t quantity,
-                      uint16_t *regs, int32_t timeout)
+uint8_t mb_write_range(const uint8_t *request, uint16_t *addr, uint16_t *quantity)
+{
+    *addr = (uint16_t)((request[1] << 8) + request[2]);
+    *quantity = 1;
+    switch (request[0]) {
+    case FC_WRITE_SINGLE_COIL:
+        return COIL;
+    case FC_WRITE_COILS:
+        *quantity = (uint16_t)((request[3] << 8) + request[4]);
+        return COIL;
+    case FC_WRITE_SINGLE_REGISTER:
+    case FC_MASK_WRITE_REGISTER:
+        return HOLDING_REGISTER;
+    case FC_WRITE_HOLDING_REGISTERS:
+        *quantity = (uint16_t)((request[3] << 8) + request[4]);
+        return HOLDING_REGISTER;
+    case FC_READ_WRITE_REGISTERS:
+        *addr = (uint16_t)((request[5] << 8) + request[6]);
+        *quantity = (uint16_t)((request[7] << 8) + request[8]);
+        return HOLDING_REGISTER;
+    default:
+        *quantity = 0;
+        return INVALID;
+    }
+}
+
+bool mb_broadcast_allowed(uint8_t function_code)
+{
+    switch (function_code) {
+    case FC_WRITE_SINGLE_COIL:
+    case FC_WRITE_SINGLE_REGISTER:
+    case FC_WRITE_COILS:
+    case FC_WRITE_HOLDING_REGISTERS:
+    case FC_WRITE_FILE_RECORD:
+    case FC_MASK_WRITE_REGISTER:
+        return true;
+    default:
+        return false;
+    }
+}
+
+int mb_request_pdu_len(const uint8_t *pdu, int avail)
+{
+    if (avail < 1)
+        return 0;
+
+    switch (pdu[0]) {
+    case FC_READ_COILS:
+    case FC_READ_DISCRETE_INPUTS:
+    case FC_READ_HOLDING_REGISTERS:
+    case FC_READ_INPUT_REGISTERS:
+    case FC_WRITE_SINGLE_COIL:
+    case FC_WRITE_SINGLE_REGISTER:
+    case FC_DIAGNOSTICS:
+        // function code + 2 bytes addr/sub-function + 2 bytes quantity/value
+        return 5;
+    case FC_READ_EXCEPTION_STATUS:
+    case FC_GET_COMM_EVENT_COUNTER:
+    case FC_GET_COMM_EVENT_LOG:
+    case FC_REPORT_SERVER_ID:
+        return 1;
+    case FC_WRITE_COILS:
+    case FC_WRITE_HOLDING_REGISTERS:
+        // function code + addr + quantity + 1 byte byte count + values
+        return avail < 6 ? 0 : 6 + pdu[5];
+    case FC_READ_FILE_RECORD:
+    case FC_WRITE_FILE_RECORD:
+        // function code + 1 byte byte count + sub-requests
+        return avail < 2 ? 0 : 2 + pdu[1];
+    case FC_MASK_WRITE_REGISTER:
+        // function code + addr + and mask + or mask
+        return 7;
+    case FC_READ_WRITE_REGISTERS:
+        // function code + read addr, quantity + write addr, quantity + byte count + values
+        return avail < 10 ? 0 : 10 + pdu[9];
+    case FC_READ_FIFO_QUEUE:
+        // function code + fifo pointer address
+        return 3;
+    case FC_MEI:
+        // read device identification: function code, mei type, read code, object id
+        if (avail < 2)
+            return 0;
+        return pdu[1] == 0x0E ? 4 : -1;
+    default:
+        return -1;
+    }
+}
+
+uint8_t mb_write_function(uint8_t reg_type, uint16_t quantity)
 {
     uint8_t fc = 0;
     switch (reg_type) {
     case COIL:
-        fc = FC_WRITE_COILS;
+        fc = quantity == 1 ? FC_WRITE_SINGLE_COIL : FC_WRITE_COILS;
         break;
     case HOLDING_REGISTER:
-        fc = FC_WRITE_HOLDING_REGISTERS;
+        fc = quantity == 1 ? FC_WRITE_SINGLE_REGISTER : FC_WRITE_HOLDING_REGISTERS;
         break;
     }
-    if (fc != 0)
-        return handle_write_request(self, slave_id, fc, addr, quantity, regs, timeout);
-    else
+    return fc;
+}
+
+int mb_read_register(modbus_device_t *self, uint8_t slave_id, uint8_t reg_type, uint16_t addr, uint16_t quantity,
+                     uint16_t *regs, int32_t timeout)
+{
+    uint32_t max_age_ms = self->cache ? modbus_cache_ttl(self->cache, slave_id, reg_type, addr, quantity) : 0;
+    return mb_read_register_cached(self, slave_id, reg_type, addr, quantity, regs, max_age_ms, timeout);
+}
+
+int mb_read_register_cached(modbus_device_t *self, uint8_t slave_id, uint8_t reg_type, uint16_t addr,
+                            uint16_t quantity, uint16_t *regs, uint32_t max_age_ms, int32_t timeout)
+{
+    uint8_t fc = mb_read_function(reg_type);
+    if (fc == 0)
         return DEVICE_E_INVALID;
+
+    if (self->cache && modbus_cache_lookup(self->cache, self, slave_id, reg_type, addr, quantity, regs, max_age_ms))
+        return DEVICE_OK;
+
+    int err = session_ready(self);
+    if (err)
+        return err;
+    err = session_result(self, handle_read_request(self, slave_id, fc, addr, quantity, regs, timeout));
+    if (err == DEVICE_OK && self->cache)
+        modbus_cache_store(self->cache, self, slave_id, reg_type, addr, quantity, regs);
+    return err;
+}
+
+int mb_read_register_raw(modbus_device_t *self, uint8_t slave_id, uint8_t reg_type, uint16_t addr,
+                         uint16_t quantity, const uint8_t **data, int32_t timeout)
+{
+    uint8_t fc = mb_read_function(reg_type);
+    if (fc == 0)
+        return DEVICE_E_INVALID;
+
+    int err = session_ready(self);
+    if (err)
+        return err;
+    return session_result(self, handle_read_raw(self, slave_id, fc, addr, quantity, data, timeout));
+}
+
+int mb_read_bits(modbus_device_t *self, uint8_t slave_id, uint8_t reg_type, uint16_t addr, uint16_t quantity,
+                 uint8_t *bits, int32_t timeout)
+{
+    if ((reg_type != COIL && reg_type != DISCRETE_INPUT) || quantity == 0 || quantity > MODBUS_MAX_COIL_PER_READ)
+        return DEVICE_E_INVALID;
+
+    // always from the bus like mb_read_register_raw, the cache keeps a
+    // uint16_t per coil and would have to be expanded and packed again
+    int nbytes = (quantity + 7) / 8;
+    const uint8_t *data;
+    int err = mb_read_register_raw(self, slave_id, reg_type, addr, quantity, &data, timeout);
+    if (err)
+        return err;
+    memcpy(bits, data, (size_t)nbytes);
+    if (quantity % 8)
+        bits[nbytes - 1] &= (uint8_t)((1 << (quantity % 8)) - 1);
+    return DEVICE_OK;
+}
+
+int mb_write_bits(modbus_device_t *self, uint8_t slave_id, uint16_t addr, uint16_t quantity, const uint8_t *bits,
+                  int32_t timeout)
+{
+    if (quantity == 0 || quantity > MODBUS_MAX_COIL_PER_WRITE)
+        return DEVICE_E_INVALID;
+
+    // even a failed write may have reached the slave, forget the old values
+    if (self->cache)
+        modbus_cache_invalidate(self->cache, self, slave_id, COIL, addr, quantity);
+
+    int err = session_ready(self);
+    if (err)
+        return err;
+
+    modbus_adu_t adu;
+    int len_req = mb_encode_write_bits_request(MODBUS_ADU_PDU(&adu), addr, quantity, bits);
+    return session_result(self, handle_request(self, slave_id, &adu, len_req, NULL, timeout));
+}
+
+int mb_write_register(modbus_device_t *self, uint8_t slave_id, uint8_t reg_type, uint16_t addr, uint16_t quantity,
+                      uint16_t *regs, int32_t timeout)
+{
+    uint8_t fc = mb_write_function(reg_type, quantity);
+    if (fc == 0)
+        return DEVICE_E_INVALID;
+
+    // even a failed write may have reached the slave, forget the old values
+    if (self->cache)
+        modbus_cache_invalidate(self->cache, self, slave_id, reg_type, addr, quantity);
+
+    int err = session_ready(self);
+    if (err)
+        return err;
+    return session_result(self, handle_write_request(self, slave_id, fc, addr, quantity, regs, timeout));
+}
+
+int mb_write_single_coil(modbus_device_t *self, uint8_t slave_id, uint16_t addr, bool on, int32_t timeout)
+{
+    uint16_t value = on ? 1 : 0;
+    return mb_write_register(self, slave_id, COIL, addr, 1, &value, timeout);
+}
+
+int mb_write_single_register(modbus_device_t *self, uint8_t slave_id, uint16_t addr, uint16_t value, int32_t timeout)
+{
+    return mb_write_register(self, slave_id, HOLDING_REGISTER, addr, 1, &value, timeout);
+}
+
+int mb_mask_write_register(modbus_device_t *self, uint8_t slave_id, uint16_t addr, uint16_t and_mask,
+                           uint16_t or_mask, int32_t timeout)
+{
+    if (self->cache)
+        modbus_cache_invalidate(self->cache, self, slave_id, HOLDING_REGISTER, addr, 1);
+
+    int err = session_ready(self);
+    if (err)
+        return err;
+
+    modbus_adu_t adu;
+    int len_req = mb_encode_mask_write_request(MODBUS_ADU_PDU(&adu), addr, and_mask, or_mask);
+    return session_result(self, handle_request(self, slave_id, &adu, len_req, NULL, timeout));
+}
+
+int mb_read_write_registers(modbus_device_t *self, uint8_t slave_id, uint16_t read_addr, uint16_t read_quantity,
+                            uint16_t *read_regs, uint16_t write_addr, uint16_t write_quantity,
+                            const uint16_t *write_regs, int32_t timeout)
+{
+    if (read_quantity == 0 || read_quantity > MODBUS_MAX_HOLDING_PER_READ || write_quantity == 0 ||
+        write_quantity > MODBUS_MAX_HOLDING_PER_READ_WRITE)
+        return DEVICE_E_INVALID;
+
+    if (self->cache)
+        modbus_cache_invalidate(self->cache, self, slave_id, HOLDING_REGISTER, write_addr, write_quantity);
+
+    int err = session_ready(self);
+    if (err)
+        return err;
+
+    modbus_adu_t adu;
+    int len_req = mb_encode_read_write_request(MODBUS_ADU_PDU(&adu), read_addr, read_quantity, write_addr,
+                                               write_quantity, write_regs);
+    err = session_result(self, handle_request(self, slave_id, &adu, len_req, read_regs, timeout));
+    // the slave writes before it reads, the values read are current
+    if (err == DEVICE_OK && self->cache)
+        modbus_cache_store(self->cache, self, slave_id, HOLDING_REGISTER, read_addr, read_quantity, read_regs);
+    return err;
+}
+
+
+int mb_read_submit(modbus_device_t *self, uint8_t slave_id, uint8_t reg_type, uint16_t addr, uint16_t quantity,
+                   uint16_t *tid, int32_t timeout)
+{
+    uint8_t fc = mb_read_function(reg_type);
+    if (fc == 0 || !self->tcp)
+        return DEVICE_E_INVALID;
+
+    int err = session_ready(self);
+    if (err)
+        return err;
+
+    modbus_adu_t adu;
+    int len_req = mb_encode_read_request(MODBUS_ADU_PDU(&adu), fc, addr, quantity);
+    err = modbus_tcp_send_adu(self->tcp, slave_id, &adu, len_req, tid, timeout);
+    if (err && err != DEVICE_E_BUSY)
+        session_result(self, err);
+    return err;
+}
+
+int mb_read_complete(modbus_device_t *self, int *tid, uint16_t *regs, int32_t timeout)
+{
+    *tid = -1;
+    if (!self->tcp)
+        return DEVICE_E_INVALID;
+
+    uint16_t rsp_tid;
+    const uint8_t *request, *response;
+    int len_rsp;
+    int err = modbus_tcp_recv_pdu(self->tcp, &rsp_tid, &request, &response, &len_rsp, timeout);
+    if (err) {
+        // reads in flight are lost with the link or overtaken by the timeout
+        for (int i = 0; i < MODBUS_TCP_MAX_INFLIGHT; i++) {
+            modbus_tcp_inflight_t *inflight = &self->tcp->inflight[i];
+            if (inflight->used)
+                modbus_record_transaction(self, inflight->unit_id, inflight->request[0], err, NULL);
+        }
+        modbus_tcp_cancel(self->tcp);
+        return session_result(self, err);
+    }
+
+    *tid = rsp_tid;
+    modbus_timing_t timing = {0, 0, timer_monotonic_us() - self->tcp->rx_request.sent_us};
+    err = session_result(self, mb_parse_read_response(request, response, len_rsp, regs));
+    modbus_record_transaction(self, self->tcp->rx_request.unit_id, request[0], err, &timing);
+    if (err == DEVICE_OK && self->cache)
+        modbus_cache_store(self->cache, self, self->tcp->rx_request.unit_id, mb_read_type(request[0]),
+                           (uint16_t)((request[1] << 8) + request[2]), (uint16_t)((request[3] << 8) + request[4]),
+                           regs);
+    return err;
+}
+
+
+void modbus_record_transaction(modbus_device_t *self, uint8_t slave_id, uint8_t function_code, int result,
+                               const modbus_timing_t *timing)
+{
+    modbus_slave_metrics_t *slave = NULL;
+    if (slave_id <= MB_METRICS_MAX_SLAVE) {
+        slave = self->slave_metrics[slave_id];
+        if (!slave)
+            slave = self->slave_metrics[slave_id] = (modbus_slave_metrics_t *)calloc(1, sizeof(*slave));
+    }
+    modbus_metrics_record(&self->metrics, slave, function_code, result, timing);
+}
+
+int modbus_session_result(modbus_device_t *self, int result)
+{
+    return session_result(self, result);
+}
+
+int modbus_session_ready(modbus_device_t *self)
+{
+    return session_ready(self);
+}
+
+void modbus_get_metrics(const modbus_device_t *self, modbus_metrics_t *metrics)
+{
+    *metrics = self->metrics;
+    if (self->rtu) {
+        metrics->crc_errors = self->rtu->crc_errors;
+        metrics->garbage_bytes = self->rtu->garbage_bytes;
+    }
+}
+
+int modbus_get_slave_metrics(const modbus_device_t *self, uint8_t slave_id, modbus_slave_metrics_t *metrics)
+{
+    if (slave_id > MB_METRICS_MAX_SLAVE || !self->slave_metrics[slave_id]) {
+        memset(metrics, 0, sizeof(*metrics));
+        return DEVICE_E_INVALID;
+    }
+    *metrics = *self->slave_metrics[slave_id];
+    return DEVICE_OK;
+}
+
+void modbus_reset_metrics(modbus_device_t *self)
+{
+    memset(&self->metrics, 0, sizeof(self->metrics));
+    for (int i = 0; i <= MB_METRICS_MAX_SLAVE; i++) {
+        free(self->slave_metrics[i]);
+        self->slave_metrics[i] = NULL;
+    }
+    if (self->rtu) {
+        self->rtu->crc_errors = 0;
+        self->rtu->garbage_bytes = 0;
+    }
+}
+
+void modbus_print_metrics(const modbus_device_t *self)
+{
+    modbus_metrics_t metrics;
+    modbus_get_metrics(self, &metrics);
+    modbus_metrics_print(&metrics);
+
+    Log_Debug("slave  transactions  errors  p50(ms)  p99(ms)  max(ms)\n");
+    for (int i = 0; i <= MB_METRICS_MAX_SLAVE; i++) {
+        const modbus_slave_metrics_t *slave = self->slave_metrics[i];
+        if (!slave)
+            continue;
+        Log_Debug("%-6d %-13u %-7u %-8.2f %-8.2f %.2f\n", i, slave->transactions,
+                  slave->transactions - slave->by_result[DEVICE_OK], mb_histogram_percentile(&slave->frame, 50) / 1e3,
+                  mb_histogram_percentile(&slave->frame, 99) / 1e3, slave->frame.max_us / 1e3);
+    }
 }
 
 
 int modbus_open(modbus_device_t *self, uint32_t slave_id, int timeout_ms)
 {
-    return modbus_rtu_open(self->rtu);
+    self->backoff_ms = self->backoff_min_ms;
+    int err = device_open(self);
+    if (err) {
+        // keep the session, mb_read_register/mb_write_register retry later
+        session_backoff(self);
+        return err;
+    }
+
+    self->health.state = MB_SESSION_ONLINE;
+    return DEVICE_OK;
 }
 
 
 int modbus_close(modbus_device_t *self)
 {
-    return modbus_rtu_close(self->rtu);
+    self->health.state = MB_SESSION_CLOSED;
+    return device_close(self);
+}
+
+
+void modbus_set_cache(modbus_device_t *self, struct modbus_cache_t *cache)
+{
+    if (self->cache && self->cache != cache)
+        modbus_cache_clear(self->cache, self);
+    self->cache = cache;
+}
+
+
+void modbus_set_reconnect(modbus_device_t *self, uint32_t min_ms, uint32_t max_ms)
+{
+    self->backoff_min_ms = min_ms;
+    self->backoff_max_ms = max_ms < min_ms ? min_ms : max_ms;
+    self->backoff_ms = min_ms;
+}
+
+
+const modbus_health_t *modbus_get_health(const modbus_device_t *self)
+{
+    return &self->health;
 }
 
 
 void modbus_destroy_device(modbus_device_t *device)
 {
     if (device) {
+        // the device address could come back as a new device, keep it out of the cache
+        if (device->cache)
+            modbus_cache_clear(device->cache, device);
+        for (int i = 0; i <= MB_METRICS_MAX_SLAVE; i++)
+            free(device->slave_metrics[i]);
         if (device->rtu) {
             modbus_rtu_destroy(device->rtu);
         }
+        if (device->tcp) {
+            modbus_tcp_destroy(device->tcp);
+        }
         free(device);
     }
 }
 
 
-modbus_device_t *modbus_create_device(int uart, unsigned int baud_rate)
+static modbus_device_t *create_device(modbus_rtu_t *rtu)
 {
-    modbus_device_t *device = (modbus_device_t *)calloc(1, sizeof(modbus_device_t));
-
-    device->rtu = modbus_rtu_create(uart, baud_rate);
-    if (!device->rtu) {
+    if (!rtu) {
         Log_Debug("Failed to create RTU\n");
-        modbus_destroy_device(device);
         return NULL;
     }
 
+    modbus_device_t *device = (modbus_device_t *)calloc(1, sizeof(modbus_device_t));
+    device->rtu = rtu;
+    modbus_set_reconnect(device, MODBUS_RECONNECT_MIN_MS, MODBUS_RECONNECT_MAX_MS);
+    return device;
+}
+
+
+modbus_device_t *modbus_create_device(int uart, unsigned int baud_rate)
+{
+    return create_device(modbus_rtu_create(uart, baud_rate));
+}
+
+
+modbus_device_t *modbus_create_device_tty(const char *path, unsigned int baud_rate)
+{
+    return create_device(modbus_rtu_create_tty(path, baud_rate));
+}
+
+
+modbus_device_t *modbus_create_device_tcp(const char *host, uint16_t port)
+{
+    modbus_tcp_t *tcp = modbus_tcp_create(host, port);
+    if (!tcp)
+        return NULL;
+
+    modbus_device_t *device = (modbus_device_t *)calloc(1, sizeof(modbus_device_t));
+    device->tcp = tcp;
+    modbus_set_reconnect(device, MODBUS_RECONNECT_MIN_MS, MODBUS_RECONNECT_MAX_MS);
     return device;
 }
\ No newline at end of file
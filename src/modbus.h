@@ -1,5 +1,6 @@
 #pragma once
 #include "modbus_rtu.h"
+#include "modbus_tcp.h"
 #include <stdint.h>
 
 
@@ -35,24 +36,140 @@ enum {
 #define MODBUS_MAX_HOLDING_PER_READ 0x7D
 #define MODBUS_MAX_COIL_PER_WRITE 0x7B0
 #define MODBUS_MAX_HOLDING_PER_WRITE 0x7B
+#define MODBUS_MAX_HOLDING_PER_READ_WRITE 0x79 // written by FC_READ_WRITE_REGISTERS
 
 
+// reopen backoff after the link broke, doubled on each failed attempt
+#define MODBUS_RECONNECT_MIN_MS 500
+#define MODBUS_RECONNECT_MAX_MS 30000
+
+// session state, a device is created and opened once and reopened lazily by
+// mb_read_register/mb_write_register after DEVICE_E_BROKEN or DEVICE_E_IO
+enum { MB_SESSION_CLOSED = 0, MB_SESSION_ONLINE = 1, MB_SESSION_BACKOFF = 2 };
+
+typedef struct modbus_health_t {
+    uint8_t state;
+    int last_error;              // last DEVICE_E_* seen, DEVICE_OK if none
+    uint32_t consecutive_errors; // failed transactions since the last success
+    uint32_t transactions;
+    uint32_t errors;
+    uint32_t reopens;            // successful reopens after a broken link
+    uint32_t reopen_failures;
+} modbus_health_t;
+
+struct mb_bus_t;
+struct modbus_cache_t;
+
 typedef struct modbus_device_t modbus_device_t;
 struct modbus_device_t {
-    modbus_rtu_t *rtu;
+    modbus_rtu_t *rtu; // exactly one of rtu and tcp is set
+    modbus_tcp_t *tcp;
+    struct mb_bus_t *bus; // set while attached to an async loop, see modbus_async.h
+    struct modbus_cache_t *cache; // register cache shared with other devices, see modbus_cache.h
+
+    modbus_health_t health;
+    uint32_t backoff_min_ms;
+    uint32_t backoff_max_ms;
+    uint32_t backoff_ms;   // delay before the next reopen attempt
+    uint64_t reopen_at_us; // monotonic time the next reopen may be tried
+
+    modbus_metrics_t metrics;
+    modbus_slave_metrics_t *slave_metrics[MB_METRICS_MAX_SLAVE + 1]; // allocated on first use
 };
 
 
 struct modbus_device_t *modbus_create_device(int uart, unsigned int baud_rate);
 
+// create a device on a posix tty, /dev/ttyS*, /dev/ttyUSB* or a pty
+struct modbus_device_t *modbus_create_device_tty(const char *path, unsigned int baud_rate);
+
+// create a modbus tcp device, host is an ipv4 address
+struct modbus_device_t *modbus_create_device_tcp(const char *host, uint16_t port);
+
 int modbus_open(struct modbus_device_t *self, uint32_t slave_id, int timeout_ms);
 
 int modbus_close(struct modbus_device_t *self);
 
+// reopen backoff, defaults to MODBUS_RECONNECT_MIN_MS..MODBUS_RECONNECT_MAX_MS
+void modbus_set_reconnect(struct modbus_device_t *self, uint32_t min_ms, uint32_t max_ms);
+
+// serve reads from a register cache and keep it up to date, NULL to stop.
+// The cache isn't owned by the device and may be shared by several.
+void modbus_set_cache(struct modbus_device_t *self, struct modbus_cache_t *cache);
+
+const modbus_health_t *modbus_get_health(const struct modbus_device_t *self);
+
+// copy of the device metrics including the link counters of the transport,
+// cheap enough to poll
+void modbus_get_metrics(const struct modbus_device_t *self, modbus_metrics_t *metrics);
+// metrics of one slave, DEVICE_E_INVALID if there were no transactions with it
+int modbus_get_slave_metrics(const struct modbus_device_t *self, uint8_t slave_id, modbus_slave_metrics_t *metrics);
+void modbus_reset_metrics(struct modbus_device_t *self);
+void modbus_print_metrics(const struct modbus_device_t *self);
+// count a finished transaction, for transaction engines outside modbus.c
+void modbus_record_transaction(struct modbus_device_t *self, uint8_t slave_id, uint8_t function_code, int result,
+                               const modbus_timing_t *timing);
+// session of a device driven by another transaction engine: report the
+// result of a transaction, DEVICE_E_BROKEN/DEVICE_E_IO close the link and
+// start the backoff. Ready reopens the link once the backoff is over,
+// DEVICE_E_BROKEN until then.
+int modbus_session_result(struct modbus_device_t *self, int result);
+int modbus_session_ready(struct modbus_device_t *self);
+
 void modbus_destroy_device(struct modbus_device_t *self);
 
 int mb_read_register(struct modbus_device_t *self, uint8_t slave_id, uint8_t reg_type, uint16_t addr, uint16_t quantity,
                      uint16_t *buf, int32_t timeout_ms);
 
+// read values no older than max_age_ms from the cache, if the device has one,
+// otherwise from the bus. mb_read_register allows the cache ttl of the range.
+int mb_read_register_cached(struct modbus_device_t *self, uint8_t slave_id, uint8_t reg_type, uint16_t addr,
+                            uint16_t quantity, uint16_t *buf, uint32_t max_age_ms, int32_t timeout_ms);
+
+// read without decoding or cache, *data points to the response payload in the
+// receive buffer, valid until the next request on the device: big endian
+// registers, or coils packed 8 per byte, lowest address in bit 0.
+// Typed values are decoded from it by mb_read_values, see modbus_value.h.
+int mb_read_register_raw(struct modbus_device_t *self, uint8_t slave_id, uint8_t reg_type, uint16_t addr,
+                         uint16_t quantity, const uint8_t **data, int32_t timeout_ms);
+
+// coils or discrete inputs as a bitmap of (quantity + 7) / 8 bytes, lowest
+// address in bit 0 of bits[0], without expanding each to a uint16_t. Reads
+// go to the bus even with a register cache, like mb_read_register_raw.
+// mb_write_bits writes coils from such a bitmap, one coil with FC 0x05.
+int mb_read_bits(struct modbus_device_t *self, uint8_t slave_id, uint8_t reg_type, uint16_t addr, uint16_t quantity,
+                 uint8_t *bits, int32_t timeout_ms);
+int mb_write_bits(struct modbus_device_t *self, uint8_t slave_id, uint16_t addr, uint16_t quantity,
+                  const uint8_t *bits, int32_t timeout_ms);
+
+// a single coil or register is written with FC 0x05/0x06, more with 0x0F/0x10.
+// Writes to MODBUS_BROADCAST_ID on rtu reach every slave and return once sent,
+// without response. The next request waits for the turnaround delay, see
+// modbus_rtu_set_turnaround.
 int mb_write_register(struct modbus_device_t *self, uint8_t slave_id, uint8_t reg_type, uint16_t addr, uint16_t quantity,
                       uint16_t *buf, int32_t timeout_ms);
+
+int mb_write_single_coil(struct modbus_device_t *self, uint8_t slave_id, uint16_t addr, bool on, int32_t timeout_ms);
+int mb_write_single_register(struct modbus_device_t *self, uint8_t slave_id, uint16_t addr, uint16_t value,
+                             int32_t timeout_ms);
+
+// change bits of a holding register in one round trip instead of a read and
+// a write: value = (value & and_mask) | (or_mask & ~and_mask)
+int mb_mask_write_register(struct modbus_device_t *self, uint8_t slave_id, uint16_t addr, uint16_t and_mask,
+                           uint16_t or_mask, int32_t timeout_ms);
+
+// write write_quantity holding registers, then read read_quantity, in one
+// round trip (FC 0x17)
+int mb_read_write_registers(struct modbus_device_t *self, uint8_t slave_id, uint16_t read_addr,
+                            uint16_t read_quantity, uint16_t *read_regs, uint16_t write_addr,
+                            uint16_t write_quantity, const uint16_t *write_regs, int32_t timeout_ms);
+
+// Pipelined reads on tcp devices, keeping up to MODBUS_TCP_MAX_INFLIGHT reads
+// in flight on the connection. Submit sends a read and sets its transaction
+// id, DEVICE_E_BUSY means the window is full and a read must complete first.
+// Complete waits for the next response of any read in flight, *tid tells
+// which. When no response arrives, e.g. timeout or broken link, *tid is -1 and
+// all reads in flight are dropped. rtu devices return DEVICE_E_INVALID.
+int mb_read_submit(struct modbus_device_t *self, uint8_t slave_id, uint8_t reg_type, uint16_t addr,
+                   uint16_t quantity, uint16_t *tid, int32_t timeout_ms);
+int mb_read_complete(struct modbus_device_t *self, int *tid, uint16_t *regs, int32_t timeout_ms);
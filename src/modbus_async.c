@@ -0,0 +1,754 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "modbus_async.h"
+#include "modbus_cache.h"
+#include "modbus_pdu.h"
+#include "modbus_trace.h"
+#include "utils.h"
+
+enum { SRC_UART, SRC_BUS_TIMER, SRC_TIMER, SRC_FD };
+
+enum { TXN_READ, TXN_WRITE, TXN_RAW };
+
+enum {
+    BUS_IDLE,      // nothing in flight
+    BUS_GAP,       // waiting for t3.5 silence before sending
+    BUS_SENDING,   // writing the adu, waiting for EPOLLOUT while the uart is full
+    BUS_DRAIN,     // adu written, waiting for it to leave the wire
+    BUS_RECEIVING, // waiting for response or timeout
+    BUS_BROKEN,    // uart hung up and closed, reopened by the next submit
+};
+
+// epoll_event.data.ptr of every fd registered in the loop
+typedef struct mb_source_t {
+    int type;
+    void *owner;
+} mb_source_t;
+
+typedef struct mb_txn_t {
+    uint8_t slave_id;
+    uint8_t kind; // TXN_*
+    modbus_adu_t adu; // encoded and sealed at submit, ready to go on the wire
+    int len_req;
+    int adu_len;
+    uint16_t *regs;
+    int32_t timeout_ms;
+    mb_callback_t cb;
+    mb_pdu_callback_t pdu_cb; // TXN_RAW
+    void *ctx;
+} mb_txn_t;
+
+struct mb_bus_t {
+    mb_loop_t *loop;
+    modbus_device_t *device;
+    mb_source_t uart_src;
+    mb_source_t timer_src;
+    int timer_fd;
+    uint32_t uart_events;
+
+    mb_txn_t queue[MB_ASYNC_QUEUE_SIZE];
+    int head;
+    int count;
+
+    int state;
+    uint8_t *adu; // adu of the transaction at the head of the queue
+    int adu_len;
+    int written;
+    uint64_t deadline_us;
+
+    // response of the completed transaction, copied out of the uart receive
+    // buffer so the next request can go out before it is parsed
+    uint8_t rx_frame[MODBUS_RTU_MAX_ADU_SIZE];
+
+    mb_bus_t *next;
+};
+
+struct mb_timer_t {
+    mb_source_t src;
+    int fd;
+    mb_timer_callback_t cb;
+    void *ctx;
+    mb_timer_t *next;
+};
+
+struct mb_watch_t {
+    mb_source_t src;
+    int fd;
+    mb_fd_callback_t cb; // NULL once removed
+    void *ctx;
+    mb_watch_t *next;
+};
+
+struct mb_loop_t {
+    int epoll_fd;
+    mb_bus_t *buses;
+    mb_timer_t *timers;
+    mb_watch_t *removed; // watches removed during dispatch, freed after it
+};
+
+
+static void bus_kick(mb_bus_t *bus);
+static void bus_break(mb_bus_t *bus, int err);
+
+static int loop_add_fd(mb_loop_t *loop, int fd, uint32_t events, mb_source_t *src)
+{
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = src;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void bus_arm_timer(mb_bus_t *bus, uint64_t at_us)
+{
+    struct itimerspec its = {{0, 0}, {0, 0}};
+    // an absolute time of 0 would disarm the timer
+    if (at_us == 0)
+        at_us = 1;
+    its.it_value.tv_sec = (time_t)(at_us / 1000000);
+    its.it_value.tv_nsec = (long)(at_us % 1000000) * 1000;
+    timerfd_settime(bus->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void bus_disarm_timer(mb_bus_t *bus)
+{
+    struct itimerspec its = {{0, 0}, {0, 0}};
+    timerfd_settime(bus->timer_fd, 0, &its, NULL);
+}
+
+static void bus_watch_uart(mb_bus_t *bus, uint32_t events)
+{
+    if (bus->uart_events == events)
+        return;
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = &bus->uart_src;
+    epoll_ctl(bus->loop->epoll_fd, EPOLL_CTL_MOD, bus->device->rtu->uart_fd, &ev);
+    bus->uart_events = events;
+}
+
+// keep the device's register cache in step with the transactions of the loop
+static void bus_update_cache(mb_bus_t *bus, mb_txn_t *txn, const uint8_t *request, int result)
+{
+    uint16_t addr, quantity;
+    if (txn->kind == TXN_READ && result == DEVICE_OK) {
+        addr = (uint16_t)((request[1] << 8) + request[2]);
+        quantity = (uint16_t)((request[3] << 8) + request[4]);
+        modbus_cache_store(bus->device->cache, bus->device, txn->slave_id, mb_read_type(request[0]), addr, quantity,
+                           txn->regs);
+    } else if (txn->kind != TXN_READ) {
+        // raw requests forwarded by the gateway may be writes too, any other
+        // function has no range. A broadcast, slave id 0, invalidates the
+        // range of every slave.
+        uint8_t reg_type = mb_write_range(request, &addr, &quantity);
+        modbus_cache_invalidate(bus->device->cache, bus->device, txn->slave_id, reg_type, addr, quantity);
+    }
+}
+
+static void bus_complete(mb_bus_t *bus, int result, uint8_t *frame, int frame_len)
+{
+    // the next request may fail and complete everything queued, and
+    // callbacks submit into the freed slot, keep a copy of this one
+    mb_txn_t txn = bus->queue[bus->head];
+    bus->head = (bus->head + 1) % MB_ASYNC_QUEUE_SIZE;
+    bus->count--;
+    bus->state = BUS_IDLE;
+    bus_disarm_timer(bus);
+    bus_watch_uart(bus, 0);
+
+    // start the next request, already sealed, before anything else so the bus
+    // only idles for the t3.5 gap. Checking and parsing this response overlap
+    // with that gap, the trace is only a copy. A broadcast completes without
+    // frame.
+    modbus_timing_t timing = {0, 0, 0};
+    bool response = result == DEVICE_OK && frame;
+    if (result == DEVICE_OK)
+        modbus_rtu_get_timing(bus->device->rtu, &timing);
+    if (response) {
+        memcpy(bus->rx_frame, frame, (size_t)frame_len);
+        frame = bus->rx_frame;
+        mb_trace_frame(MB_TRACE_RX, bus->device->rtu->uart_fd, frame, frame_len);
+    }
+    bus_kick(bus);
+
+    const uint8_t *request = MODBUS_ADU_PDU(&txn.adu);
+    if (response) {
+        result = modbus_rtu_check_frame(bus->device->rtu, txn.slave_id, frame, frame_len);
+        response = result == DEVICE_OK;
+    }
+    if (txn.kind == TXN_RAW) {
+        modbus_record_transaction(bus->device, txn.slave_id, request[0], result, &timing);
+        if (bus->device->cache)
+            bus_update_cache(bus, &txn, request, result);
+        // 1 byte slave_id + pdu + 2 bytes crc
+        if (txn.pdu_cb)
+            txn.pdu_cb(bus->device, result, response ? frame + 1 : NULL, response ? frame_len - 3 : 0, txn.ctx);
+        return;
+    }
+    if (response) {
+        result = txn.kind == TXN_WRITE ? mb_parse_write_response(request, frame + 1, frame_len - 3)
+                                       : mb_parse_read_response(request, frame + 1, frame_len - 3, txn.regs);
+    }
+    modbus_record_transaction(bus->device, txn.slave_id, request[0], result, &timing);
+    if (bus->device->cache)
+        bus_update_cache(bus, &txn, request, result);
+
+    if (txn.cb)
+        txn.cb(bus->device, result, txn.ctx);
+}
+
+static void bus_start_receive(mb_bus_t *bus)
+{
+    modbus_rtu_tx_release(bus->device->rtu);
+    bus->state = BUS_RECEIVING;
+    bus_watch_uart(bus, EPOLLIN);
+    bus_arm_timer(bus, bus->deadline_us);
+}
+
+// the request left the wire, wait for its response. A broadcast gets none
+// and completes right away, the next request waits for the turnaround delay.
+static void bus_sent(mb_bus_t *bus)
+{
+    if (bus->queue[bus->head].slave_id != MODBUS_BROADCAST_ID) {
+        bus_start_receive(bus);
+        return;
+    }
+
+    modbus_rtu_tx_release(bus->device->rtu);
+    modbus_rtu_broadcast_sent(bus->device->rtu);
+    bus_complete(bus, DEVICE_OK, NULL, 0);
+}
+
+static void bus_write(mb_bus_t *bus)
+{
+    modbus_rtu_t *rtu = bus->device->rtu;
+
+    while (bus->written < bus->adu_len) {
+        ssize_t nwrite = write(rtu->uart_fd, bus->adu + bus->written, (size_t)(bus->adu_len - bus->written));
+        if (nwrite < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                bus_watch_uart(bus, EPOLLOUT);
+                bus_arm_timer(bus, bus->deadline_us);
+                return;
+            }
+            // completing would kick the next request into the same error,
+            // fail the queue at once and leave the uart to the session
+            Log_Debug("uart write error:%s\n", strerror(errno));
+            modbus_rtu_tx_done(rtu, bus->written);
+            bus_break(bus, DEVICE_E_IO);
+            return;
+        }
+        bus->written += (int)nwrite;
+    }
+
+    modbus_rtu_tx_done(rtu, bus->written);
+    mb_trace_frame(MB_TRACE_TX, rtu->uart_fd, bus->adu, bus->adu_len);
+
+#ifdef TX_ENABLE
+    // keep the transmitter on until the last byte left the wire
+    bus->state = BUS_DRAIN;
+    bus_watch_uart(bus, 0);
+    bus_arm_timer(bus, modbus_rtu_tx_drained_at(rtu));
+#else
+    bus_sent(bus);
+#endif
+}
+
+static void bus_send(mb_bus_t *bus)
+{
+    modbus_rtu_t *rtu = bus->device->rtu;
+    modbus_rtu_discard_input(rtu);
+    modbus_rtu_tx_begin(rtu);
+    bus->state = BUS_SENDING;
+    bus->written = 0;
+    bus_write(bus);
+}
+
+// start the transaction at the head of the queue if the bus is idle
+static void bus_kick(mb_bus_t *bus)
+{
+    if (bus->state != BUS_IDLE || bus->count == 0)
+        return;
+
+    mb_txn_t *txn = &bus->queue[bus->head];
+    modbus_rtu_t *rtu = bus->device->rtu;
+    bus->adu = MODBUS_ADU_RTU(&txn->adu);
+    bus->adu_len = txn->adu_len;
+
+    uint64_t now = timer_monotonic_us();
+    bus->deadline_us = now + (uint64_t)txn->timeout_ms * 1000;
+
+    uint64_t ready_at = modbus_rtu_ready_at(rtu);
+    if (ready_at > now) {
+        bus->state = BUS_GAP;
+        bus_arm_timer(bus, ready_at);
+    } else {
+        bus_send(bus);
+    }
+}
+
+static void bus_receive(mb_bus_t *bus, bool silent)
+{
+    modbus_rtu_t *rtu = bus->device->rtu;
+    uint8_t *frame = NULL;
+    int frame_len = 0;
+
+    int err = modbus_rtu_rx_frame(rtu, silent, &frame, &frame_len);
+    if (err != DEVICE_OK || frame_len > 0) {
+        bus_complete(bus, err, frame, frame_len);
+        return;
+    }
+
+    // frame started, wake up on t3.5 silence or the deadline, which comes first
+    uint64_t at_us = bus->deadline_us;
+    if (rtu->rx_len > 0 && modbus_rtu_ready_at(rtu) < at_us)
+        at_us = modbus_rtu_ready_at(rtu);
+    bus_arm_timer(bus, at_us);
+}
+
+// the uart hung up, epoll would report it again on every wait even with no
+// events watched. Take the uart out of the loop and fail everything queued,
+// the session closes it and the first submit after the backoff reopens it.
+static void bus_break(mb_bus_t *bus, int err)
+{
+    modbus_device_t *device = bus->device;
+    Log_Debug("uart connection broken\n");
+
+    epoll_ctl(bus->loop->epoll_fd, EPOLL_CTL_DEL, device->rtu->uart_fd, NULL);
+    bus->uart_events = 0;
+    bus_disarm_timer(bus);
+    if (bus->state == BUS_SENDING || bus->state == BUS_DRAIN)
+        modbus_rtu_tx_release(device->rtu);
+    bool inflight = bus->state != BUS_IDLE && bus->state != BUS_GAP;
+    bus->state = BUS_BROKEN;
+    modbus_session_result(device, err);
+
+    // submits from the callbacks find the bus broken and fail, only the
+    // transactions queued now are completed
+    for (int n = bus->count; n > 0; n--) {
+        mb_txn_t txn = bus->queue[bus->head];
+        bus->head = (bus->head + 1) % MB_ASYNC_QUEUE_SIZE;
+        bus->count--;
+        if (inflight) {
+            modbus_record_transaction(device, txn.slave_id, MODBUS_ADU_PDU(&txn.adu)[0], err, NULL);
+            inflight = false;
+        }
+        if (txn.kind == TXN_RAW && txn.pdu_cb)
+            txn.pdu_cb(device, err, NULL, 0, txn.ctx);
+        else if (txn.kind != TXN_RAW && txn.cb)
+            txn.cb(device, err, txn.ctx);
+    }
+}
+
+static void bus_on_uart(mb_bus_t *bus, uint32_t events)
+{
+    if (events & (EPOLLHUP | EPOLLERR)) {
+        bus_break(bus, (events & EPOLLHUP) ? DEVICE_E_BROKEN : DEVICE_E_IO);
+        return;
+    }
+
+    if (bus->state == BUS_SENDING && (events & EPOLLOUT)) {
+        bus_write(bus);
+    } else if (bus->state == BUS_RECEIVING && (events & EPOLLIN)) {
+        int err = modbus_rtu_rx_read(bus->device->rtu);
+        if (err != DEVICE_OK) {
+            bus_break(bus, err);
+            return;
+        }
+        bus_receive(bus, false);
+    }
+}
+
+static void bus_on_timer(mb_bus_t *bus)
+{
+    uint64_t expirations;
+    if (read(bus->timer_fd, &expirations, sizeof(expirations)) < 0)
+        return;
+
+    uint64_t now = timer_monotonic_us();
+    modbus_rtu_t *rtu = bus->device->rtu;
+
+    switch (bus->state) {
+    case BUS_GAP:
+        bus_send(bus);
+        break;
+    case BUS_DRAIN:
+        bus_sent(bus);
+        break;
+    case BUS_SENDING:
+        Log_Debug("uart sending timeout\n");
+        modbus_rtu_tx_done(rtu, bus->written);
+        modbus_rtu_tx_release(rtu);
+        bus_complete(bus, DEVICE_E_TIMEOUT, NULL, 0);
+        break;
+    case BUS_RECEIVING:
+        if (rtu->rx_len > 0 && now >= modbus_rtu_ready_at(rtu)) {
+            bus_receive(bus, true);
+        } else if (now >= bus->deadline_us) {
+            Log_Debug("uart receiving timeout\n");
+            bus_complete(bus, DEVICE_E_TIMEOUT, NULL, 0);
+        } else {
+            bus_receive(bus, false);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static int bus_submit(modbus_device_t *device, mb_txn_t **ptxn)
+{
+    mb_bus_t *bus = device->bus;
+    if (!bus) {
+        Log_Debug("Device is not attached to a loop\n");
+        return DEVICE_E_INVALID;
+    }
+    if (bus->count == MB_ASYNC_QUEUE_SIZE)
+        return DEVICE_E_BUSY;
+    if (bus->state == BUS_BROKEN) {
+        int err = modbus_session_ready(device);
+        if (err)
+            return err;
+        if (loop_add_fd(bus->loop, device->rtu->uart_fd, 0, &bus->uart_src) != 0) {
+            Log_Debug("Failed to watch reopened uart:%s\n", strerror(errno));
+            modbus_session_result(device, DEVICE_E_IO);
+            return DEVICE_E_BROKEN;
+        }
+        bus->state = BUS_IDLE;
+    }
+
+    *ptxn = &bus->queue[(bus->head + bus->count) % MB_ASYNC_QUEUE_SIZE];
+    return DEVICE_OK;
+}
+
+// seal the queued transaction now, while the bus is busy with earlier ones,
+// so starting it is just a write
+static void bus_commit(modbus_device_t *device, mb_txn_t *txn)
+{
+    txn->adu_len = modbus_rtu_seal_adu(MODBUS_ADU_RTU(&txn->adu), txn->slave_id, txn->len_req);
+    device->bus->count++;
+    bus_kick(device->bus);
+}
+
+
+// --------------------- public interface ---------------------------------------
+
+mb_loop_t *mb_loop_create(void)
+{
+    mb_loop_t *loop = (mb_loop_t *)calloc(1, sizeof(mb_loop_t));
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        Log_Debug("Failed to create epoll:%s\n", strerror(errno));
+        free(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+void mb_loop_destroy(mb_loop_t *loop)
+{
+    if (!loop)
+        return;
+
+    while (loop->buses)
+        mb_loop_remove_device(loop, loop->buses->device);
+    while (loop->timers)
+        mb_loop_remove_timer(loop, loop->timers);
+    while (loop->removed) {
+        mb_watch_t *watch = loop->removed;
+        loop->removed = watch->next;
+        free(watch);
+    }
+    close(loop->epoll_fd);
+    free(loop);
+}
+
+int mb_loop_get_fd(mb_loop_t *loop)
+{
+    return loop->epoll_fd;
+}
+
+int mb_loop_dispatch(mb_loop_t *loop, int timeout_ms)
+{
+    struct epoll_event events[MB_LOOP_MAX_EVENTS];
+    int n = epoll_wait(loop->epoll_fd, events, MB_LOOP_MAX_EVENTS, timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR)
+            return 0;
+        Log_Debug("epoll wait error:%s\n", strerror(errno));
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        mb_source_t *src = (mb_source_t *)events[i].data.ptr;
+        switch (src->type) {
+        case SRC_UART:
+            bus_on_uart((mb_bus_t *)src->owner, events[i].events);
+            break;
+        case SRC_BUS_TIMER:
+            bus_on_timer((mb_bus_t *)src->owner);
+            break;
+        case SRC_TIMER: {
+            mb_timer_t *timer = (mb_timer_t *)src->owner;
+            uint64_t expirations;
+            if (read(timer->fd, &expirations, sizeof(expirations)) > 0 && timer->cb)
+                timer->cb(timer, timer->ctx);
+            break;
+        }
+        case SRC_FD: {
+            mb_watch_t *watch = (mb_watch_t *)src->owner;
+            if (watch->cb)
+                watch->cb(watch, watch->fd, events[i].events, watch->ctx);
+            break;
+        }
+        }
+    }
+
+    while (loop->removed) {
+        mb_watch_t *watch = loop->removed;
+        loop->removed = watch->next;
+        free(watch);
+    }
+    return n;
+}
+
+int mb_loop_add_device(mb_loop_t *loop, modbus_device_t *device)
+{
+    if (device->bus) {
+        Log_Debug("Device already attached to a loop\n");
+        return DEVICE_E_INVALID;
+    }
+    if (!device->rtu) {
+        // tcp devices pipeline on their own, see mb_read_submit
+        Log_Debug("Only rtu devices can be attached to a loop\n");
+        return DEVICE_E_INVALID;
+    }
+    if (device->rtu->uart_fd < 0) {
+        Log_Debug("Device must be opened before attaching to a loop\n");
+        return DEVICE_E_INVALID;
+    }
+
+    mb_bus_t *bus = (mb_bus_t *)calloc(1, sizeof(mb_bus_t));
+    bus->loop = loop;
+    bus->device = device;
+    bus->uart_src.type = SRC_UART;
+    bus->uart_src.owner = bus;
+    bus->timer_src.type = SRC_BUS_TIMER;
+    bus->timer_src.owner = bus;
+    bus->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (bus->timer_fd < 0 || loop_add_fd(loop, device->rtu->uart_fd, 0, &bus->uart_src) != 0 ||
+        loop_add_fd(loop, bus->timer_fd, EPOLLIN, &bus->timer_src) != 0) {
+        Log_Debug("Failed to attach device to loop:%s\n", strerror(errno));
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, device->rtu->uart_fd, NULL);
+        if (bus->timer_fd >= 0)
+            close(bus->timer_fd);
+        free(bus);
+        return DEVICE_E_IO;
+    }
+
+    bus->next = loop->buses;
+    loop->buses = bus;
+    device->bus = bus;
+    return DEVICE_OK;
+}
+
+int mb_loop_remove_device(mb_loop_t *loop, modbus_device_t *device)
+{
+    mb_bus_t **pp = &loop->buses;
+    while (*pp && (*pp)->device != device)
+        pp = &(*pp)->next;
+    if (!*pp)
+        return DEVICE_E_INVALID;
+
+    mb_bus_t *bus = *pp;
+    *pp = bus->next;
+
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, device->rtu->uart_fd, NULL);
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, bus->timer_fd, NULL);
+    close(bus->timer_fd);
+
+    if (bus->state == BUS_SENDING || bus->state == BUS_DRAIN)
+        modbus_rtu_tx_release(device->rtu);
+
+    // complete everything still queued, the bus no longer gets kicked
+    device->bus = NULL;
+    while (bus->count > 0) {
+        mb_txn_t *txn = &bus->queue[bus->head];
+        bus->head = (bus->head + 1) % MB_ASYNC_QUEUE_SIZE;
+        bus->count--;
+        if (txn->kind == TXN_RAW && txn->pdu_cb)
+            txn->pdu_cb(device, DEVICE_E_BROKEN, NULL, 0, txn->ctx);
+        else if (txn->kind != TXN_RAW && txn->cb)
+            txn->cb(device, DEVICE_E_BROKEN, txn->ctx);
+    }
+
+    free(bus);
+    return DEVICE_OK;
+}
+
+mb_timer_t *mb_loop_add_timer(mb_loop_t *loop, uint32_t delay_ms, uint32_t period_ms, mb_timer_callback_t cb,
+                              void *ctx)
+{
+    mb_timer_t *timer = (mb_timer_t *)calloc(1, sizeof(mb_timer_t));
+    timer->src.type = SRC_TIMER;
+    timer->src.owner = timer;
+    timer->cb = cb;
+    timer->ctx = ctx;
+    timer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    // a zero it_value disarms, fire a zero delay timer after 1 ns
+    struct itimerspec its;
+    its.it_value.tv_sec = delay_ms / 1000;
+    its.it_value.tv_nsec = delay_ms ? (long)(delay_ms % 1000) * 1000000 : 1;
+    its.it_interval.tv_sec = period_ms / 1000;
+    its.it_interval.tv_nsec = (long)(period_ms % 1000) * 1000000;
+
+    if (timer->fd < 0 || timerfd_settime(timer->fd, 0, &its, NULL) != 0 ||
+        loop_add_fd(loop, timer->fd, EPOLLIN, &timer->src) != 0) {
+        Log_Debug("Failed to create timer:%s\n", strerror(errno));
+        if (timer->fd >= 0)
+            close(timer->fd);
+        free(timer);
+        return NULL;
+    }
+
+    timer->next = loop->timers;
+    loop->timers = timer;
+    return timer;
+}
+
+void mb_loop_remove_timer(mb_loop_t *loop, mb_timer_t *timer)
+{
+    mb_timer_t **pp = &loop->timers;
+    while (*pp && *pp != timer)
+        pp = &(*pp)->next;
+    if (!*pp)
+        return;
+
+    *pp = timer->next;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, timer->fd, NULL);
+    close(timer->fd);
+    free(timer);
+}
+
+mb_watch_t *mb_loop_add_fd(mb_loop_t *loop, int fd, uint32_t events, mb_fd_callback_t cb, void *ctx)
+{
+    mb_watch_t *watch = (mb_watch_t *)calloc(1, sizeof(mb_watch_t));
+    watch->src.type = SRC_FD;
+    watch->src.owner = watch;
+    watch->fd = fd;
+    watch->cb = cb;
+    watch->ctx = ctx;
+
+    if (loop_add_fd(loop, fd, events, &watch->src) != 0) {
+        Log_Debug("Failed to watch fd %d:%s\n", fd, strerror(errno));
+        free(watch);
+        return NULL;
+    }
+    return watch;
+}
+
+int mb_loop_modify_fd(mb_loop_t *loop, mb_watch_t *watch, uint32_t events)
+{
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = &watch->src;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, watch->fd, &ev) == 0 ? DEVICE_OK : DEVICE_E_IO;
+}
+
+void mb_loop_remove_fd(mb_loop_t *loop, mb_watch_t *watch)
+{
+    if (!watch)
+        return;
+
+    // events of this dispatch may still point at the watch, free it later
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+    watch->cb = NULL;
+    watch->next = loop->removed;
+    loop->removed = watch;
+}
+
+int mb_read_register_async(modbus_device_t *device, uint8_t slave_id, uint8_t reg_type, uint16_t addr,
+                           uint16_t quantity, uint16_t *regs, int32_t timeout_ms, mb_callback_t cb, void *ctx)
+{
+    uint8_t fc = mb_read_function(reg_type);
+    if (fc == 0 || slave_id == MODBUS_BROADCAST_ID)
+        return DEVICE_E_INVALID;
+
+    mb_txn_t *txn;
+    int err = bus_submit(device, &txn);
+    if (err)
+        return err;
+
+    txn->slave_id = slave_id;
+    txn->kind = TXN_READ;
+    txn->len_req = mb_encode_read_request(MODBUS_ADU_PDU(&txn->adu), fc, addr, quantity);
+    txn->regs = regs;
+    txn->timeout_ms = timeout_ms;
+    txn->cb = cb;
+    txn->ctx = ctx;
+    bus_commit(device, txn);
+    return DEVICE_OK;
+}
+
+int mb_write_register_async(modbus_device_t *device, uint8_t slave_id, uint8_t reg_type, uint16_t addr,
+                            uint16_t quantity, const uint16_t *regs, int32_t timeout_ms, mb_callback_t cb, void *ctx)
+{
+    uint8_t fc = mb_write_function(reg_type, quantity);
+    if (fc == 0)
+        return DEVICE_E_INVALID;
+
+    mb_txn_t *txn;
+    int err = bus_submit(device, &txn);
+    if (err)
+        return err;
+
+    // values are encoded now, regs can be reused right away
+    txn->slave_id = slave_id;
+    txn->kind = TXN_WRITE;
+    txn->len_req = mb_encode_write_request(MODBUS_ADU_PDU(&txn->adu), fc, addr, quantity, regs);
+    txn->regs = NULL;
+    txn->timeout_ms = timeout_ms;
+    txn->cb = cb;
+    txn->ctx = ctx;
+    bus_commit(device, txn);
+    return DEVICE_OK;
+}
+
+int mb_request_async(modbus_device_t *device, uint8_t slave_id, const uint8_t *pdu, int pdu_len, int32_t timeout_ms,
+                     mb_pdu_callback_t cb, void *ctx)
+{
+    if (pdu_len < 1 || pdu_len > MODBUS_MAX_PDU_SIZE ||
+        (slave_id == MODBUS_BROADCAST_ID && !mb_broadcast_allowed(pdu[0])))
+        return DEVICE_E_INVALID;
+
+    mb_txn_t *txn;
+    int err = bus_submit(device, &txn);
+    if (err)
+        return err;
+
+    txn->slave_id = slave_id;
+    txn->kind = TXN_RAW;
+    memcpy(MODBUS_ADU_PDU(&txn->adu), pdu, (size_t)pdu_len);
+    txn->len_req = pdu_len;
+    txn->regs = NULL;
+    txn->timeout_ms = timeout_ms;
+    txn->cb = NULL;
+    txn->pdu_cb = cb;
+    txn->ctx = ctx;
+    bus_commit(device, txn);
+    return DEVICE_OK;
+}
+
+int mb_async_pending(modbus_device_t *device)
+{
+    return device->bus ? device->bus->count : 0;
+}
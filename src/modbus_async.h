@@ -0,0 +1,83 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "modbus.h"
+
+// Asynchronous Modbus master driven by an epoll event loop.
+//
+// Transactions are submitted with a completion callback and run by
+// mb_loop_dispatch(), so one thread can serve many buses and timers:
+//
+//   mb_loop_t *loop = mb_loop_create();
+//   mb_loop_add_device(loop, device);   // device must be opened
+//   mb_read_register_async(device, 1, HOLDING_REGISTER, 0, 10, regs, 1000, on_read, ctx);
+//   while (running)
+//       mb_loop_dispatch(loop, -1);
+//
+// Once a device is added to a loop, don't call the blocking
+// mb_read_register/mb_write_register on it.
+
+#define MB_ASYNC_QUEUE_SIZE 16
+#define MB_LOOP_MAX_EVENTS 16
+
+typedef struct mb_loop_t mb_loop_t;
+typedef struct mb_bus_t mb_bus_t;
+typedef struct mb_timer_t mb_timer_t;
+typedef struct mb_watch_t mb_watch_t;
+
+// result is DEVICE_OK or DEVICE_E_*, read values are in the regs buffer
+// passed at submit. Callbacks run on the thread calling mb_loop_dispatch and
+// may submit new transactions, but must not remove the device from the loop.
+typedef void (*mb_callback_t)(modbus_device_t *device, int result, void *ctx);
+typedef void (*mb_timer_callback_t)(mb_timer_t *timer, void *ctx);
+// raw transaction completion, on DEVICE_OK pdu is the response pdu, an
+// exception response included, valid only during the callback
+typedef void (*mb_pdu_callback_t)(modbus_device_t *device, int result, const uint8_t *pdu, int pdu_len, void *ctx);
+// events is a mask of EPOLLIN/EPOLLOUT/EPOLLHUP/EPOLLERR
+typedef void (*mb_fd_callback_t)(mb_watch_t *watch, int fd, uint32_t events, void *ctx);
+
+mb_loop_t *mb_loop_create(void);
+void mb_loop_destroy(mb_loop_t *loop);
+
+// epoll fd of the loop, readable when there are events to dispatch. Lets the
+// loop be nested in another event loop, e.g. applibs EventLoop_RegisterIo.
+int mb_loop_get_fd(mb_loop_t *loop);
+
+// wait up to timeout_ms (-1 for ever) for events and dispatch them,
+// return number of events dispatched or -1 on error
+int mb_loop_dispatch(mb_loop_t *loop, int timeout_ms);
+
+// attach an opened device, a device belongs to at most one loop. Remove
+// completes all queued transactions with DEVICE_E_BROKEN. So does a hangup of
+// the uart, which also closes it, and submits fail with DEVICE_E_BROKEN until
+// the device's reopen backoff is over.
+int mb_loop_add_device(mb_loop_t *loop, modbus_device_t *device);
+int mb_loop_remove_device(mb_loop_t *loop, modbus_device_t *device);
+
+// timer firing after delay_ms, then every period_ms if period_ms is not 0
+mb_timer_t *mb_loop_add_timer(mb_loop_t *loop, uint32_t delay_ms, uint32_t period_ms, mb_timer_callback_t cb,
+                              void *ctx);
+void mb_loop_remove_timer(mb_loop_t *loop, mb_timer_t *timer);
+
+// watch any other fd, e.g. sockets, for epoll events. A watch may be removed
+// from any callback, its memory is released after the dispatch.
+mb_watch_t *mb_loop_add_fd(mb_loop_t *loop, int fd, uint32_t events, mb_fd_callback_t cb, void *ctx);
+int mb_loop_modify_fd(mb_loop_t *loop, mb_watch_t *watch, uint32_t events);
+void mb_loop_remove_fd(mb_loop_t *loop, mb_watch_t *watch);
+
+// queue a transaction, return DEVICE_OK or DEVICE_E_BUSY if the queue is full.
+// regs must stay valid until the callback is called. Writes to
+// MODBUS_BROADCAST_ID complete once sent, reads to it are DEVICE_E_INVALID.
+int mb_read_register_async(modbus_device_t *device, uint8_t slave_id, uint8_t reg_type, uint16_t addr,
+                           uint16_t quantity, uint16_t *regs, int32_t timeout_ms, mb_callback_t cb, void *ctx);
+int mb_write_register_async(modbus_device_t *device, uint8_t slave_id, uint8_t reg_type, uint16_t addr,
+                            uint16_t quantity, const uint16_t *regs, int32_t timeout_ms, mb_callback_t cb, void *ctx);
+
+// queue a request pdu as is, for callers relaying pdus they didn't build,
+// e.g. a gateway. The pdu is copied at submit. A broadcast calls back with a
+// NULL pdu.
+int mb_request_async(modbus_device_t *device, uint8_t slave_id, const uint8_t *pdu, int pdu_len, int32_t timeout_ms,
+                     mb_pdu_callback_t cb, void *ctx);
+
+// transactions queued or in flight on device
+int mb_async_pending(modbus_device_t *device);
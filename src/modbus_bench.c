@@ -0,0 +1,193 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc16.h"
+#include "modbus_bench.h"
+#include "utils.h"
+
+enum {
+    BENCH_READ,         // mb_read_register, quantity points
+    BENCH_WRITE,        // mb_write_register, quantity points
+    BENCH_WRITE_SINGLE, // mb_write_register of one point
+    BENCH_MASK_WRITE,   // mb_mask_write_register
+    BENCH_READ_WRITE,   // mb_read_write_registers, quantity each way
+};
+
+typedef struct bench_case_t {
+    uint8_t function_code;
+    uint8_t reg_type;
+    uint8_t call; // BENCH_*
+} bench_case_t;
+
+// every function code the client issues for register reads and writes
+static const bench_case_t bench_cases[] = {
+    {FC_READ_COILS, COIL, BENCH_READ},
+    {FC_READ_DISCRETE_INPUTS, DISCRETE_INPUT, BENCH_READ},
+    {FC_READ_HOLDING_REGISTERS, HOLDING_REGISTER, BENCH_READ},
+    {FC_READ_INPUT_REGISTERS, INPUT_REGISTER, BENCH_READ},
+    {FC_WRITE_SINGLE_COIL, COIL, BENCH_WRITE_SINGLE},
+    {FC_WRITE_SINGLE_REGISTER, HOLDING_REGISTER, BENCH_WRITE_SINGLE},
+    {FC_WRITE_COILS, COIL, BENCH_WRITE},
+    {FC_WRITE_HOLDING_REGISTERS, HOLDING_REGISTER, BENCH_WRITE},
+    {FC_MASK_WRITE_REGISTER, HOLDING_REGISTER, BENCH_MASK_WRITE},
+    {FC_READ_WRITE_REGISTERS, HOLDING_REGISTER, BENCH_READ_WRITE},
+};
+
+static int bench_call(modbus_device_t *device, const bench_case_t *bc, uint8_t slave_id, uint16_t addr,
+                      uint16_t quantity, uint16_t *regs, int32_t timeout_ms)
+{
+    switch (bc->call) {
+    case BENCH_READ:
+        return mb_read_register(device, slave_id, bc->reg_type, addr, quantity, regs, timeout_ms);
+    case BENCH_WRITE:
+        return mb_write_register(device, slave_id, bc->reg_type, addr, quantity, regs, timeout_ms);
+    case BENCH_WRITE_SINGLE:
+        return mb_write_register(device, slave_id, bc->reg_type, addr, 1, regs, timeout_ms);
+    case BENCH_MASK_WRITE:
+        return mb_mask_write_register(device, slave_id, addr, 0xFF00, regs[0], timeout_ms);
+    default:
+        // the values written are read back
+        return mb_read_write_registers(device, slave_id, addr, quantity, regs + quantity, addr, quantity, regs,
+                                       timeout_ms);
+    }
+}
+
+static int compare_long(const void *a, const void *b)
+{
+    long la = *(const long *)a, lb = *(const long *)b;
+    return la < lb ? -1 : la > lb ? 1 : 0;
+}
+
+static long percentile(const long *sorted, int count, int pct)
+{
+    if (count == 0)
+        return 0;
+    int i = (count * pct + 99) / 100 - 1;
+    return sorted[i < 0 ? 0 : i];
+}
+
+int modbus_bench_run(modbus_device_t *device, uint8_t slave_id, uint16_t addr, uint16_t quantity, int iterations,
+                     int32_t timeout_ms, modbus_bench_result_t *results)
+{
+    if (iterations <= 0 || quantity == 0 || quantity > MODBUS_MAX_HOLDING_PER_READ_WRITE)
+        return 0;
+
+    long *latency = (long *)malloc(sizeof(long) * (size_t)iterations);
+    uint16_t regs[2 * MODBUS_MAX_HOLDING_PER_READ_WRITE];
+    int count = 0;
+
+    for (size_t c = 0; c < sizeof(bench_cases) / sizeof(bench_cases[0]); c++) {
+        const bench_case_t *bc = &bench_cases[c];
+        modbus_bench_result_t *r = &results[count++];
+        memset(r, 0, sizeof(*r));
+        r->function_code = bc->function_code;
+
+        int ok = 0;
+        uint64_t start_us = timer_monotonic_us();
+        for (int i = 0; i < iterations; i++) {
+            for (int k = 0; k < quantity; k++) {
+                regs[k] = bc->reg_type == COIL ? (uint16_t)((i + k) & 1) : (uint16_t)(i + k);
+            }
+
+            uint64_t t0 = timer_monotonic_us();
+            int err = bench_call(device, bc, slave_id, addr, quantity, regs, timeout_ms);
+            if (err) {
+                r->errors++;
+                continue;
+            }
+            latency[ok++] = (long)(timer_monotonic_us() - t0);
+        }
+        uint64_t elapse_us = timer_monotonic_us() - start_us;
+
+        qsort(latency, (size_t)ok, sizeof(long), compare_long);
+        r->transactions = ok;
+        r->tps = elapse_us ? ok * 1e6 / (double)elapse_us : 0;
+        r->p50_us = percentile(latency, ok, 50);
+        r->p90_us = percentile(latency, ok, 90);
+        r->p99_us = percentile(latency, ok, 99);
+        r->max_us = ok ? latency[ok - 1] : 0;
+    }
+
+    free(latency);
+    return count;
+}
+
+void modbus_bench_print(const modbus_bench_result_t *results, int count)
+{
+    Log_Debug("fc    ok     err   tps       p50(us)  p90(us)  p99(us)  max(us)\n");
+    for (int i = 0; i < count; i++) {
+        const modbus_bench_result_t *r = &results[i];
+        Log_Debug("0x%02x  %-6d %-5d %-9.1f %-8ld %-8ld %-8ld %ld\n", r->function_code, r->transactions, r->errors,
+                  r->tps, r->p50_us, r->p90_us, r->p99_us, r->max_us);
+    }
+}
+
+// frames up to a full rtu adu, the lengths the crc sees on the bus
+#define CRC_BENCH_MAX_LEN 256
+#define CRC_BENCH_CASES 2000
+
+static uint32_t crc_bench_rand(uint32_t *state)
+{
+    // xorshift, the same data on every run
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+int modbus_bench_crc(int iterations)
+{
+    uint8_t data[CRC_BENCH_MAX_LEN];
+    uint32_t state = 0x12345678;
+    int mismatches = 0;
+
+    // conformance, one shot and streamed in up to three chunks split at
+    // random, against the reference. Every length and alignment the slices
+    // handle differently is covered by the random lengths and offsets.
+    for (int i = 0; i < CRC_BENCH_CASES; i++) {
+        for (int k = 0; k < CRC_BENCH_MAX_LEN; k++)
+            data[k] = (uint8_t)crc_bench_rand(&state);
+        size_t offset = crc_bench_rand(&state) % 8;
+        size_t len = crc_bench_rand(&state) % (CRC_BENCH_MAX_LEN - offset + 1);
+        const uint8_t *p = data + offset;
+        uint16_t expect = crc16_bitwise(CRC16_INIT, p, len);
+
+        size_t split1 = len ? crc_bench_rand(&state) % (len + 1) : 0;
+        size_t split2 = split1 + (len - split1 ? crc_bench_rand(&state) % (len - split1 + 1) : 0);
+        uint16_t crc = crc16_init();
+        crc = crc16_update(crc, p, split1);
+        crc = crc16_update(crc, p + split1, split2 - split1);
+        crc = crc16_final(crc16_update(crc, p + split2, len - split2));
+
+        uint16_t one_shot = crc16(p, len);
+        if (one_shot != expect || crc != expect) {
+            if (mismatches++ < 8)
+                Log_Debug("crc16 %s mismatch, len %zu offset %zu split %zu/%zu: %04x stream %04x expect %04x\n",
+                          crc16_engine_name(), len, offset, split1, split2, one_shot, crc, expect);
+        }
+    }
+    // check value of the modbus crc
+    if (crc16((const uint8_t *)"123456789", 9) != 0x4B37)
+        mismatches++;
+    Log_Debug("crc16 %s: %d cases, %d mismatches\n", crc16_engine_name(), CRC_BENCH_CASES, mismatches);
+
+    // timing, a read request, a 10 register response and a full frame
+    static const size_t lens[] = {6, 23, CRC_BENCH_MAX_LEN - 2};
+    volatile uint16_t sink = 0;
+    Log_Debug("len   %-12s bitwise(ns)\n", crc16_engine_name());
+    for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+        uint64_t t0 = timer_monotonic_us();
+        for (int i = 0; i < iterations; i++)
+            sink ^= crc16(data + (i & 1), lens[l]);
+        uint64_t t1 = timer_monotonic_us();
+        for (int i = 0; i < iterations; i++)
+            sink ^= crc16_bitwise(CRC16_INIT, data + (i & 1), lens[l]);
+        uint64_t t2 = timer_monotonic_us();
+        Log_Debug("%-5zu %-12.1f %.1f\n", lens[l], (double)(t1 - t0) * 1e3 / iterations,
+                  (double)(t2 - t1) * 1e3 / iterations);
+    }
+    (void)sink;
+    return mismatches ? -1 : 0;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <stdint.h>
+#include "modbus.h"
+
+typedef struct modbus_bench_result_t modbus_bench_result_t;
+struct modbus_bench_result_t {
+    uint8_t function_code;
+    int transactions;
+    int errors;
+    double tps;    // successful transactions per second
+    long p50_us;
+    long p90_us;
+    long p99_us;
+    long max_us;
+};
+
+// Run iterations transactions of every function code the client supports,
+// quantity points each, single writes and mask writes one, starting at
+// addr. quantity is at most MODBUS_MAX_HOLDING_PER_READ_WRITE. results must
+// have room for MODBUS_BENCH_MAX_RESULTS entries, return the number of
+// results filled.
+#define MODBUS_BENCH_MAX_RESULTS 12
+
+int modbus_bench_run(modbus_device_t *device, uint8_t slave_id, uint16_t addr, uint16_t quantity, int iterations,
+                     int32_t timeout_ms, modbus_bench_result_t *results);
+
+void modbus_bench_print(const modbus_bench_result_t *results, int count);
+
+// Check the crc16 engine selected at compile time against crc16_bitwise,
+// one shot and streamed over random frames, then time both iterations
+// times. Other engines are checked by building with -DCRC16_ENGINE=N.
+// Return -1 if any crc differs.
+int modbus_bench_crc(int iterations);
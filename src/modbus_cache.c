@@ -0,0 +1,242 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "modbus_cache.h"
+#include "utils.h"
+
+
+static unsigned int block_hash(const void *bus, uint8_t slave_id, uint8_t reg_type, uint16_t base)
+{
+    uint32_t h = (uint32_t)(uintptr_t)bus;
+    h ^= ((uint32_t)slave_id << 24) | ((uint32_t)reg_type << 16) | (uint32_t)(base / MODBUS_CACHE_BLOCK_REGS);
+    // murmur3 finalizer, spreads neighbour blocks over the table
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static bool block_is(const modbus_cache_block_t *block, const void *bus, uint8_t slave_id, uint8_t reg_type,
+                     uint16_t base)
+{
+    return block->bus == bus && block->slave_id == slave_id && block->reg_type == reg_type && block->base == base;
+}
+
+// block holding base, or NULL
+static modbus_cache_block_t *cache_find(modbus_cache_t *cache, const void *bus, uint8_t slave_id, uint8_t reg_type,
+                                        uint16_t base)
+{
+    unsigned int mask = cache->nblocks - 1;
+    unsigned int slot = block_hash(bus, slave_id, reg_type, base) & mask;
+    for (int i = 0; i < MODBUS_CACHE_PROBE; i++) {
+        modbus_cache_block_t *block = &cache->blocks[(slot + (unsigned int)i) & mask];
+        if (block_is(block, bus, slave_id, reg_type, base))
+            return block;
+    }
+    return NULL;
+}
+
+// block holding base, taking a free slot or evicting the least recently
+// stored one of the probe window if there is none
+static modbus_cache_block_t *cache_insert(modbus_cache_t *cache, const void *bus, uint8_t slave_id, uint8_t reg_type,
+                                          uint16_t base)
+{
+    unsigned int mask = cache->nblocks - 1;
+    unsigned int slot = block_hash(bus, slave_id, reg_type, base) & mask;
+    modbus_cache_block_t *victim = NULL;
+    for (int i = 0; i < MODBUS_CACHE_PROBE; i++) {
+        modbus_cache_block_t *block = &cache->blocks[(slot + (unsigned int)i) & mask];
+        if (block_is(block, bus, slave_id, reg_type, base))
+            return block;
+        if (!victim || (victim->bus && (!block->bus || block->stored_us < victim->stored_us)))
+            victim = block;
+    }
+
+    if (victim->bus)
+        cache->stats.evictions++;
+    memset(victim, 0, sizeof(*victim));
+    victim->bus = bus;
+    victim->slave_id = slave_id;
+    victim->reg_type = reg_type;
+    victim->base = base;
+    return victim;
+}
+
+
+// --------------------- public interface ---------------------------------------
+
+int modbus_cache_set_ttl(modbus_cache_t *cache, uint8_t slave_id, uint8_t reg_type, uint16_t first, uint16_t last,
+                         uint32_t ttl_ms)
+{
+    if (first > last)
+        return DEVICE_E_INVALID;
+    if (cache->nranges == MODBUS_CACHE_MAX_RANGES)
+        return DEVICE_E_BUSY;
+
+    modbus_cache_range_t *range = &cache->ranges[cache->nranges++];
+    range->slave_id = slave_id;
+    range->reg_type = reg_type;
+    range->first = first;
+    range->last = last;
+    range->ttl_ms = ttl_ms;
+    return DEVICE_OK;
+}
+
+uint32_t modbus_cache_ttl(const modbus_cache_t *cache, uint8_t slave_id, uint8_t reg_type, uint16_t addr,
+                          uint16_t quantity)
+{
+    // registers not in any range keep the default
+    uint32_t end = (uint32_t)addr + quantity;
+    uint32_t ttl_ms = UINT32_MAX;
+    uint32_t covered = 0;
+    for (int i = 0; i < cache->nranges; i++) {
+        const modbus_cache_range_t *range = &cache->ranges[i];
+        if ((range->slave_id != MODBUS_CACHE_ANY_SLAVE && range->slave_id != slave_id) ||
+            range->reg_type != reg_type || range->last < addr || range->first >= end)
+            continue;
+        if (range->ttl_ms < ttl_ms)
+            ttl_ms = range->ttl_ms;
+        uint32_t lo = range->first > addr ? range->first : addr;
+        uint32_t hi = (uint32_t)range->last + 1 < end ? (uint32_t)range->last + 1 : end;
+        covered += hi - lo;
+    }
+    // overlapping ranges count twice, which only makes a partial cover look full
+    if (covered < quantity && cache->default_ttl_ms < ttl_ms)
+        ttl_ms = cache->default_ttl_ms;
+    return ttl_ms;
+}
+
+bool modbus_cache_lookup(modbus_cache_t *cache, const void *bus, uint8_t slave_id, uint8_t reg_type, uint16_t addr,
+                         uint16_t quantity, uint16_t *regs, uint32_t max_age_ms)
+{
+    if (quantity == 0 || max_age_ms == 0 || (uint32_t)addr + quantity > 0x10000) {
+        cache->stats.misses++;
+        return false;
+    }
+
+    uint64_t now = timer_monotonic_us();
+    uint64_t max_age_us = (uint64_t)max_age_ms * 1000;
+    uint32_t end = (uint32_t)addr + quantity;
+
+    // check all blocks before copying anything
+    for (uint32_t a = addr; a < end;) {
+        uint16_t base = (uint16_t)(a - a % MODBUS_CACHE_BLOCK_REGS);
+        uint32_t stop = base + MODBUS_CACHE_BLOCK_REGS < end ? base + MODBUS_CACHE_BLOCK_REGS : end;
+        modbus_cache_block_t *block = cache_find(cache, bus, slave_id, reg_type, base);
+        for (; block && a < stop; a++) {
+            uint64_t read_us = block->read_us[a - base];
+            if (read_us == 0 || now - read_us > max_age_us)
+                break;
+        }
+        if (a < stop) {
+            cache->stats.misses++;
+            return false;
+        }
+    }
+
+    for (uint32_t a = addr; a < end;) {
+        uint16_t base = (uint16_t)(a - a % MODBUS_CACHE_BLOCK_REGS);
+        uint32_t stop = base + MODBUS_CACHE_BLOCK_REGS < end ? base + MODBUS_CACHE_BLOCK_REGS : end;
+        modbus_cache_block_t *block = cache_find(cache, bus, slave_id, reg_type, base);
+        memcpy(regs + (a - addr), block->values + (a - base), (stop - a) * sizeof(uint16_t));
+        a = stop;
+    }
+    cache->stats.hits++;
+    return true;
+}
+
+void modbus_cache_store(modbus_cache_t *cache, const void *bus, uint8_t slave_id, uint8_t reg_type, uint16_t addr,
+                        uint16_t quantity, const uint16_t *regs)
+{
+    uint64_t now = timer_monotonic_us();
+    uint32_t end = (uint32_t)addr + quantity;
+    if (end > 0x10000)
+        end = 0x10000;
+
+    for (uint32_t a = addr; a < end;) {
+        uint16_t base = (uint16_t)(a - a % MODBUS_CACHE_BLOCK_REGS);
+        uint32_t stop = base + MODBUS_CACHE_BLOCK_REGS < end ? base + MODBUS_CACHE_BLOCK_REGS : end;
+        modbus_cache_block_t *block = cache_insert(cache, bus, slave_id, reg_type, base);
+        block->stored_us = now;
+        for (; a < stop; a++) {
+            block->values[a - base] = regs[a - addr];
+            block->read_us[a - base] = now;
+        }
+    }
+}
+
+void modbus_cache_invalidate(modbus_cache_t *cache, const void *bus, uint8_t slave_id, uint8_t reg_type,
+                             uint16_t addr, uint16_t quantity)
+{
+    uint32_t end = (uint32_t)addr + quantity;
+    if (end > 0x10000)
+        end = 0x10000;
+
+    if (slave_id == MODBUS_CACHE_ANY_SLAVE) {
+        // a broadcast wrote every slave of the bus
+        for (unsigned int i = 0; i < cache->nblocks; i++) {
+            modbus_cache_block_t *block = &cache->blocks[i];
+            if (block->bus != bus || block->reg_type != reg_type || block->base >= end ||
+                (uint32_t)block->base + MODBUS_CACHE_BLOCK_REGS <= addr)
+                continue;
+            for (uint32_t a = block->base; a < (uint32_t)block->base + MODBUS_CACHE_BLOCK_REGS; a++) {
+                if (a >= addr && a < end && block->read_us[a - block->base]) {
+                    block->read_us[a - block->base] = 0;
+                    cache->stats.invalidations++;
+                }
+            }
+        }
+        return;
+    }
+
+    for (uint32_t a = addr; a < end;) {
+        uint16_t base = (uint16_t)(a - a % MODBUS_CACHE_BLOCK_REGS);
+        uint32_t stop = base + MODBUS_CACHE_BLOCK_REGS < end ? base + MODBUS_CACHE_BLOCK_REGS : end;
+        modbus_cache_block_t *block = cache_find(cache, bus, slave_id, reg_type, base);
+        for (; a < stop; a++) {
+            if (block && block->read_us[a - base]) {
+                block->read_us[a - base] = 0;
+                cache->stats.invalidations++;
+            }
+        }
+    }
+}
+
+void modbus_cache_clear(modbus_cache_t *cache, const void *bus)
+{
+    for (unsigned int i = 0; i < cache->nblocks; i++) {
+        if (!bus || cache->blocks[i].bus == bus)
+            memset(&cache->blocks[i], 0, sizeof(cache->blocks[i]));
+    }
+}
+
+
+void modbus_cache_destroy(modbus_cache_t *cache)
+{
+    if (cache) {
+        free(cache->blocks);
+        free(cache);
+    }
+}
+
+
+modbus_cache_t *modbus_cache_create(unsigned int nblocks, uint32_t default_ttl_ms)
+{
+    // round up to a power of 2 for masking, at least one probe window
+    unsigned int size = MODBUS_CACHE_PROBE;
+    while (size < nblocks)
+        size *= 2;
+
+    modbus_cache_t *cache = (modbus_cache_t *)calloc(1, sizeof(modbus_cache_t));
+    cache->blocks = (modbus_cache_block_t *)calloc(size, sizeof(modbus_cache_block_t));
+    if (!cache->blocks) {
+        Log_Debug("Failed to allocate %u cache blocks\n", size);
+        free(cache);
+        return NULL;
+    }
+    cache->nblocks = size;
+    cache->default_ttl_ms = default_ttl_ms;
+    return cache;
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+// Register image shared by the readers of one or more buses. Values are kept
+// per (bus, slave id, register type, address) with the time they were read,
+// so repeated reads within the allowed age are answered from memory:
+//
+//   modbus_cache_t *cache = modbus_cache_create(64, 100);     // 100 ms default
+//   modbus_cache_set_ttl(cache, 1, INPUT_REGISTER, 0, 99, 1000);
+//   modbus_set_cache(device, cache);
+//   mb_read_register(device, 1, INPUT_REGISTER, 10, 4, regs, 1000);  // from cache if read < 1 s ago
+//
+// Writes through mb_write_register invalidate the written range. The cache is
+// not thread safe, like the devices using it.
+
+// registers of a block, blocks are aligned to their size
+#define MODBUS_CACHE_BLOCK_REGS 32
+#define MODBUS_CACHE_MAX_RANGES 16
+// slots probed for a block before the oldest one is evicted
+#define MODBUS_CACHE_PROBE 8
+// slave id of a ttl range matching every slave
+#define MODBUS_CACHE_ANY_SLAVE 0
+
+typedef struct modbus_cache_block_t modbus_cache_block_t;
+struct modbus_cache_block_t {
+    const void *bus; // NULL if the slot is free
+    uint8_t slave_id;
+    uint8_t reg_type;
+    uint16_t base;      // address of values[0]
+    uint64_t stored_us; // last store, for eviction
+    uint16_t values[MODBUS_CACHE_BLOCK_REGS];
+    uint64_t read_us[MODBUS_CACHE_BLOCK_REGS]; // monotonic time read, 0 if not valid
+};
+
+typedef struct modbus_cache_range_t modbus_cache_range_t;
+struct modbus_cache_range_t {
+    uint8_t slave_id;
+    uint8_t reg_type;
+    uint16_t first;
+    uint16_t last;
+    uint32_t ttl_ms;
+};
+
+typedef struct modbus_cache_stats_t modbus_cache_stats_t;
+struct modbus_cache_stats_t {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long invalidations; // registers dropped by writes
+    unsigned long evictions;     // blocks dropped for room
+};
+
+typedef struct modbus_cache_t modbus_cache_t;
+struct modbus_cache_t {
+    modbus_cache_block_t *blocks;
+    unsigned int nblocks; // power of 2
+    uint32_t default_ttl_ms;
+    modbus_cache_range_t ranges[MODBUS_CACHE_MAX_RANGES];
+    int nranges;
+    modbus_cache_stats_t stats;
+};
+
+
+// room for about nblocks * MODBUS_CACHE_BLOCK_REGS registers. Reads not
+// covered by a ttl range are served for default_ttl_ms, 0 disables them.
+modbus_cache_t *modbus_cache_create(unsigned int nblocks, uint32_t default_ttl_ms);
+void modbus_cache_destroy(modbus_cache_t *cache);
+
+// ttl of reads within first..last, the first matching range wins. A read
+// crossing ranges gets the smallest ttl of them.
+int modbus_cache_set_ttl(modbus_cache_t *cache, uint8_t slave_id, uint8_t reg_type, uint16_t first, uint16_t last,
+                         uint32_t ttl_ms);
+uint32_t modbus_cache_ttl(const modbus_cache_t *cache, uint8_t slave_id, uint8_t reg_type, uint16_t addr,
+                          uint16_t quantity);
+
+// copy quantity values to regs and return true if all were read no more than
+// max_age_ms ago. Nothing is copied on a miss.
+bool modbus_cache_lookup(modbus_cache_t *cache, const void *bus, uint8_t slave_id, uint8_t reg_type, uint16_t addr,
+                         uint16_t quantity, uint16_t *regs, uint32_t max_age_ms);
+// remember values just read from the bus
+void modbus_cache_store(modbus_cache_t *cache, const void *bus, uint8_t slave_id, uint8_t reg_type, uint16_t addr,
+                        uint16_t quantity, const uint16_t *regs);
+// forget values written, of every slave of bus for MODBUS_CACHE_ANY_SLAVE (broadcast)
+void modbus_cache_invalidate(modbus_cache_t *cache, const void *bus, uint8_t slave_id, uint8_t reg_type,
+                             uint16_t addr, uint16_t quantity);
+// drop everything, e.g. of a bus being removed, or all buses if bus is NULL
+void modbus_cache_clear(modbus_cache_t *cache, const void *bus);
@@ -0,0 +1,117 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "modbus_change.h"
+#include "utils.h"
+
+
+static bool exceeds_deadband(const modbus_change_point_t *state, uint16_t value)
+{
+    float last = state->is_signed ? (float)(int16_t)state->last : (float)state->last;
+    float now = state->is_signed ? (float)(int16_t)value : (float)value;
+    float delta = now > last ? now - last : last - now;
+
+    switch (state->deadband_type) {
+    case MODBUS_DEADBAND_ABSOLUTE:
+        return delta > state->deadband;
+    case MODBUS_DEADBAND_PERCENT:
+        return delta > (last < 0 ? -last : last) * state->deadband / 100.0f;
+    default:
+        return true;
+    }
+}
+
+
+// --------------------- public interface ---------------------------------------
+
+int modbus_change_set_deadband(modbus_change_detector_t *det, int point, uint8_t deadband_type, float deadband,
+                               bool is_signed)
+{
+    if (point < 0 || point >= det->npoints || deadband_type > MODBUS_DEADBAND_PERCENT || deadband < 0)
+        return DEVICE_E_INVALID;
+
+    modbus_change_point_t *state = &det->state[point];
+    state->deadband_type = deadband_type;
+    state->deadband = deadband;
+    state->is_signed = is_signed;
+    return DEVICE_OK;
+}
+
+int modbus_change_update(modbus_change_detector_t *det, uint64_t timestamp_us)
+{
+    det->nchanges = 0;
+    det->updates++;
+
+    for (int i = 0; i < det->npoints; i++) {
+        const modbus_point_t *point = &det->points[i];
+        modbus_change_point_t *state = &det->state[i];
+        if (point->result != DEVICE_OK)
+            continue;
+
+        uint16_t value = *point->value;
+        uint8_t flags = 0;
+        if (!state->known) {
+            flags = MODBUS_CHANGE_FIRST;
+            state->last = value;
+            state->known = true;
+        } else if (value == state->last) {
+            continue;
+        } else if (!exceeds_deadband(state, value)) {
+            // last stays the reported value, so slow drifts still add up
+            det->suppressed++;
+            continue;
+        }
+
+        modbus_change_t *change = &det->changes[det->nchanges++];
+        change->point = i;
+        change->slave_id = point->slave_id;
+        change->reg_type = point->reg_type;
+        change->addr = point->addr;
+        change->old_value = state->last;
+        change->new_value = value;
+        change->flags = flags;
+        change->timestamp_us = timestamp_us;
+        state->last = value;
+    }
+
+    det->reported += (unsigned long)det->nchanges;
+    return det->nchanges;
+}
+
+void modbus_change_reset(modbus_change_detector_t *det)
+{
+    for (int i = 0; i < det->npoints; i++)
+        det->state[i].known = false;
+    det->nchanges = 0;
+}
+
+
+void modbus_change_destroy(modbus_change_detector_t *det)
+{
+    if (det) {
+        free(det->state);
+        free(det->changes);
+        free(det);
+    }
+}
+
+
+modbus_change_detector_t *modbus_change_create(const modbus_point_t *points, int npoints)
+{
+    if (!points || npoints <= 0) {
+        Log_Debug("No points to detect changes of\n");
+        return NULL;
+    }
+
+    modbus_change_detector_t *det = (modbus_change_detector_t *)calloc(1, sizeof(modbus_change_detector_t));
+    det->points = points;
+    det->npoints = npoints;
+    det->state = (modbus_change_point_t *)calloc((size_t)npoints, sizeof(modbus_change_point_t));
+    det->changes = (modbus_change_t *)calloc((size_t)npoints, sizeof(modbus_change_t));
+    if (!det->state || !det->changes) {
+        Log_Debug("Failed to allocate change detector\n");
+        modbus_change_destroy(det);
+        return NULL;
+    }
+    return det;
+}
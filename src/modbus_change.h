@@ -0,0 +1,78 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "modbus_plan.h"
+
+// Change detection on scanned points. Keeps the last reported value of each
+// point and, after every scan, lists only the points that moved by more than
+// their deadband, so consumers handle changes instead of whole scans:
+//
+//   modbus_change_detector_t *det = modbus_change_create(points, npoints);
+//   modbus_change_set_deadband(det, 3, MODBUS_DEADBAND_PERCENT, 2.0f, false);
+//   modbus_plan_execute(device, plan, 1000);
+//   int n = modbus_change_update(det, timer_monotonic_us());
+//   for (int i = 0; i < n; i++)
+//       publish(&det->changes[i]);
+
+// a point reports when |new - last reported| is larger than the deadband
+enum {
+    MODBUS_DEADBAND_NONE = 0, // every change
+    MODBUS_DEADBAND_ABSOLUTE = 1,
+    MODBUS_DEADBAND_PERCENT = 2, // percent of the last reported value
+};
+
+// change flags
+#define MODBUS_CHANGE_FIRST 0x01 // first value of the point, old_value equals new_value
+
+typedef struct modbus_change_t modbus_change_t;
+struct modbus_change_t {
+    int point; // index into the points array
+    uint8_t slave_id;
+    uint8_t reg_type;
+    uint16_t addr;
+    uint16_t old_value;
+    uint16_t new_value;
+    uint8_t flags;
+    uint64_t timestamp_us;
+};
+
+typedef struct modbus_change_point_t modbus_change_point_t;
+struct modbus_change_point_t {
+    uint16_t last; // last reported value
+    bool known;
+    bool is_signed; // compare as int16_t
+    uint8_t deadband_type;
+    float deadband;
+};
+
+typedef struct modbus_change_detector_t modbus_change_detector_t;
+struct modbus_change_detector_t {
+    const modbus_point_t *points;
+    int npoints;
+    modbus_change_point_t *state;
+
+    // changes of the last update, at most one per point
+    modbus_change_t *changes;
+    int nchanges;
+
+    unsigned long updates;
+    unsigned long reported;   // changes reported
+    unsigned long suppressed; // changes within the deadband
+};
+
+
+// detect changes of points, typically the points of a plan. Points array
+// must outlive the detector. All points start without deadband.
+modbus_change_detector_t *modbus_change_create(const modbus_point_t *points, int npoints);
+void modbus_change_destroy(modbus_change_detector_t *det);
+
+int modbus_change_set_deadband(modbus_change_detector_t *det, int point, uint8_t deadband_type, float deadband,
+                               bool is_signed);
+
+// compare the points' values with the last reported ones after a scan and
+// fill det->changes, stamped timestamp_us. Points whose read failed keep
+// their last value. Return the number of changes.
+int modbus_change_update(modbus_change_detector_t *det, uint64_t timestamp_us);
+
+// forget the last values, the next update reports every point as first
+void modbus_change_reset(modbus_change_detector_t *det);
@@ -0,0 +1,429 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "modbus_gateway.h"
+#include "utils.h"
+
+
+static void gateway_schedule(mb_gateway_t *self, int b);
+
+static mb_gateway_request_t *gateway_alloc_request(mb_gateway_t *self)
+{
+    mb_gateway_request_t *req = self->free_requests;
+    if (req) {
+        self->free_requests = req->next;
+        req->next = NULL;
+    }
+    return req;
+}
+
+static void gateway_free_request(mb_gateway_t *self, mb_gateway_request_t *req)
+{
+    req->client = NULL;
+    req->next = self->free_requests;
+    self->free_requests = req;
+}
+
+static void gateway_close_client(mb_gateway_client_t *client)
+{
+    mb_gateway_t *self = client->gateway;
+
+    // drop what wasn't handed to a bus yet, orphan what is on the wire
+    for (int b = 0; b < self->nbuses; b++) {
+        while (client->head[b]) {
+            mb_gateway_request_t *req = client->head[b];
+            client->head[b] = req->next;
+            gateway_free_request(self, req);
+        }
+        client->tail[b] = NULL;
+    }
+    for (int i = 0; i < MB_GATEWAY_MAX_PENDING; i++) {
+        if (self->requests[i].client == client)
+            self->requests[i].client = NULL;
+    }
+
+    mb_loop_remove_fd(self->loop, client->watch);
+    close(client->fd);
+    client->watch = NULL;
+    client->fd = -1;
+    client->pending = 0;
+    client->rx_len = 0;
+    client->tx_len = 0;
+}
+
+static void gateway_flush(mb_gateway_client_t *client)
+{
+    int total = 0;
+    while (total < client->tx_len) {
+        ssize_t n = send(client->fd, client->tx_buf + total, (size_t)(client->tx_len - total),
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            Log_Debug("gateway send error:%s\n", strerror(errno));
+            gateway_close_client(client);
+            return;
+        }
+        total += (int)n;
+    }
+
+    client->tx_len -= total;
+    memmove(client->tx_buf, client->tx_buf + total, (size_t)client->tx_len);
+    mb_loop_modify_fd(client->gateway->loop, client->watch, EPOLLIN | (client->tx_len ? EPOLLOUT : 0));
+}
+
+// send mbap header with the length fixed up for pdu, then pdu
+static void gateway_reply(mb_gateway_client_t *client, const uint8_t *mbap, const uint8_t *pdu, int pdu_len)
+{
+    if (client->tx_len + MODBUS_TCP_MBAP_SIZE + pdu_len > MB_GATEWAY_CLIENT_BUF_SIZE) {
+        Log_Debug("gateway client not reading responses, closing\n");
+        gateway_close_client(client);
+        return;
+    }
+
+    uint8_t *out = client->tx_buf + client->tx_len;
+    memcpy(out, mbap, MODBUS_TCP_MBAP_SIZE);
+    out[4] = (uint8_t)((pdu_len + 1) >> 8);
+    out[5] = (uint8_t)((pdu_len + 1) & 0xFF);
+    memcpy(out + MODBUS_TCP_MBAP_SIZE, pdu, (size_t)pdu_len);
+    client->tx_len += MODBUS_TCP_MBAP_SIZE + pdu_len;
+
+    client->gateway->stats.responses++;
+    gateway_flush(client);
+}
+
+static void gateway_exception(mb_gateway_client_t *client, const uint8_t *mbap, uint8_t function, uint8_t code)
+{
+    uint8_t pdu[2] = {(uint8_t)(function | 0x80), code};
+    client->gateway->stats.exceptions++;
+    gateway_reply(client, mbap, pdu, sizeof(pdu));
+}
+
+// a broadcast on the bus gets no response, the tcp client does. Answer with
+// the echo a slave would send for the write.
+static int gateway_echo_len(const uint8_t *pdu, int pdu_len)
+{
+    if (pdu[0] == FC_WRITE_COILS || pdu[0] == FC_WRITE_HOLDING_REGISTERS)
+        return 5; // function code + addr + quantity
+    return pdu_len;
+}
+
+static void gateway_on_bus_response(modbus_device_t *device, int result, const uint8_t *pdu, int pdu_len, void *ctx)
+{
+    mb_gateway_request_t *req = (mb_gateway_request_t *)ctx;
+    mb_gateway_t *self = req->gateway;
+    mb_gateway_client_t *client = req->client;
+    int b = req->bus;
+    self->buses[b].inflight--;
+
+    if (!client) {
+        self->stats.dropped++;
+    } else {
+        client->pending--;
+        if (result == DEVICE_OK && !pdu)
+            gateway_reply(client, req->mbap, req->pdu, gateway_echo_len(req->pdu, req->pdu_len));
+        else if (result == DEVICE_OK)
+            gateway_reply(client, req->mbap, pdu, pdu_len);
+        else
+            gateway_exception(client, req->mbap, req->pdu[0], MB_EX_GATEWAY_TARGET_FAILED);
+    }
+    gateway_free_request(self, req);
+
+    // queue the next frame before the async bus looks for one
+    gateway_schedule(self, b);
+}
+
+// hand requests to bus b, taking one per client in round robin, until the
+// bus has MB_GATEWAY_BUS_DEPTH requests
+static void gateway_schedule(mb_gateway_t *self, int b)
+{
+    mb_gateway_bus_t *bus = &self->buses[b];
+
+    while (bus->inflight < MB_GATEWAY_BUS_DEPTH) {
+        mb_gateway_client_t *client = NULL;
+        for (int k = 0; k < MB_GATEWAY_MAX_CLIENTS && !client; k++) {
+            int c = (bus->next_client + k) % MB_GATEWAY_MAX_CLIENTS;
+            if (self->clients[c].fd >= 0 && self->clients[c].head[b]) {
+                client = &self->clients[c];
+                bus->next_client = (c + 1) % MB_GATEWAY_MAX_CLIENTS;
+            }
+        }
+        if (!client)
+            return;
+
+        mb_gateway_request_t *req = client->head[b];
+        client->head[b] = req->next;
+        if (!client->head[b])
+            client->tail[b] = NULL;
+        req->next = NULL;
+
+        uint8_t unit_id = req->mbap[6];
+        int err = mb_request_async(bus->device, unit_id, req->pdu, req->pdu_len, self->timeout_ms,
+                                   gateway_on_bus_response, req);
+        if (err) {
+            client->pending--;
+            gateway_exception(client, req->mbap, req->pdu[0], MB_EX_GATEWAY_TARGET_FAILED);
+            gateway_free_request(self, req);
+            continue;
+        }
+        bus->inflight++;
+        self->stats.forwarded++;
+    }
+}
+
+static void gateway_request(mb_gateway_client_t *client, const uint8_t *frame, int frame_len)
+{
+    mb_gateway_t *self = client->gateway;
+    const uint8_t *pdu = frame + MODBUS_TCP_MBAP_SIZE;
+    int pdu_len = frame_len - MODBUS_TCP_MBAP_SIZE;
+    uint8_t b = self->unit_bus[frame[6]];
+    self->stats.requests++;
+
+    if (b == MB_GATEWAY_NO_BUS) {
+        gateway_exception(client, frame, pdu[0], MB_EX_GATEWAY_PATH_UNAVAILABLE);
+        return;
+    }
+
+    mb_gateway_request_t *req =
+        client->pending < MB_GATEWAY_CLIENT_MAX_PENDING ? gateway_alloc_request(self) : NULL;
+    if (!req) {
+        gateway_exception(client, frame, pdu[0], MB_EX_SERVER_BUSY);
+        return;
+    }
+
+    req->client = client;
+    memcpy(req->mbap, frame, MODBUS_TCP_MBAP_SIZE);
+    memcpy(req->pdu, pdu, (size_t)pdu_len);
+    req->pdu_len = pdu_len;
+    req->bus = b;
+
+    if (client->tail[b])
+        client->tail[b]->next = req;
+    else
+        client->head[b] = req;
+    client->tail[b] = req;
+    client->pending++;
+
+    gateway_schedule(self, b);
+}
+
+static void gateway_on_client(mb_watch_t *watch, int fd, uint32_t events, void *ctx)
+{
+    mb_gateway_client_t *client = (mb_gateway_client_t *)ctx;
+
+    if (events & EPOLLOUT) {
+        gateway_flush(client);
+        if (client->fd < 0)
+            return;
+    }
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+        return;
+
+    ssize_t n = recv(fd, client->rx_buf + client->rx_len, (size_t)(MB_GATEWAY_CLIENT_BUF_SIZE - client->rx_len),
+                     MSG_DONTWAIT);
+    if (n <= 0) {
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        gateway_close_client(client);
+        return;
+    }
+    client->rx_len += (int)n;
+
+    int consumed = 0;
+    while (client->rx_len - consumed >= MODBUS_TCP_MBAP_SIZE) {
+        const uint8_t *frame = client->rx_buf + consumed;
+        int length = (frame[4] << 8) + frame[5]; // unit id + pdu
+        if (frame[2] != 0 || frame[3] != 0 || length < 2 || length > MODBUS_MAX_PDU_SIZE + 1) {
+            Log_Debug("Invalid mbap header:%s\n", hex(frame, MODBUS_TCP_MBAP_SIZE));
+            gateway_close_client(client);
+            return;
+        }
+
+        int frame_len = MODBUS_TCP_MBAP_SIZE - 1 + length;
+        if (client->rx_len - consumed < frame_len)
+            break;
+        gateway_request(client, frame, frame_len);
+        if (client->fd < 0)
+            return;
+        consumed += frame_len;
+    }
+
+    client->rx_len -= consumed;
+    memmove(client->rx_buf, client->rx_buf + consumed, (size_t)client->rx_len);
+}
+
+static void gateway_on_accept(mb_watch_t *watch, int fd, uint32_t events, void *ctx)
+{
+    mb_gateway_t *self = (mb_gateway_t *)ctx;
+
+    int client_fd = accept(fd, NULL, NULL);
+    if (client_fd < 0)
+        return;
+    fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(client_fd, F_SETFD, FD_CLOEXEC);
+
+    mb_gateway_client_t *client = NULL;
+    for (int i = 0; i < MB_GATEWAY_MAX_CLIENTS && !client; i++) {
+        if (self->clients[i].fd < 0)
+            client = &self->clients[i];
+    }
+    if (!client) {
+        Log_Debug("gateway: too many clients\n");
+        close(client_fd);
+        return;
+    }
+
+    int one = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    client->watch = mb_loop_add_fd(self->loop, client_fd, EPOLLIN, gateway_on_client, client);
+    if (!client->watch) {
+        close(client_fd);
+        return;
+    }
+    client->fd = client_fd;
+    self->stats.connections++;
+}
+
+static void gateway_stop_timer(mb_timer_t *timer, void *ctx)
+{
+    mb_gateway_stop((mb_gateway_t *)ctx);
+}
+
+
+// --------------------- public interface ---------------------------------------
+
+mb_gateway_t *mb_gateway_create(const char *addr, uint16_t port)
+{
+    mb_gateway_t *self = (mb_gateway_t *)calloc(1, sizeof(mb_gateway_t));
+    self->timeout_ms = MB_GATEWAY_TIMEOUT_MS;
+    self->listen_fd = -1;
+    memset(self->unit_bus, MB_GATEWAY_NO_BUS, sizeof(self->unit_bus));
+    for (int i = 0; i < MB_GATEWAY_MAX_CLIENTS; i++) {
+        self->clients[i].gateway = self;
+        self->clients[i].fd = -1;
+    }
+    for (int i = MB_GATEWAY_MAX_PENDING - 1; i >= 0; i--) {
+        self->requests[i].gateway = self;
+        gateway_free_request(self, &self->requests[i]);
+    }
+
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    socklen_t sa_len = sizeof(sa);
+
+    int one = 1;
+    self->loop = mb_loop_create();
+    if (!self->loop || inet_pton(AF_INET, addr, &sa.sin_addr) != 1 ||
+        (self->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+        setsockopt(self->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+        bind(self->listen_fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 ||
+        listen(self->listen_fd, MB_GATEWAY_MAX_CLIENTS) != 0 ||
+        getsockname(self->listen_fd, (struct sockaddr *)&sa, &sa_len) != 0 ||
+        !(self->listen_watch = mb_loop_add_fd(self->loop, self->listen_fd, EPOLLIN, gateway_on_accept, self))) {
+        Log_Debug("Failed to listen on %s:%u:%s\n", addr, port, strerror(errno));
+        mb_gateway_destroy(self);
+        return NULL;
+    }
+
+    self->port = ntohs(sa.sin_port);
+    return self;
+}
+
+void mb_gateway_destroy(mb_gateway_t *self)
+{
+    if (!self)
+        return;
+
+    for (int i = 0; i < MB_GATEWAY_MAX_CLIENTS; i++) {
+        if (self->clients[i].fd >= 0)
+            gateway_close_client(&self->clients[i]);
+    }
+    if (self->loop) {
+        // completes requests still on the wire, their clients are gone
+        for (int b = 0; b < self->nbuses; b++)
+            mb_loop_remove_device(self->loop, self->buses[b].device);
+        mb_loop_remove_fd(self->loop, self->listen_watch);
+        mb_loop_destroy(self->loop);
+    }
+    if (self->listen_fd >= 0)
+        close(self->listen_fd);
+    free(self);
+}
+
+int mb_gateway_add_bus(mb_gateway_t *self, modbus_device_t *device, uint8_t first_unit, uint8_t last_unit)
+{
+    int b = -1;
+    for (int i = 0; i < self->nbuses; i++) {
+        if (self->buses[i].device == device)
+            b = i;
+    }
+
+    if (b < 0) {
+        if (self->nbuses == MB_GATEWAY_MAX_BUSES || mb_loop_add_device(self->loop, device) != DEVICE_OK)
+            return -1;
+        b = self->nbuses++;
+        self->buses[b].device = device;
+    }
+
+    for (int unit = first_unit; unit <= last_unit; unit++)
+        self->unit_bus[unit] = (uint8_t)b;
+    return b;
+}
+
+void mb_gateway_set_timeout(mb_gateway_t *self, int32_t timeout_ms)
+{
+    self->timeout_ms = timeout_ms;
+}
+
+uint16_t mb_gateway_port(mb_gateway_t *self)
+{
+    return self->port;
+}
+
+int mb_gateway_run(mb_gateway_t *self, uint32_t duration_ms)
+{
+    self->running = true;
+    mb_timer_t *stop = duration_ms ? mb_loop_add_timer(self->loop, duration_ms, 0, gateway_stop_timer, self) : NULL;
+
+    int result = DEVICE_OK;
+    while (self->running) {
+        if (mb_loop_dispatch(self->loop, -1) < 0) {
+            result = DEVICE_E_IO;
+            break;
+        }
+    }
+    self->running = false;
+
+    if (stop)
+        mb_loop_remove_timer(self->loop, stop);
+    return result;
+}
+
+void mb_gateway_stop(mb_gateway_t *self)
+{
+    self->running = false;
+}
+
+void mb_gateway_print_stats(mb_gateway_t *self)
+{
+    const mb_gateway_stats_t *s = &self->stats;
+    Log_Debug("gateway: %lu connections, %lu requests, %lu forwarded, %lu responses, %lu exceptions, %lu dropped\n",
+              s->connections, s->requests, s->forwarded, s->responses, s->exceptions, s->dropped);
+    for (int b = 0; b < self->nbuses; b++) {
+        Log_Debug("bus %d: %d in flight, %d queued in the async master\n", b, self->buses[b].inflight,
+                  mb_async_pending(self->buses[b].device));
+    }
+}
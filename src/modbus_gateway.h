@@ -0,0 +1,118 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "modbus.h"
+#include "modbus_async.h"
+
+// Modbus TCP to RTU gateway. Requests of TCP clients are routed by unit id to
+// an RTU bus and queued per client and bus. Each bus takes the next request
+// from its clients in round robin, so a chatty client can't starve the
+// others, and always has the next frame queued so the half duplex line never
+// idles between transactions. Responses go back with the client's MBAP
+// transaction id and unit id. Writes to unit id 0, when routed, are broadcast
+// on the bus and answered with the write echo once sent.
+//
+//   mb_gateway_t *gw = mb_gateway_create("0.0.0.0", MODBUS_TCP_DEFAULT_PORT);
+//   mb_gateway_add_bus(gw, device, 1, 247);   // opened rtu device
+//   mb_gateway_run(gw, 0);
+
+#define MB_GATEWAY_MAX_BUSES 8
+#define MB_GATEWAY_MAX_CLIENTS 8
+#define MB_GATEWAY_MAX_PENDING 64        // requests queued or in flight, all clients
+#define MB_GATEWAY_CLIENT_MAX_PENDING 16 // per client, more are answered with server busy
+#define MB_GATEWAY_BUS_DEPTH 2           // requests handed to a bus ahead of time
+#define MB_GATEWAY_TIMEOUT_MS 1000
+#define MB_GATEWAY_CLIENT_BUF_SIZE 1024
+#define MB_GATEWAY_NO_BUS 0xFF
+
+// exception codes the gateway answers itself
+#define MB_EX_SERVER_BUSY 0x06
+#define MB_EX_GATEWAY_PATH_UNAVAILABLE 0x0A
+#define MB_EX_GATEWAY_TARGET_FAILED 0x0B
+
+typedef struct mb_gateway_stats_t mb_gateway_stats_t;
+struct mb_gateway_stats_t {
+    unsigned long connections; // accepted tcp connections
+    unsigned long requests;    // requests received
+    unsigned long forwarded;   // requests sent on a bus
+    unsigned long responses;   // responses sent back
+    unsigned long exceptions;  // exceptions made up by the gateway
+    unsigned long dropped;     // responses whose client disconnected
+};
+
+typedef struct mb_gateway_t mb_gateway_t;
+typedef struct mb_gateway_client_t mb_gateway_client_t;
+
+// a request from receipt until its response is sent
+typedef struct mb_gateway_request_t mb_gateway_request_t;
+struct mb_gateway_request_t {
+    mb_gateway_t *gateway;
+    mb_gateway_client_t *client; // NULL once the client disconnected
+    uint8_t mbap[MODBUS_TCP_MBAP_SIZE]; // client header, echoed in the response
+    uint8_t pdu[MODBUS_MAX_PDU_SIZE];
+    int pdu_len;
+    uint8_t bus;
+    mb_gateway_request_t *next; // client queue or free list
+};
+
+struct mb_gateway_client_t {
+    mb_gateway_t *gateway;
+    int fd; // -1 if the slot is free
+    mb_watch_t *watch;
+    int pending; // requests queued or in flight
+
+    // per bus fifo of requests not handed to the bus yet
+    mb_gateway_request_t *head[MB_GATEWAY_MAX_BUSES];
+    mb_gateway_request_t *tail[MB_GATEWAY_MAX_BUSES];
+
+    uint8_t rx_buf[MB_GATEWAY_CLIENT_BUF_SIZE];
+    int rx_len;
+    uint8_t tx_buf[MB_GATEWAY_CLIENT_BUF_SIZE]; // responses the socket didn't take yet
+    int tx_len;
+};
+
+typedef struct mb_gateway_bus_t mb_gateway_bus_t;
+struct mb_gateway_bus_t {
+    modbus_device_t *device;
+    int inflight;   // requests handed to the bus
+    int next_client; // round robin position
+};
+
+struct mb_gateway_t {
+    mb_loop_t *loop;
+    int listen_fd;
+    uint16_t port;
+    mb_watch_t *listen_watch;
+    int32_t timeout_ms;
+    volatile bool running;
+
+    mb_gateway_bus_t buses[MB_GATEWAY_MAX_BUSES];
+    int nbuses;
+    uint8_t unit_bus[256]; // bus index per unit id, MB_GATEWAY_NO_BUS if not routed
+
+    mb_gateway_client_t clients[MB_GATEWAY_MAX_CLIENTS];
+    mb_gateway_request_t requests[MB_GATEWAY_MAX_PENDING];
+    mb_gateway_request_t *free_requests;
+
+    mb_gateway_stats_t stats;
+};
+
+// listen on addr:port, an ipv4 address. Port 0 picks a free one, see
+// mb_gateway_port
+mb_gateway_t *mb_gateway_create(const char *addr, uint16_t port);
+void mb_gateway_destroy(mb_gateway_t *self);
+
+// route unit ids first_unit..last_unit to an opened rtu device, return the
+// bus index or -1. The gateway doesn't own the device.
+int mb_gateway_add_bus(mb_gateway_t *self, modbus_device_t *device, uint8_t first_unit, uint8_t last_unit);
+
+// response timeout on the rtu buses, default MB_GATEWAY_TIMEOUT_MS
+void mb_gateway_set_timeout(mb_gateway_t *self, int32_t timeout_ms);
+
+uint16_t mb_gateway_port(mb_gateway_t *self);
+
+// dispatch events for duration_ms, or until mb_gateway_stop when 0
+int mb_gateway_run(mb_gateway_t *self, uint32_t duration_ms);
+void mb_gateway_stop(mb_gateway_t *self);
+
+void mb_gateway_print_stats(mb_gateway_t *self);
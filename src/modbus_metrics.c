@@ -0,0 +1,119 @@
+#include "modbus_metrics.h"
+
+
+static int histogram_bucket(uint64_t us)
+{
+    if (us >= MB_HISTOGRAM_MAX_US)
+        us = MB_HISTOGRAM_MAX_US - 1;
+    if (us < MB_HISTOGRAM_SUB_BUCKETS)
+        return (int)us;
+
+    // power of 2 picks the row, the next SUB_BITS bits the bucket in it
+    int msb = 63 - __builtin_clzll(us);
+    int shift = msb - MB_HISTOGRAM_SUB_BITS;
+    return (shift + 1) * MB_HISTOGRAM_SUB_BUCKETS + (int)((us >> shift) & (MB_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+// largest value falling into bucket
+static uint64_t histogram_bucket_max(int bucket)
+{
+    if (bucket < MB_HISTOGRAM_SUB_BUCKETS)
+        return (uint64_t)bucket;
+
+    int shift = bucket / MB_HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t sub = (uint64_t)(bucket % MB_HISTOGRAM_SUB_BUCKETS) + MB_HISTOGRAM_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+
+// --------------------- public interface ---------------------------------------
+
+void mb_histogram_record(mb_histogram_t *h, uint64_t us)
+{
+    uint32_t v = us < MB_HISTOGRAM_MAX_US ? (uint32_t)us : MB_HISTOGRAM_MAX_US;
+    if (h->count == 0 || v < h->min_us)
+        h->min_us = v;
+    if (v > h->max_us)
+        h->max_us = v;
+    h->count++;
+    h->sum_us += us;
+    h->buckets[histogram_bucket(us)]++;
+}
+
+uint64_t mb_histogram_percentile(const mb_histogram_t *h, double percentile)
+{
+    if (h->count == 0)
+        return 0;
+
+    // rank of the value, 1 based, the max for 100
+    uint64_t rank = (uint64_t)(percentile / 100.0 * h->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank >= h->count)
+        return h->max_us;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < MB_HISTOGRAM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t us = histogram_bucket_max(i);
+            return us < h->max_us ? us : h->max_us;
+        }
+    }
+    return h->max_us;
+}
+
+void modbus_metrics_record(modbus_metrics_t *m, modbus_slave_metrics_t *slave, uint8_t function_code, int result,
+                           const modbus_timing_t *timing)
+{
+    if (result < 0 || result >= DEVICE_E_COUNT)
+        result = DEVICE_E_INTERNAL;
+
+    m->transactions++;
+    m->by_function[function_code & 0x7F]++;
+    m->by_result[result]++;
+    if (slave) {
+        slave->transactions++;
+        slave->by_result[result]++;
+    }
+
+    // only complete transactions say something about latency
+    if (result != DEVICE_OK || !timing)
+        return;
+    if (timing->send_us)
+        mb_histogram_record(&m->send, timing->send_us);
+    if (timing->first_byte_us)
+        mb_histogram_record(&m->first_byte, timing->first_byte_us);
+    if (timing->frame_us) {
+        mb_histogram_record(&m->frame, timing->frame_us);
+        if (slave)
+            mb_histogram_record(&slave->frame, timing->frame_us);
+    }
+}
+
+static void histogram_print(const char *name, const mb_histogram_t *h)
+{
+    if (h->count == 0)
+        return;
+    Log_Debug("%-10s %-8u %-8.2f %-8.2f %-8.2f %-8.2f %.2f\n", name, h->count, h->min_us / 1e3,
+              (double)h->sum_us / h->count / 1e3, mb_histogram_percentile(h, 50) / 1e3,
+              mb_histogram_percentile(h, 99) / 1e3, h->max_us / 1e3);
+}
+
+void modbus_metrics_print(const modbus_metrics_t *m)
+{
+    Log_Debug("%u transactions, %u crc errors, %u garbage bytes\n", m->transactions, m->crc_errors,
+              m->garbage_bytes);
+    for (int fc = 0; fc < MB_METRICS_FUNCTIONS; fc++) {
+        if (m->by_function[fc])
+            Log_Debug("  fc 0x%02X: %u\n", fc, m->by_function[fc]);
+    }
+    for (int err = 0; err < DEVICE_E_COUNT; err++) {
+        if (m->by_result[err])
+            Log_Debug("  %s: %u\n", strerr(err), m->by_result[err]);
+    }
+    Log_Debug("latency    count    min(ms)  avg(ms)  p50(ms)  p99(ms)  max(ms)\n");
+    histogram_print("send", &m->send);
+    histogram_print("first byte", &m->first_byte);
+    histogram_print("frame", &m->frame);
+}
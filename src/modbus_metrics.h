@@ -0,0 +1,66 @@
+#pragma once
+#include <stdint.h>
+#include "utils.h"
+
+// Transaction metrics of a device, always on and cheap enough for
+// production: counts by function code and by DEVICE_E_* result, link error
+// counters and latency histograms. Histograms are log linear like HDR
+// histograms, 8 buckets per power of 2, so percentiles are within 12.5% from
+// 1 us up to 2^30 us in under 1 KB each.
+
+#define MB_HISTOGRAM_SUB_BITS 3
+#define MB_HISTOGRAM_SUB_BUCKETS (1 << MB_HISTOGRAM_SUB_BITS)
+#define MB_HISTOGRAM_MAX_US (1u << 30)
+#define MB_HISTOGRAM_BUCKETS ((30 - MB_HISTOGRAM_SUB_BITS + 1) * MB_HISTOGRAM_SUB_BUCKETS)
+
+#define MB_METRICS_FUNCTIONS 128 // function codes without the exception bit
+#define MB_METRICS_MAX_SLAVE 247
+
+typedef struct mb_histogram_t mb_histogram_t;
+struct mb_histogram_t {
+    uint32_t count;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint64_t sum_us;
+    uint32_t buckets[MB_HISTOGRAM_BUCKETS];
+};
+
+// phases of one transaction in us, 0 if not measured
+typedef struct modbus_timing_t modbus_timing_t;
+struct modbus_timing_t {
+    uint64_t send_us;       // request from first byte written until on the wire
+    uint64_t first_byte_us; // end of request until the first response byte
+    uint64_t frame_us;      // end of request until the whole response was in
+};
+
+typedef struct modbus_slave_metrics_t modbus_slave_metrics_t;
+struct modbus_slave_metrics_t {
+    uint32_t transactions;
+    uint32_t by_result[DEVICE_E_COUNT];
+    mb_histogram_t frame;
+};
+
+typedef struct modbus_metrics_t modbus_metrics_t;
+struct modbus_metrics_t {
+    uint32_t transactions;
+    uint32_t by_function[MB_METRICS_FUNCTIONS];
+    uint32_t by_result[DEVICE_E_COUNT];
+    uint32_t crc_errors;    // rtu frames failing the crc check
+    uint32_t garbage_bytes; // unexpected rtu bytes dropped before sending
+    mb_histogram_t send;
+    mb_histogram_t first_byte;
+    mb_histogram_t frame;
+};
+
+
+void mb_histogram_record(mb_histogram_t *h, uint64_t us);
+// upper bound of the bucket holding the percentile, 0 if empty
+uint64_t mb_histogram_percentile(const mb_histogram_t *h, double percentile);
+
+// count a transaction with slave_id, timing of successful ones goes into the
+// histograms. slave may be NULL to only count on the device.
+void modbus_metrics_record(modbus_metrics_t *m, modbus_slave_metrics_t *slave, uint8_t function_code, int result,
+                           const modbus_timing_t *timing);
+
+// log counts and p50/p99/max of the histograms
+void modbus_metrics_print(const modbus_metrics_t *m);
@@ -0,0 +1,47 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+// Transport independent PDU encoding and parsing shared by the blocking
+// calls in modbus.c and the event driven paths.
+
+// exception codes
+#define MB_EX_ILLEGAL_FUNCTION 0x01
+#define MB_EX_ILLEGAL_ADDRESS 0x02
+#define MB_EX_ILLEGAL_VALUE 0x03
+#define MB_EX_SERVER_FAILURE 0x04
+
+// function code reading/writing reg_type, 0 if the type can't be read/written.
+// Writes of a single value use the shorter write single coil/register.
+uint8_t mb_read_function(uint8_t reg_type);
+uint8_t mb_write_function(uint8_t reg_type, uint16_t quantity);
+// register type read by a function code, INVALID if it isn't a read
+uint8_t mb_read_type(uint8_t function_code);
+// register type and range written by a request pdu, INVALID if it writes no
+// coils or holding registers
+uint8_t mb_write_range(const uint8_t *request, uint16_t *addr, uint16_t *quantity);
+// writes only, a broadcast gets no response to carry values read
+bool mb_broadcast_allowed(uint8_t function_code);
+
+// length of the request pdu at the head of pdu, 0 if more than avail bytes
+// are needed to tell, -1 if the function code is unknown
+int mb_request_pdu_len(const uint8_t *pdu, int avail);
+
+// encode request pdu into request, return pdu length. Read requests need
+// MODBUS_READ_REQUEST_FRAME_LENGTH bytes, write requests up to MODBUS_MAX_PDU_SIZE.
+int mb_encode_read_request(uint8_t *request, uint8_t function_code, uint16_t addr, uint16_t quantity);
+int mb_encode_write_request(uint8_t *request, uint8_t function_code, uint16_t addr, uint16_t quantity,
+                            const uint16_t *regs);
+// write coils (0x0F, or 0x05 for one) from a bitmap, lowest address in bit 0
+int mb_encode_write_bits_request(uint8_t *request, uint16_t addr, uint16_t quantity, const uint8_t *bits);
+// mask write (0x16) sets a register to (value & and_mask) | (or_mask & ~and_mask),
+// read/write multiple (0x17) writes and then reads holding registers
+int mb_encode_mask_write_request(uint8_t *request, uint16_t addr, uint16_t and_mask, uint16_t or_mask);
+int mb_encode_read_write_request(uint8_t *request, uint16_t read_addr, uint16_t read_quantity, uint16_t write_addr,
+                                 uint16_t write_quantity, const uint16_t *regs);
+
+// check response pdu against request pdu, read responses are decoded to regs.
+// mb_check_read_response only checks, the payload is at response + 2.
+int mb_check_read_response(const uint8_t *request, const uint8_t *response, int len_rsp);
+int mb_parse_read_response(const uint8_t *request, const uint8_t *response, int len_rsp, uint16_t *regs);
+int mb_parse_write_response(const uint8_t *request, const uint8_t *response, int len_rsp);
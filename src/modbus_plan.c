@@ -0,0 +1,220 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "modbus_plan.h"
+#include "utils.h"
+#include "platform.h"
+
+typedef struct plan_key_t {
+    uint32_t key;
+    int index;
+} plan_key_t;
+
+static int compare_key(const void *a, const void *b)
+{
+    const plan_key_t *ka = (const plan_key_t *)a;
+    const plan_key_t *kb = (const plan_key_t *)b;
+    if (ka->key != kb->key)
+        return ka->key < kb->key ? -1 : 1;
+    // keep caller order for duplicated points
+    return ka->index - kb->index;
+}
+
+static uint16_t max_per_read(uint8_t reg_type)
+{
+    switch (reg_type) {
+    case COIL:
+        return MODBUS_MAX_COIL_PER_READ;
+    case DISCRETE_INPUT:
+        return MODBUS_MAX_DISCRETE_PER_READ;
+    case INPUT_REGISTER:
+        return MODBUS_MAX_INPUT_PER_READ;
+    case HOLDING_REGISTER:
+        return MODBUS_MAX_HOLDING_PER_READ;
+    default:
+        return 0;
+    }
+}
+
+static int build_requests(modbus_plan_t *plan, uint16_t gap)
+{
+    int n = 0;
+    modbus_plan_request_t *req = NULL;
+
+    for (int i = 0; i < plan->npoints; i++) {
+        modbus_point_t *p = &plan->points[plan->order[i]];
+        uint16_t limit = max_per_read(p->reg_type);
+        if (limit == 0) {
+            Log_Debug("Invalid register type %d for point %d\n", p->reg_type, plan->order[i]);
+            return DEVICE_E_INVALID;
+        }
+
+        if (req && req->slave_id == p->slave_id && req->reg_type == p->reg_type) {
+            uint32_t end = (uint32_t)req->addr + req->quantity; // one past last covered address
+            if (p->addr < end) {
+                // duplicated point, already covered
+                req->count++;
+                continue;
+            }
+            if (p->addr - end <= gap && (uint32_t)p->addr - req->addr + 1 <= limit) {
+                req->quantity = (uint16_t)(p->addr - req->addr + 1);
+                req->count++;
+                continue;
+            }
+        }
+
+        req = &plan->requests[n++];
+        req->slave_id = p->slave_id;
+        req->reg_type = p->reg_type;
+        req->addr = p->addr;
+        req->quantity = 1;
+        req->first = i;
+        req->count = 1;
+    }
+
+    plan->nrequests = n;
+    return DEVICE_OK;
+}
+
+
+// --------------------- public interface ---------------------------------------
+
+modbus_plan_t *modbus_plan_create(modbus_point_t *points, int npoints, uint16_t gap)
+{
+    if (!points || npoints <= 0)
+        return NULL;
+
+    modbus_plan_t *plan = (modbus_plan_t *)calloc(1, sizeof(modbus_plan_t));
+    plan_key_t *keys = (plan_key_t *)malloc(sizeof(plan_key_t) * (size_t)npoints);
+    plan->points = points;
+    plan->npoints = npoints;
+    plan->order = (int *)malloc(sizeof(int) * (size_t)npoints);
+    // worst case every point is its own request
+    plan->requests = (modbus_plan_request_t *)calloc((size_t)npoints, sizeof(modbus_plan_request_t));
+    plan->scratch = (uint16_t *)malloc(sizeof(uint16_t) * MODBUS_MAX_COIL_PER_READ);
+
+    if (!keys || !plan->order || !plan->requests || !plan->scratch) {
+        Log_Debug("Failed to allocate plan\n");
+        free(keys);
+        modbus_plan_destroy(plan);
+        return NULL;
+    }
+
+    for (int i = 0; i < npoints; i++) {
+        keys[i].key = ((uint32_t)points[i].slave_id << 24) | ((uint32_t)points[i].reg_type << 16) | points[i].addr;
+        keys[i].index = i;
+    }
+    qsort(keys, (size_t)npoints, sizeof(plan_key_t), compare_key);
+    for (int i = 0; i < npoints; i++) {
+        plan->order[i] = keys[i].index;
+    }
+    free(keys);
+
+    if (build_requests(plan, gap) != DEVICE_OK) {
+        modbus_plan_destroy(plan);
+        return NULL;
+    }
+
+    Log_Debug("Plan: %d points merged into %d requests\n", npoints, plan->nrequests);
+    return plan;
+}
+
+// tcp devices keep a window of requests in flight, each response is parsed
+// into the scratch and scattered before the next one is received
+static int plan_execute_pipelined(modbus_device_t *device, modbus_plan_t *plan, int32_t timeout_ms)
+{
+    int result = DEVICE_OK;
+    int tids[MODBUS_TCP_MAX_INFLIGHT]; // transaction id per window slot, -1 if free
+    int slot_request[MODBUS_TCP_MAX_INFLIGHT];
+    int inflight = 0, next = 0;
+
+    for (int i = 0; i < MODBUS_TCP_MAX_INFLIGHT; i++)
+        tids[i] = -1;
+
+    while (next < plan->nrequests || inflight > 0) {
+        while (next < plan->nrequests && inflight < MODBUS_TCP_MAX_INFLIGHT) {
+            modbus_plan_request_t *req = &plan->requests[next];
+            uint16_t tid;
+            int err = mb_read_submit(device, req->slave_id, req->reg_type, req->addr, req->quantity, &tid, timeout_ms);
+            // busy with none of ours in flight, the window is taken by
+            // requests of another caller and only its completes free it
+            if (err == DEVICE_E_BUSY && inflight > 0)
+                break;
+            if (err) {
+                result = err;
+                modbus_plan_scatter(plan, next++, err);
+                continue;
+            }
+
+            int slot = 0;
+            while (tids[slot] >= 0)
+                slot++;
+            tids[slot] = tid;
+            slot_request[slot] = next++;
+            inflight++;
+        }
+        if (inflight == 0)
+            break;
+
+        int tid;
+        int err = mb_read_complete(device, &tid, plan->scratch, timeout_ms);
+        for (int i = 0; i < MODBUS_TCP_MAX_INFLIGHT; i++) {
+            // no transaction id fails the whole window
+            if (tids[i] < 0 || (tid >= 0 && tids[i] != tid))
+                continue;
+            modbus_plan_scatter(plan, slot_request[i], err);
+            tids[i] = -1;
+            inflight--;
+        }
+        if (err)
+            result = err;
+    }
+
+    return result;
+}
+
+int modbus_plan_execute(modbus_device_t *device, modbus_plan_t *plan, int32_t timeout_ms)
+{
+    if (device->tcp)
+        return plan_execute_pipelined(device, plan, timeout_ms);
+
+    int result = DEVICE_OK;
+
+    for (int r = 0; r < plan->nrequests; r++) {
+        modbus_plan_request_t *req = &plan->requests[r];
+        int err = mb_read_register(device, req->slave_id, req->reg_type, req->addr, req->quantity, plan->scratch,
+                                   timeout_ms);
+        if (err) {
+            result = err;
+        }
+        modbus_plan_scatter(plan, r, err);
+    }
+
+    return result;
+}
+
+void modbus_plan_scatter(modbus_plan_t *plan, int r, int err)
+{
+    modbus_plan_request_t *req = &plan->requests[r];
+    if (err) {
+        Log_Debug("Plan request %d (slave %d addr %d x %d) failed:%s\n", r, req->slave_id, req->addr,
+                  req->quantity, strerr(err));
+    }
+
+    for (int i = req->first; i < req->first + req->count; i++) {
+        modbus_point_t *p = &plan->points[plan->order[i]];
+        p->result = err;
+        if (!err && p->value)
+            *p->value = plan->scratch[p->addr - req->addr];
+    }
+}
+
+void modbus_plan_destroy(modbus_plan_t *plan)
+{
+    if (plan) {
+        free(plan->order);
+        free(plan->requests);
+        free(plan->scratch);
+        free(plan);
+    }
+}
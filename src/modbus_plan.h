@@ -0,0 +1,56 @@
+#pragma once
+#include <stdint.h>
+#include "modbus.h"
+
+// A point is a single coil/discrete input/register read by the planner.
+// Value is scattered to *value after modbus_plan_execute, result holds
+// DEVICE_OK or the error of the request that covered the point.
+typedef struct modbus_point_t modbus_point_t;
+struct modbus_point_t {
+    uint8_t slave_id;
+    uint8_t reg_type;
+    uint16_t addr;
+    uint16_t *value;
+    int result;
+};
+
+// one multi register read request covering points [first, first + count)
+// of the sorted point order
+typedef struct modbus_plan_request_t modbus_plan_request_t;
+struct modbus_plan_request_t {
+    uint8_t slave_id;
+    uint8_t reg_type;
+    uint16_t addr;
+    uint16_t quantity;
+    int first;
+    int count;
+};
+
+typedef struct modbus_plan_t modbus_plan_t;
+struct modbus_plan_t {
+    modbus_point_t *points;
+    int npoints;
+    int *order;
+    modbus_plan_request_t *requests;
+    int nrequests;
+    uint16_t *scratch;
+};
+
+// Merge points into as few read requests as possible. Points of the same slave
+// and register type are merged as long as the request stays within the
+// MODBUS_MAX_*_PER_READ limit and the hole between two neighbour points is not
+// more than gap addresses. Points array must outlive the plan.
+modbus_plan_t *modbus_plan_create(modbus_point_t *points, int npoints, uint16_t gap);
+
+// run all requests of the plan and scatter values to the points. return
+// DEVICE_OK if all requests succeeded, otherwise the last error. A failed
+// request doesn't stop the rest of the plan. On tcp devices up to
+// MODBUS_TCP_MAX_INFLIGHT requests are in flight at once, requests fail with
+// DEVICE_E_BUSY while the window is full of requests submitted by others.
+int modbus_plan_execute(modbus_device_t *device, modbus_plan_t *plan, int32_t timeout_ms);
+
+// scatter the result of request r, read into plan->scratch, to its points.
+// For callers running the requests themselves, e.g. asynchronously.
+void modbus_plan_scatter(modbus_plan_t *plan, int r, int err);
+
+void modbus_plan_destroy(modbus_plan_t *plan);
@@ -0,0 +1,227 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "modbus_poller.h"
+#include "utils.h"
+
+
+static void poller_next_request(mb_poller_bus_t *bus);
+static void poller_start_scan(mb_poller_bus_t *bus);
+static void poller_on_retry(mb_timer_t *timer, void *ctx);
+
+static void poller_scan_done(mb_poller_bus_t *bus)
+{
+    uint64_t elapse_us = timer_monotonic_us() - bus->scan_start_us;
+    bus->next_request = -1;
+    bus->stats.scans++;
+    bus->stats.busy_us += elapse_us;
+    bus->stats.last_scan_us = elapse_us;
+    if (elapse_us > bus->stats.max_scan_us)
+        bus->stats.max_scan_us = elapse_us;
+
+    mb_poller_t *poller = bus->poller;
+    if (poller->on_scan)
+        poller->on_scan(poller, (int)(bus - poller->buses), bus->scan_result, poller->ctx);
+}
+
+static void poller_on_response(modbus_device_t *device, int result, void *ctx)
+{
+    mb_poller_bus_t *bus = (mb_poller_bus_t *)ctx;
+
+    bus->stats.transactions++;
+    if (result != DEVICE_OK) {
+        bus->stats.errors++;
+        bus->scan_result = result;
+    }
+    modbus_plan_scatter(bus->plan, bus->next_request, result);
+
+    bus->next_request++;
+    poller_next_request(bus);
+}
+
+// requests of a plan share plan->scratch, so they run one at a time
+static void poller_next_request(mb_poller_bus_t *bus)
+{
+    while (bus->next_request < bus->plan->nrequests) {
+        modbus_plan_request_t *req = &bus->plan->requests[bus->next_request];
+        int err = mb_read_register_async(bus->device, req->slave_id, req->reg_type, req->addr, req->quantity,
+                                         bus->plan->scratch, bus->timeout_ms, poller_on_response, bus);
+        if (err == DEVICE_OK) {
+            bus->submitted++;
+            return;
+        }
+
+        bus->stats.errors++;
+        bus->scan_result = err;
+        modbus_plan_scatter(bus->plan, bus->next_request, err);
+        bus->next_request++;
+    }
+
+    poller_scan_done(bus);
+
+    // back to back scanning when there is no period. If nothing could be
+    // submitted, back off instead of spinning on the failing bus.
+    if (bus->period_ms == 0 && bus->poller->running) {
+        if (bus->submitted > 0) {
+            poller_start_scan(bus);
+        } else if (!bus->timer) {
+            bus->timer = mb_loop_add_timer(bus->poller->loop, MB_POLLER_RETRY_MS, 0, poller_on_retry, bus);
+        }
+    }
+}
+
+static void poller_start_scan(mb_poller_bus_t *bus)
+{
+    if (bus->next_request >= 0) {
+        // previous scan didn't finish within the period
+        bus->stats.overruns++;
+        return;
+    }
+
+    bus->scan_start_us = timer_monotonic_us();
+    bus->scan_result = DEVICE_OK;
+    bus->submitted = 0;
+    bus->next_request = 0;
+    poller_next_request(bus);
+}
+
+static void poller_on_timer(mb_timer_t *timer, void *ctx)
+{
+    poller_start_scan((mb_poller_bus_t *)ctx);
+}
+
+static void poller_on_retry(mb_timer_t *timer, void *ctx)
+{
+    mb_poller_bus_t *bus = (mb_poller_bus_t *)ctx;
+    mb_loop_remove_timer(bus->poller->loop, timer);
+    bus->timer = NULL;
+    if (bus->poller->running)
+        poller_start_scan(bus);
+}
+
+static void poller_stop_timer(mb_timer_t *timer, void *ctx)
+{
+    mb_poller_stop((mb_poller_t *)ctx);
+}
+
+
+// --------------------- public interface ---------------------------------------
+
+mb_poller_t *mb_poller_create(void)
+{
+    mb_poller_t *poller = (mb_poller_t *)calloc(1, sizeof(mb_poller_t));
+    poller->loop = mb_loop_create();
+    if (!poller->loop) {
+        free(poller);
+        return NULL;
+    }
+    return poller;
+}
+
+void mb_poller_destroy(mb_poller_t *self)
+{
+    if (self) {
+        // the loop completes queued transactions, don't start new scans
+        self->running = false;
+        mb_loop_destroy(self->loop);
+        free(self);
+    }
+}
+
+int mb_poller_add_bus(mb_poller_t *self, modbus_device_t *device, modbus_plan_t *plan, uint32_t period_ms,
+                      int32_t timeout_ms)
+{
+    if (self->nbuses == MB_POLLER_MAX_BUSES || !plan) {
+        return -1;
+    }
+    if (mb_loop_add_device(self->loop, device) != DEVICE_OK) {
+        return -1;
+    }
+
+    mb_poller_bus_t *bus = &self->buses[self->nbuses];
+    memset(bus, 0, sizeof(*bus));
+    bus->poller = self;
+    bus->device = device;
+    bus->plan = plan;
+    bus->period_ms = period_ms;
+    bus->timeout_ms = timeout_ms;
+    bus->next_request = -1;
+    return self->nbuses++;
+}
+
+int mb_poller_run(mb_poller_t *self, uint32_t duration_ms)
+{
+    self->running = true;
+    self->start_us = timer_monotonic_us();
+
+    for (int i = 0; i < self->nbuses; i++) {
+        mb_poller_bus_t *bus = &self->buses[i];
+        memset(&bus->stats, 0, sizeof(bus->stats));
+        if (bus->period_ms) {
+            bus->timer = mb_loop_add_timer(self->loop, 0, bus->period_ms, poller_on_timer, bus);
+        } else {
+            poller_start_scan(bus);
+        }
+    }
+
+    mb_timer_t *stop = duration_ms ? mb_loop_add_timer(self->loop, duration_ms, 0, poller_stop_timer, self) : NULL;
+
+    int result = DEVICE_OK;
+    while (self->running) {
+        if (mb_loop_dispatch(self->loop, -1) < 0) {
+            result = DEVICE_E_IO;
+            break;
+        }
+    }
+    self->running = false;
+
+    for (int i = 0; i < self->nbuses; i++) {
+        mb_poller_bus_t *bus = &self->buses[i];
+        if (bus->timer) {
+            mb_loop_remove_timer(self->loop, bus->timer);
+            bus->timer = NULL;
+        }
+    }
+    if (stop)
+        mb_loop_remove_timer(self->loop, stop);
+
+    // let scans in progress finish so the next run starts clean
+    for (int i = 0; i < self->nbuses; i++) {
+        while (self->buses[i].next_request >= 0 && mb_loop_dispatch(self->loop, -1) >= 0)
+            ;
+    }
+
+    return result;
+}
+
+void mb_poller_stop(mb_poller_t *self)
+{
+    self->running = false;
+}
+
+void mb_poller_get_stats(mb_poller_t *self, int bus, mb_poller_stats_t *stats)
+{
+    if (bus >= 0 && bus < self->nbuses)
+        *stats = self->buses[bus].stats;
+    else
+        memset(stats, 0, sizeof(*stats));
+}
+
+void mb_poller_print_stats(mb_poller_t *self)
+{
+    uint64_t elapse_us = timer_monotonic_us() - self->start_us;
+    double seconds = elapse_us ? elapse_us / 1e6 : 1;
+    unsigned long transactions = 0, errors = 0, scans = 0;
+
+    Log_Debug("bus  scans   tps       err     overrun  scan(ms) max(ms) busy\n");
+    for (int i = 0; i < self->nbuses; i++) {
+        mb_poller_stats_t *s = &self->buses[i].stats;
+        Log_Debug("%-4d %-7lu %-9.1f %-7lu %-8lu %-8.1f %-7.1f %.0f%%\n", i, s->scans, s->transactions / seconds,
+                  s->errors, s->overruns, s->last_scan_us / 1e3, s->max_scan_us / 1e3,
+                  100.0 * (double)s->busy_us / (double)(elapse_us ? elapse_us : 1));
+        transactions += s->transactions;
+        errors += s->errors;
+        scans += s->scans;
+    }
+    Log_Debug("all  %-7lu %-9.1f %lu\n", scans, transactions / seconds, errors);
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include <stdint.h>
+#include "modbus.h"
+#include "modbus_async.h"
+#include "modbus_plan.h"
+
+// Multi bus polling engine. Each bus is a modbus_device_t with a scan plan,
+// all buses are scanned concurrently from one event loop so the scan times
+// of separate RS-485 segments overlap instead of adding up.
+//
+//   mb_poller_t *poller = mb_poller_create();
+//   mb_poller_add_bus(poller, device1, plan1, 1000);
+//   mb_poller_add_bus(poller, device2, plan2, 0);    // scan back to back
+//   mb_poller_run(poller, 60000);
+
+#define MB_POLLER_MAX_BUSES 8
+
+// back off of a back to back scanned bus when nothing could be submitted
+#define MB_POLLER_RETRY_MS 1000
+
+typedef struct mb_poller_stats_t mb_poller_stats_t;
+struct mb_poller_stats_t {
+    unsigned long scans;        // completed scans
+    unsigned long transactions; // completed transactions
+    unsigned long errors;       // failed transactions
+    unsigned long overruns;     // scan still running when the next one was due
+    uint64_t busy_us;           // total time spent scanning
+    uint64_t last_scan_us;      // duration of the last scan
+    uint64_t max_scan_us;       // longest scan
+};
+
+typedef struct mb_poller_bus_t mb_poller_bus_t;
+struct mb_poller_bus_t {
+    struct mb_poller_t *poller;
+    modbus_device_t *device;
+    modbus_plan_t *plan;
+    uint32_t period_ms;
+    int32_t timeout_ms;
+    mb_timer_t *timer;
+
+    int next_request; // next plan request to run, -1 when no scan in progress
+    int scan_result;
+    int submitted; // transactions submitted in this scan
+    uint64_t scan_start_us;
+    mb_poller_stats_t stats;
+};
+
+typedef struct mb_poller_t mb_poller_t;
+struct mb_poller_t {
+    mb_loop_t *loop;
+    mb_poller_bus_t buses[MB_POLLER_MAX_BUSES];
+    int nbuses;
+    uint64_t start_us;
+    volatile bool running;
+
+    // called after each completed scan of a bus, result is DEVICE_OK if all
+    // requests of the scan succeeded
+    void (*on_scan)(mb_poller_t *poller, int bus, int result, void *ctx);
+    void *ctx;
+};
+
+mb_poller_t *mb_poller_create(void);
+void mb_poller_destroy(mb_poller_t *self);
+
+// add an opened device scanning plan every period_ms, 0 scans back to back.
+// return bus index or -1. The poller doesn't own device and plan.
+int mb_poller_add_bus(mb_poller_t *self, modbus_device_t *device, modbus_plan_t *plan, uint32_t period_ms,
+                      int32_t timeout_ms);
+
+// start scanning and dispatch events for duration_ms, or until
+// mb_poller_stop when duration_ms is 0
+int mb_poller_run(mb_poller_t *self, uint32_t duration_ms);
+void mb_poller_stop(mb_poller_t *self);
+
+void mb_poller_get_stats(mb_poller_t *self, int bus, mb_poller_stats_t *stats);
+
+// log per bus and aggregate throughput since mb_poller_run started
+void mb_poller_print_stats(mb_poller_t *self);
@@ -4,32 +4,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/epoll.h>
 #include <time.h>
 #include <unistd.h>
 #include <stdbool.h>
 
-#define UART_STRUCTS_VERSION 1
-#include <applibs/uart.h>
-#include <applibs/log.h>
-#include <applibs/gpio.h>
-
+#include "crc16.h"
 #include "modbus.h"
 #include "modbus_rtu.h"
+#include "modbus_pdu.h"
+#include "rtu_transport.h"
+#include "modbus_trace.h"
 #include "utils.h"
 #include "led.h"
 
-#include <hw/sample_hardware.h>
-
 #define TX_LED 0
 #define RX_LED 1
 
-#define MB_RTU_MAX_ADU_SIZE 256
-#define MB_RTU_HEADER_SIZE 3
+// the status leds are shared by every rtu, opened by the first and closed by the last
+static int led_users;
+
+
 
 #define UART_read read
 #define UART_write write
-#define UART_close close
 
 
 static int rtu_ensure_idle(modbus_rtu_t *self, int timeout)
@@ -43,7 +40,6 @@ static int rtu_ensure_idle(modbus_rtu_t *self, int timeout)
 
     bool quit = false;
     int elapse_ms;
-    uint8_t garbage[MB_RTU_MAX_ADU_SIZE];
     while (!quit) {
         elapse_ms = timer_stopwatch_stop(&poll_sw);
         if (elapse_ms >= timeout) {
@@ -51,15 +47,12 @@ static int rtu_ensure_idle(modbus_rtu_t *self, int timeout)
             continue;
         }
 
+        modbus_rtu_discard_input(self);
         int nevents = poll(fds, 1, 0);
         if (nevents == 0) {
             // no data on rtu
             return 0;
-        } else if (nevents == 1 && (fds[0].revents & POLLIN)) {
-            // Read garbage data in uart buffer up to one frame of 256 bytes.
-            Log_Debug("Consume garbage data: read %d byes of garbage on RTU\n",
-                      UART_read(self->uart_fd, garbage, MB_RTU_MAX_ADU_SIZE));
-        } else {
+        } else if (nevents < 0 || !(fds[0].revents & POLLIN)) {
             Log_Debug("Uart poll error in rtu_ensure_idle: %s\n", strerror(errno));
             quit = true;
         }
@@ -68,43 +61,37 @@ static int rtu_ensure_idle(modbus_rtu_t *self, int timeout)
     return -1;
 }
 
-static uint16_t crc16(const uint8_t *buffer, int len)
+// Compute character time and t1.5/t3.5 silent intervals from baud rate and
+// frame format. One character is start bit + 8 data bits + parity + stop bits.
+static void rtu_update_timing(modbus_rtu_t *self)
 {
-    uint16_t temp, flag;
-    temp = 0xFFFF;
-    for (int i = 0; i < len; i++) {
-        temp = (uint16_t)(temp ^ buffer[i]);
-        for (int j = 1; j <= 8; j++) {
-            flag = temp & 0x0001;
-            temp >>= 1;
-            if (flag)
-                temp ^= 0xA001;
-        }
+    unsigned int bits = 1 + 8 + (self->parity != RTU_PARITY_NONE ? 1 : 0) + self->stop_bits;
+    unsigned int baud = self->baud_rate ? self->baud_rate : 1;
+
+    self->char_us = (bits * 1000000u + baud - 1) / baud;
+    if (self->baud_rate > MODBUS_RTU_FIXED_TIMING_BAUD) {
+        self->t15_us = MODBUS_RTU_FIXED_T15_US;
+        self->t35_us = MODBUS_RTU_FIXED_T35_US;
+    } else {
+        self->t15_us = (self->char_us * 3 + 1) / 2;
+        self->t35_us = (self->char_us * 7 + 1) / 2;
     }
-    return temp & 0xFFFF;
 }
 
-#ifdef TX_ENABLE
-static void tcdrain(modbus_rtu_t *self, size_t count)
+// wait until the bus has been silent for t3.5 since the last character
+static void rtu_wait_frame_gap(modbus_rtu_t *self)
 {
-    // assume 8N1 uart config
-    double bytes_per_second = (double)(self->baud_rate) / 10;
-    long tx_enable_us = (long)(1e6 * count / bytes_per_second);
-    tx_enable_us += 200; // assume 200us processing time
-    struct timespec delay;
-    delay.tv_sec = (long)(tx_enable_us / 1e6);
-    delay.tv_nsec = (tx_enable_us % 1000000) * 1000;
-    nanosleep(&delay, NULL);
+    uint64_t now = timer_monotonic_us();
+    uint64_t ready_at = modbus_rtu_ready_at(self);
+    if (ready_at > now) {
+        timer_sleep_us((long)(ready_at - now));
+    }
 }
-#endif
 
 static int rtu_write_frame(modbus_rtu_t *self, uint8_t *buf, int count, int timeout)
 {
-#ifdef TX_ENABLE
-    if (self->tx_enable_fd >= 0) {
-        GPIO_SetValue(self->tx_enable_fd, GPIO_Value_High);
-    }    
-#endif
+    rtu_wait_frame_gap(self);
+    modbus_rtu_tx_begin(self);
 
     int total = 0, uart_fd = self->uart_fd;
     struct pollfd fds[1];
@@ -140,7 +127,6 @@ static int rtu_write_frame(modbus_rtu_t *self, uint8_t *buf, int count, int time
                 result = DEVICE_E_IO;
                 break;
             } else if (fds[0].revents & POLLOUT) {
-                led_set_color(TX_LED, Led_Colors_Red);
                 int nwrite = UART_write(uart_fd, buf + total, (size_t)(count - total));
                 if (nwrite < 0) {
                     Log_Debug("uart write error:%s\n", strerror(errno));
@@ -152,24 +138,29 @@ static int rtu_write_frame(modbus_rtu_t *self, uint8_t *buf, int count, int time
         }
     }
 
+    modbus_rtu_tx_done(self, total);
+    // log while the frame is still on the wire, not after
+    if (result == DEVICE_OK)
+        mb_trace_frame(MB_TRACE_TX, self->uart_fd, buf, count);
+
 #ifdef TX_ENABLE
     // wait for all sending bytes to be put on wire
-    tcdrain(self, (size_t)count);
-    if (self->tx_enable_fd >= 0) {
-        GPIO_SetValue(self->tx_enable_fd, GPIO_Value_Low);
-    }    
+    timer_sleep_us((long)(modbus_rtu_tx_drained_at(self) - timer_monotonic_us()));
 #endif
-
-    const struct timespec ts_delay = {.tv_sec = 0, .tv_nsec=5*1000000};
-    nanosleep(&ts_delay, NULL);
-    led_set_color(TX_LED, Led_Colors_Off);                
+    modbus_rtu_tx_release(self);
 
     return result;
 }
 
 
-static int find_pdu_len(uint8_t *pdu)
+// Length of the response pdu from its first avail bytes. Return the length,
+// 0 if more bytes are needed to tell, or -1 if the length can't be found
+// from the pdu and the frame end must be detected from t3.5 silence.
+static int find_pdu_len(const uint8_t *pdu, int avail)
 {
+    if (avail < 1)
+        return 0;
+
     // it's error response, pdu is two bytes
     if (pdu[0] & 0x80)
         return 2;
@@ -181,7 +172,7 @@ static int find_pdu_len(uint8_t *pdu)
     case FC_READ_HOLDING_REGISTERS:
     case FC_READ_INPUT_REGISTERS:
         // 1 byte function code + 1 byte byte count + n bytes values
-        length = 2 + pdu[1];
+        length = avail < 2 ? 0 : 2 + pdu[1];
         break;
     case FC_WRITE_COILS:
     case FC_WRITE_HOLDING_REGISTERS:
@@ -203,27 +194,39 @@ static int find_pdu_len(uint8_t *pdu)
         length = 5;
         break;
     case FC_GET_COMM_EVENT_LOG:
-        length = 2 + pdu[1];
-        break;
     case FC_REPORT_SERVER_ID:
-        length = 5;
-        break;
     case FC_READ_FILE_RECORD:
     case FC_WRITE_FILE_RECORD:
-        length = 2 + pdu[1];
+    case FC_READ_WRITE_REGISTERS:
+        // 1 byte function code + 1 byte byte count + n bytes data
+        length = avail < 2 ? 0 : 2 + pdu[1];
         break;
     case FC_MASK_WRITE_REGISTER:
+        // 1 byte function code, 2 bytes addr, 2 bytes and mask, 2 bytes or mask
         length = 7;
         break;
-    case FC_READ_WRITE_REGISTERS:
-        length = 2 + pdu[1];
-        break;
     case FC_READ_FIFO_QUEUE:
-        length = 2 + pdu[1];
+        // 1 byte function code + 2 bytes byte count + n bytes data
+        length = avail < 3 ? 0 : 3 + ((pdu[1] << 8) + pdu[2]);
         break;
     case FC_MEI:
-        // FC_MEI is not supported now as the pdu lenth cann't be found
-        // in pdu and not fixed.
+        // read device identification (MEI type 0x0E): function code, mei type,
+        // read code, conformity, more follows, next object id, number of
+        // objects, then per object 1 byte id + 1 byte length + value.
+        // Other MEI types fall back to silence detection.
+        if (avail < 2)
+            return 0;
+        if (pdu[1] != 0x0E)
+            return -1;
+        if (avail < 7)
+            return 0;
+        length = 7;
+        for (int i = 0; i < pdu[6]; i++) {
+            if (avail < length + 2)
+                return 0;
+            length += 2 + pdu[length + 1];
+        }
+        break;
     default:
         length = -1;
         break;
@@ -233,31 +236,50 @@ static int find_pdu_len(uint8_t *pdu)
 }
 
 
-static int rtu_read_bytes(modbus_rtu_t *self, uint8_t *buf, int count, int timeout)
+// Drain the uart into rx_buf until a full frame is received. The frame end
+// is found from find_pdu_len as soon as the header is in, and from t3.5
+// silence when the pdu length is unknown. On success *frame points into
+// rx_buf and stays valid until the next read.
+static int rtu_read_frame(modbus_rtu_t *self, uint8_t **frame, int *fbytes, int timeout)
 {
-    int result = DEVICE_OK, total = 0, elapse_ms;
+    int result, elapse_ms;
     struct timespec poll_sw;
     struct pollfd fds[1];
     fds[0].fd = self->uart_fd;
     fds[0].events = POLLIN;
     timer_stopwatch_start(&poll_sw);
 
-    while (total < count) {
+    // poll has ms resolution, round t3.5 up
+    int silence_ms = (int)((self->t35_us + 999) / 1000);
+
+    *fbytes = 0;
+    while (true) {
+        result = modbus_rtu_rx_frame(self, false, frame, fbytes);
+        if (result != DEVICE_OK || *fbytes > 0)
+            break;
+
         elapse_ms = timer_stopwatch_stop(&poll_sw);
         if (elapse_ms >= timeout) {
+            Log_Debug("uart receiving timeout\n");
             result = DEVICE_E_TIMEOUT;
             break;
         }
 
-        int nevents = poll(fds, 1, timeout - elapse_ms);
+        // once the frame started, t3.5 of silence ends it
+        int wait_ms = timeout - elapse_ms;
+        if (self->rx_len > 0 && silence_ms < wait_ms)
+            wait_ms = silence_ms;
+
+        int nevents = poll(fds, 1, wait_ms);
         if (nevents < 0) {
             Log_Debug("uart poll in err: %s\n", strerror(errno));
             result = DEVICE_E_IO;
             break;
         } else if (nevents == 0) {
-            Log_Debug("uart receiving timeout\n");
-            result = DEVICE_E_TIMEOUT;
-            break;
+            if (self->rx_len > 0 && timer_monotonic_us() >= self->idle_at_us + self->t35_us) {
+                result = modbus_rtu_rx_frame(self, true, frame, fbytes);
+                break;
+            }
         } else {
             if (fds[0].revents & POLLHUP) {
                 Log_Debug("uart connection broken\n");
@@ -268,49 +290,226 @@ static int rtu_read_bytes(modbus_rtu_t *self, uint8_t *buf, int count, int timeo
                 result = DEVICE_E_IO;
                 break;
             } else if (fds[0].revents & POLLIN) {
-                led_set_color(RX_LED, Led_Colors_Red);
-                int nread = UART_read(fds[0].fd, buf + total, (size_t)(count - total));
-                if (nread < 0) {
-                    Log_Debug("uart read error:%s\n", strerror(errno));
-                    result = DEVICE_E_IO;
+                result = modbus_rtu_rx_read(self);
+                if (result != DEVICE_OK)
                     break;
-                }
-                total += nread;
             }
         }
     }
 
-    const struct timespec ts_delay = {.tv_sec = 0, .tv_nsec=5*1000000};
-    nanosleep(&ts_delay, NULL);
+    return result;
+}
+
+
+// ------------------------ non blocking building blocks --------------------
+
+
+// drop the frame returned by the previous rx_frame, keep what follows it
+static void rtu_rx_consume(modbus_rtu_t *self)
+{
+    if (self->rx_frame_len > 0) {
+        self->rx_len -= self->rx_frame_len;
+        memmove(self->rx_buf, self->rx_buf + self->rx_frame_len, (size_t)self->rx_len);
+        self->rx_frame_len = 0;
+    }
+}
+
+
+int modbus_rtu_seal_adu(uint8_t *adu, uint8_t slave_id, int pdu_len)
+{
+    adu[0] = slave_id;
+
+    // crc for the entrie adu
+    uint16_t crc = crc16(adu, pdu_len + 1);
+    adu[1 + pdu_len] = (uint8_t)(crc & 0xFF);
+    adu[1 + pdu_len + 1] = (uint8_t)((crc >> 8) & 0xFF);
+
+    return pdu_len + 3; // 1 byte slave id + pdu + 2 bytes crc
+}
+
+int modbus_rtu_build_adu(uint8_t *adu, uint8_t slave_id, const uint8_t *pdu, int pdu_len)
+{
+    memcpy(adu + 1, pdu, (size_t)pdu_len);
+    return modbus_rtu_seal_adu(adu, slave_id, pdu_len);
+}
+
+int modbus_rtu_check_frame(modbus_rtu_t *self, uint8_t slave_id, const uint8_t *adu, int adu_len)
+{
+    if (adu[0] != slave_id) {
+        Log_Debug("Discard unexpected frame from slave %d, expected %d\n", adu[0], slave_id);
+        return DEVICE_E_PROTOCOL;
+    }
+
+    uint16_t crc1 = (uint16_t)(adu[adu_len - 2] + (adu[adu_len - 1] << 8));
+    uint16_t crc2 = crc16(adu, adu_len - 2);
+    if (crc1 != crc2) {
+        Log_Debug("CRC error: recv=%x calc=%x\n", crc1, crc2);
+        self->crc_errors++;
+        return DEVICE_E_PROTOCOL;
+    }
+
+    return DEVICE_OK;
+}
+
+void modbus_rtu_get_timing(const modbus_rtu_t *self, modbus_timing_t *timing)
+{
+    uint64_t now = timer_monotonic_us();
+    timing->send_us = self->tx_end_us - self->tx_start_us;
+    timing->first_byte_us = self->rx_first_us > self->tx_end_us ? self->rx_first_us - self->tx_end_us : 0;
+    timing->frame_us = now - self->tx_end_us;
+}
+
+uint64_t modbus_rtu_ready_at(modbus_rtu_t *self)
+{
+    uint64_t ready_at = self->idle_at_us + self->t35_us;
+    return self->hold_until_us > ready_at ? self->hold_until_us : ready_at;
+}
+
+void modbus_rtu_broadcast_sent(modbus_rtu_t *self)
+{
+    unsigned int turnaround_us = self->turnaround_us;
+    if (turnaround_us == 0) {
+        turnaround_us = MODBUS_RTU_TURNAROUND_CHARS * self->char_us;
+        if (turnaround_us < MODBUS_RTU_TURNAROUND_MIN_US)
+            turnaround_us = MODBUS_RTU_TURNAROUND_MIN_US;
+    }
+    self->hold_until_us = self->idle_at_us + self->t35_us + turnaround_us;
+}
+
+void modbus_rtu_discard_input(modbus_rtu_t *self)
+{
+    // anything left in the receive buffer is a late or unexpected frame
+    if (self->rx_len > self->rx_frame_len) {
+        Log_Debug("Discard %d buffered bytes on RTU\n", self->rx_len - self->rx_frame_len);
+        mb_trace_frame(MB_TRACE_DISCARD, self->uart_fd, self->rx_buf + self->rx_frame_len,
+                       self->rx_len - self->rx_frame_len);
+        self->garbage_bytes += (uint32_t)(self->rx_len - self->rx_frame_len);
+    }
+    self->rx_len = 0;
+    self->rx_frame_len = 0;
+
+    uint8_t garbage[MODBUS_RTU_MAX_ADU_SIZE];
+    int nread;
+    while ((nread = UART_read(self->uart_fd, garbage, sizeof(garbage))) > 0) {
+        Log_Debug("Consume garbage data: read %d byes of garbage on RTU\n", nread);
+        mb_trace_frame(MB_TRACE_DISCARD, self->uart_fd, garbage, nread);
+        self->garbage_bytes += (uint32_t)nread;
+        self->idle_at_us = timer_monotonic_us();
+    }
+}
 
+void modbus_rtu_tx_begin(modbus_rtu_t *self)
+{
     led_set_color(RX_LED, Led_Colors_Off);
-    return result;
+    led_set_color(TX_LED, Led_Colors_Red);
+    self->tx_start_us = timer_monotonic_us();
+
+#ifdef TX_ENABLE
+    self->transport->set_tx_enable(self, true);
+#endif
 }
 
+void modbus_rtu_tx_done(modbus_rtu_t *self, int count)
+{
+    // write() returns once bytes are queued in the uart, the last byte is
+    // on the wire one character time per byte after the first write
+    self->idle_at_us = self->tx_start_us + (uint64_t)count * self->char_us;
+}
 
-static int rtu_read_frame(modbus_rtu_t *self, uint8_t *buf, int *fbytes, int timeout)
+uint64_t modbus_rtu_tx_drained_at(modbus_rtu_t *self)
 {
-    // Find pdu len is tricky as we need to parse pdu to figure out
-    // read first three bytes of adu
-    struct timespec poll_sw;
-    timer_stopwatch_start(&poll_sw);
-    int err = rtu_read_bytes(self, buf, MB_RTU_HEADER_SIZE, timeout);
-    if (err) {
-        Log_Debug("Failed to read adu header:%s\n", strerr(err));
-        return err;
+    return self->idle_at_us + MODBUS_RTU_TX_DRAIN_MARGIN_US;
+}
+
+void modbus_rtu_tx_release(modbus_rtu_t *self)
+{
+    self->tx_end_us = timer_monotonic_us();
+#ifdef TX_ENABLE
+    self->transport->set_tx_enable(self, false);
+#endif
+}
+
+int modbus_rtu_rx_read(modbus_rtu_t *self)
+{
+    rtu_rx_consume(self);
+
+    // led only changes on direction switch, see led_set_color
+    led_set_color(TX_LED, Led_Colors_Off);
+    led_set_color(RX_LED, Led_Colors_Red);
+
+    while (self->rx_len < (int)sizeof(self->rx_buf)) {
+        int nread = UART_read(self->uart_fd, self->rx_buf + self->rx_len,
+                              sizeof(self->rx_buf) - (size_t)self->rx_len);
+        if (nread < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                continue;
+            Log_Debug("uart read error:%s\n", strerror(errno));
+            return DEVICE_E_IO;
+        }
+        if (nread == 0)
+            break;
+        self->idle_at_us = timer_monotonic_us();
+        if (self->rx_len == 0)
+            self->rx_first_us = self->idle_at_us;
+        self->rx_len += nread;
     }
 
-    int pdu_len = find_pdu_len(buf + 1);
-    if (pdu_len <= 0 || pdu_len > MB_RTU_MAX_ADU_SIZE - 3) {
+    return DEVICE_OK;
+}
+
+// cut the next frame from rx_buf, sizing the pdu with pdu_len_fn
+static int rtu_rx_cut(modbus_rtu_t *self, bool silent, uint8_t **frame, int *fbytes,
+                      int (*pdu_len_fn)(const uint8_t *pdu, int avail))
+{
+    *fbytes = 0;
+    rtu_rx_consume(self);
+    if (self->rx_len == 0)
+        return DEVICE_OK;
+
+    // 1 byte slave id + pdu + 2 bytes crc
+    int frame_len = 0;
+    int pdu_len = pdu_len_fn(self->rx_buf + 1, self->rx_len - 1);
+    if (pdu_len > MODBUS_RTU_MAX_ADU_SIZE - 3) {
         Log_Debug("Invalid pdu len %d\n", pdu_len);
+    } else if (pdu_len > 0 && self->rx_len >= pdu_len + 3) {
+        frame_len = pdu_len + 3;
+    } else if (pdu_len < 0 && self->rx_len >= MODBUS_RTU_MAX_ADU_SIZE) {
+        Log_Debug("Frame larger than %d bytes\n", MODBUS_RTU_MAX_ADU_SIZE);
+    } else if (!silent) {
+        // wait for more bytes
+        return DEVICE_OK;
+    } else if (pdu_len < 0) {
+        // frame of unknown length ended by silence
+        frame_len = self->rx_len;
+    } else {
+        Log_Debug("Incomplete frame of %d bytes\n", self->rx_len);
+    }
+
+    if (frame_len < 4) {
+        // out of sync, drop everything
+        if (frame_len > 0)
+            Log_Debug("Frame too short: %d bytes\n", frame_len);
+        mb_trace_frame(MB_TRACE_DISCARD, self->uart_fd, self->rx_buf, self->rx_len);
+        self->rx_len = 0;
         return DEVICE_E_PROTOCOL;
     }
 
-    // 1 byte slave_id + pdu + 2 bytes crc
-    *fbytes = 1 + pdu_len + 2;
-    int elapse_ms = timer_stopwatch_stop(&poll_sw);
-    int result =  rtu_read_bytes(self, buf + 3, pdu_len, timeout - elapse_ms);
-    return result;
+    self->rx_frame_len = frame_len;
+    *frame = self->rx_buf;
+    *fbytes = frame_len;
+    return DEVICE_OK;
+}
+
+int modbus_rtu_rx_frame(modbus_rtu_t *self, bool silent, uint8_t **frame, int *fbytes)
+{
+    return rtu_rx_cut(self, silent, frame, fbytes, find_pdu_len);
+}
+
+int modbus_rtu_rx_request(modbus_rtu_t *self, bool silent, uint8_t **frame, int *fbytes)
+{
+    return rtu_rx_cut(self, silent, frame, fbytes, mb_request_pdu_len);
 }
 
 
@@ -323,60 +522,52 @@ int modbus_rtu_open(modbus_rtu_t *self)
     if (self->uart_fd >= 0)
         return 0;
 
-    UART_Config config;
-    UART_InitConfig(&config);
-    config.blockingMode = UART_BlockingMode_NonBlocking;
-    config.dataBits = UART_DataBits_Eight;
-    config.parity = UART_Parity_None;
-    config.stopBits = UART_StopBits_One;
-    config.baudRate = self->baud_rate;
-
-    self->uart_fd = UART_Open(self->uart_port, &config);
-    if (self->uart_fd < 0) {
-        Log_Debug("ERROR: Could not open UART: %s (%d).\n", strerror(errno), errno);
-        return -1;
-    }
-#ifdef TX_ENABLE
-    self->tx_enable_fd = GPIO_OpenAsOutput(SAMPLE_AILINK_UART_ENABLE, GPIO_OutputMode_PushPull, GPIO_Value_Low);
-
-    if (self->tx_enable_fd < 0) {
-        Log_Debug("ERROR: Could not open tx enable GPIO\n");
-        return DEVICE_E_IO;
-    }
-#endif    
-
-    return 0;
+    return self->transport->open(self);
 }
 
 int modbus_rtu_close(modbus_rtu_t *self)
 {
     int result = 0;
     if (self->uart_fd >= 0) {
-        result = UART_close(self->uart_fd);
-        self->uart_fd = -1;
+        result = self->transport->close(self);
     }
-#ifdef TX_ENABLE
-    if (self->tx_enable_fd >= 0) {
-        result = close(self->tx_enable_fd);
-        self->tx_enable_fd = -1;
-    }
-#endif    
+    led_set_color(TX_LED, Led_Colors_Off);
+    led_set_color(RX_LED, Led_Colors_Off);
 
     return result;
 }
 
-int modbus_rtu_send_request(modbus_rtu_t *self, uint8_t slave_id, const uint8_t *pdu, int pdu_len, int timeout)
+int modbus_rtu_set_format(modbus_rtu_t *self, uint8_t parity, uint8_t stop_bits)
 {
-    uint8_t adu[MB_RTU_MAX_ADU_SIZE];
-    adu[0] = slave_id;
-    memcpy(adu + 1, pdu, (size_t)pdu_len);
+    if (parity > RTU_PARITY_ODD || stop_bits < 1 || stop_bits > 2)
+        return DEVICE_E_CONFIG;
 
-    // crc for the entrie adu
-    uint16_t crc = crc16(adu, pdu_len + 1);
-    adu[1 + pdu_len] = (uint8_t)(crc & 0xFF);
-    adu[1 + pdu_len + 1] = (uint8_t)((crc >> 8) & 0xFF);
+    self->parity = parity;
+    self->stop_bits = stop_bits;
+    rtu_update_timing(self);
+    return DEVICE_OK;
+}
+
+int modbus_rtu_set_tx_enable_gpio(modbus_rtu_t *self, int gpio)
+{
+#ifdef TX_ENABLE
+    self->tx_enable_gpio = gpio;
+    return DEVICE_OK;
+#else
+    return DEVICE_E_CONFIG;
+#endif
+}
+
+void modbus_rtu_set_turnaround(modbus_rtu_t *self, unsigned int us)
+{
+    self->turnaround_us = us;
+}
+
+int modbus_rtu_send_adu(modbus_rtu_t *self, uint8_t slave_id, modbus_adu_t *adu, int pdu_len, int timeout)
+{
+    uint8_t *frame = MODBUS_ADU_RTU(adu);
+    int adu_len = modbus_rtu_seal_adu(frame, slave_id, pdu_len);
 
-    int adu_len = pdu_len + 3; // 1 byte slave id + pdu + 2 bytes crc
     struct timespec poll_sw;
     timer_stopwatch_start(&poll_sw);
 
@@ -385,71 +576,112 @@ int modbus_rtu_send_request(modbus_rtu_t *self, uint8_t slave_id, const uint8_t
     }
 
     int elapse_ms = timer_stopwatch_stop(&poll_sw);
-    int err = rtu_write_frame(self, adu, adu_len, timeout - elapse_ms);
+    int err = rtu_write_frame(self, frame, adu_len, timeout - elapse_ms);
     if (err) {
         Log_Debug("Failed to write request:%s\n", strerr(err));
         return err;
     }
-
-    Log_Debug("ADU-->%s\n", hex(adu, (size_t)adu_len));
     return DEVICE_OK;
 }
 
 
-int modbus_rtu_recv_response(modbus_rtu_t *self, uint8_t slave_id, uint8_t *pdu, int *ppdu_len, int timeout)
+int modbus_rtu_recv_pdu(modbus_rtu_t *self, uint8_t slave_id, const uint8_t **pdu, int *ppdu_len, int timeout)
 {
-    uint8_t adu[MB_RTU_MAX_ADU_SIZE];
-
+    uint8_t *adu = NULL;
     int adu_len = 0;
-    // adu must have enough space to receive MB_RTU_MAX_ADU_SIZE bytes
-    int err = rtu_read_frame(self, adu, &adu_len, timeout);
+    int err = rtu_read_frame(self, &adu, &adu_len, timeout);
     if (err != 0) {
         return err;
     }
 
-    Log_Debug("ADU<--%s\n", hex(adu, (size_t)adu_len));
-
-    if (adu[0] != slave_id) {
-        Log_Debug("Discard unexpected frame from slave %d, expected %d\n", adu[0], slave_id);
-        return DEVICE_E_PROTOCOL;
-    }
+    mb_trace_frame(MB_TRACE_RX, self->uart_fd, adu, adu_len);
 
-    uint16_t crc1 = (uint16_t)(adu[adu_len - 2] + (adu[adu_len - 1] << 8));
-    uint16_t crc2 = crc16(adu, adu_len - 2);
-    if (crc1 != crc2) {
-        Log_Debug("CRC error: recv=%x calc=%x\n", crc1, crc2);
-        return DEVICE_E_PROTOCOL;
+    err = modbus_rtu_check_frame(self, slave_id, adu, adu_len);
+    if (err != 0) {
+        return err;
     }
 
     // 1 byte slave_id + pdu + 2 bytes crc
-    int pdu_len = adu_len - 3;
-    memcpy(pdu, adu + 1, (size_t)pdu_len);
-    *ppdu_len = pdu_len;
+    *pdu = adu + 1;
+    *ppdu_len = adu_len - 3;
     return DEVICE_OK;
 }
 
 
+int modbus_rtu_send_request(modbus_rtu_t *self, uint8_t slave_id, const uint8_t *pdu, int pdu_len, int timeout)
+{
+    modbus_adu_t adu;
+    memcpy(MODBUS_ADU_PDU(&adu), pdu, (size_t)pdu_len);
+    return modbus_rtu_send_adu(self, slave_id, &adu, pdu_len, timeout);
+}
+
+
+int modbus_rtu_recv_response(modbus_rtu_t *self, uint8_t slave_id, uint8_t *pdu, int *ppdu_len, int timeout)
+{
+    const uint8_t *view = NULL;
+    int err = modbus_rtu_recv_pdu(self, slave_id, &view, ppdu_len, timeout);
+    if (err == DEVICE_OK)
+        memcpy(pdu, view, (size_t)*ppdu_len);
+    return err;
+}
+
+
 void modbus_rtu_destroy(modbus_rtu_t *self)
 {
     modbus_rtu_close(self);
     free(self);
-    led_close(TX_LED);
-    led_close(RX_LED);
+    if (--led_users == 0) {
+        led_close(TX_LED);
+        led_close(RX_LED);
+    }
 }
 
 
-modbus_rtu_t *modbus_rtu_create(int uart, unsigned int baud_rate)
+static modbus_rtu_t *rtu_create(const rtu_transport_t *transport, unsigned int baud_rate)
 {
     modbus_rtu_t *rtu = (modbus_rtu_t *)calloc(1, sizeof(modbus_rtu_t));
 
-    led_open(TX_LED);
-    led_open(RX_LED);
+    if (led_users++ == 0) {
+        led_open(TX_LED);
+        led_open(RX_LED);
+    }
 
-    rtu->uart_port = uart;
+    rtu->transport = transport;
     rtu->baud_rate = baud_rate;
+    rtu->parity = RTU_PARITY_NONE;
+    rtu->stop_bits = 1;
+    rtu_update_timing(rtu);
     rtu->uart_fd = -1;
 #ifdef TX_ENABLE
     rtu->tx_enable_fd = -1;
+    rtu->tx_enable_gpio = -1;
 #endif        
     return rtu;
 }
+
+
+modbus_rtu_t *modbus_rtu_create(int uart, unsigned int baud_rate)
+{
+#ifdef MODBUS_HOST
+    modbus_rtu_t *rtu = rtu_create(&rtu_transport_posix, baud_rate);
+    snprintf(rtu->tty_path, sizeof(rtu->tty_path), "/dev/ttyS%d", uart);
+#else
+    modbus_rtu_t *rtu = rtu_create(&rtu_transport_applibs, baud_rate);
+#endif
+    rtu->uart_port = uart;
+    return rtu;
+}
+
+
+modbus_rtu_t *modbus_rtu_create_tty(const char *path, unsigned int baud_rate)
+{
+    if (!path || strlen(path) >= MODBUS_RTU_TTY_PATH_SIZE) {
+        Log_Debug("Invalid tty path\n");
+        return NULL;
+    }
+
+    modbus_rtu_t *rtu = rtu_create(&rtu_transport_posix, baud_rate);
+    strcpy(rtu->tty_path, path);
+    rtu->uart_port = -1;
+    return rtu;
+}
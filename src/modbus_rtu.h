@@ -1,5 +1,7 @@
 #pragma once
+#include <stdbool.h>
 #include <stdint.h>
+#include "modbus_metrics.h"
 
 // #define TX_ENABLE
 
@@ -8,22 +10,149 @@
 
 #define MODBUS_READ_REQUEST_FRAME_LENGTH 5
 
+// requests to slave id 0 are executed by every slave and never answered
+#define MODBUS_BROADCAST_ID 0
+
+// 1 byte slave id + pdu + 2 bytes crc
+#define MODBUS_RTU_MAX_ADU_SIZE 256
+
+// room in front of the pdu for the largest transport header, the 7 bytes
+// tcp mbap header. rtu only uses the last byte for the slave id.
+#define MODBUS_ADU_HEADROOM 7
+
+// request buffer with headroom for the transport header in front of the pdu
+// and room for the crc behind it. The pdu is encoded straight into
+// MODBUS_ADU_PDU(adu) and the adu is finished in place, without copying.
+typedef struct modbus_adu_t {
+    uint8_t data[MODBUS_ADU_HEADROOM + MODBUS_MAX_PDU_SIZE + 2];
+} modbus_adu_t;
+
+#define MODBUS_ADU_PDU(adu) ((adu)->data + MODBUS_ADU_HEADROOM)
+#define MODBUS_ADU_RTU(adu) ((adu)->data + MODBUS_ADU_HEADROOM - 1)
+
+// uart frame format
+enum { RTU_PARITY_NONE = 0, RTU_PARITY_EVEN = 1, RTU_PARITY_ODD = 2 };
+
+// above 19200 baud modbus specifies fixed inter-character/frame timers
+#define MODBUS_RTU_FIXED_TIMING_BAUD 19200
+#define MODBUS_RTU_FIXED_T15_US 750
+#define MODBUS_RTU_FIXED_T35_US 1750
+
+// uart driver and transceiver latency before releasing tx enable
+#define MODBUS_RTU_TX_DRAIN_MARGIN_US 200
+
+// silence after a broadcast so slaves execute it before the next frame:
+// MODBUS_RTU_TURNAROUND_CHARS character times, about the 100 ms the serial
+// line spec suggests at 9600 baud, and no less than MODBUS_RTU_TURNAROUND_MIN_US
+#define MODBUS_RTU_TURNAROUND_CHARS 96
+#define MODBUS_RTU_TURNAROUND_MIN_US 10000
+
+#define MODBUS_RTU_TTY_PATH_SIZE 64
+
+// receive buffer holds one max size frame plus whatever follows it
+#define MODBUS_RTU_RX_BUF_SIZE 512
+
+struct rtu_transport_t;
+
 typedef struct modbus_rtu_t modbus_rtu_t;
 struct modbus_rtu_t {
+    const struct rtu_transport_t *transport;
     int uart_fd;
     int uart_port;
+    char tty_path[MODBUS_RTU_TTY_PATH_SIZE];
     unsigned int baud_rate;
+    uint8_t parity;
+    uint8_t stop_bits;
+
+    // timing derived from baud rate and frame format, in us
+    unsigned int char_us; // time to transfer one character
+    unsigned int t15_us;  // max silence between two characters of a frame
+    unsigned int t35_us;  // min silence between two frames
+    uint64_t idle_at_us;  // monotonic time the last character leaves/arrives on the bus
+    uint64_t tx_start_us; // monotonic time the current frame started sending
+    uint64_t tx_end_us;   // monotonic time tx enable was released after it
+    uint64_t rx_first_us; // monotonic time the first byte of the frame in rx_buf arrived
+    unsigned int turnaround_us; // after a broadcast, 0 derives it from the baud rate
+    uint64_t hold_until_us;     // no frame is sent before, set by a broadcast
+
+    // link quality, see modbus_get_metrics
+    uint32_t crc_errors;
+    uint32_t garbage_bytes; // unexpected bytes dropped before sending
+
+    // the uart is drained into rx_buf and frames are cut from its head
+    uint8_t rx_buf[MODBUS_RTU_RX_BUF_SIZE];
+    int rx_len;       // bytes in rx_buf
+    int rx_frame_len; // bytes of the last returned frame, dropped on next read
 #ifdef TX_ENABLE
     int tx_enable_fd;
+    int tx_enable_gpio; // -1 for the board default, see rtu_transport_applibs.c
 #endif    
 };
 
 
+// uart is an applibs UART id on device, and /dev/ttyS<uart> on host
 modbus_rtu_t *modbus_rtu_create(int uart, unsigned int baud_rate);
+// termios backend on a tty path, e.g. /dev/ttyUSB0 or /dev/pts/3
+modbus_rtu_t *modbus_rtu_create_tty(const char *path, unsigned int baud_rate);
 void modbus_rtu_destroy(modbus_rtu_t *self);
+// change uart frame format, default is 8N1, must be called before open
+int modbus_rtu_set_format(modbus_rtu_t *self, uint8_t parity, uint8_t stop_bits);
+// GPIO driving the transceiver tx enable, each bus needs its own when
+// several buses are open at once. Must be called before open.
+int modbus_rtu_set_tx_enable_gpio(modbus_rtu_t *self, int gpio);
+// turnaround delay after a broadcast in us, 0 for the default computed from
+// the baud rate (see MODBUS_RTU_TURNAROUND_CHARS)
+void modbus_rtu_set_turnaround(modbus_rtu_t *self, unsigned int us);
 int modbus_rtu_open(modbus_rtu_t *self);
 int modbus_rtu_close(modbus_rtu_t *self);
 void modbus_rtu_destroy(modbus_rtu_t *self);
 
+// send the pdu_len bytes pdu already encoded at MODBUS_ADU_PDU(adu)
+int modbus_rtu_send_adu(modbus_rtu_t *self, uint8_t slave_id, modbus_adu_t *adu, int pdu_len, int timeout);
+// receive a response, *pdu points into the receive buffer and stays valid
+// until the next send or receive on self
+int modbus_rtu_recv_pdu(modbus_rtu_t *self, uint8_t slave_id, const uint8_t **pdu, int *ppdu_len, int timeout);
+
+// copying variants of the two above, for callers owning plain pdu buffers
 int modbus_rtu_send_request(modbus_rtu_t *self, uint8_t slave_id, const uint8_t *pdu, int pdu_len, int timeout);
 int modbus_rtu_recv_response(modbus_rtu_t *self, uint8_t slave_id, uint8_t *pdu, int *ppdu_len, int timeout);
+
+
+// Non blocking building blocks, used by the blocking calls above and by
+// event driven callers that poll uart_fd themselves (see modbus_async.h).
+
+// build adu from pdu into adu, which must have room for pdu_len + 3 bytes.
+// return adu length
+int modbus_rtu_build_adu(uint8_t *adu, uint8_t slave_id, const uint8_t *pdu, int pdu_len);
+// finish an adu whose pdu is already at adu + 1: set slave id, append crc.
+// return adu length
+int modbus_rtu_seal_adu(uint8_t *adu, uint8_t slave_id, int pdu_len);
+// check slave id and crc of a received adu
+int modbus_rtu_check_frame(modbus_rtu_t *self, uint8_t slave_id, const uint8_t *adu, int adu_len);
+// phases of the transaction whose response just arrived
+void modbus_rtu_get_timing(const modbus_rtu_t *self, modbus_timing_t *timing);
+// monotonic time in us after which the next frame may be sent (t3.5 gap,
+// or the turnaround delay after a broadcast)
+uint64_t modbus_rtu_ready_at(modbus_rtu_t *self);
+// a broadcast left the wire and gets no response, hold the next frame back
+// for the turnaround delay
+void modbus_rtu_broadcast_sent(modbus_rtu_t *self);
+// drop buffered and pending input before sending a request
+void modbus_rtu_discard_input(modbus_rtu_t *self);
+
+// sending: tx_begin, write adu to uart_fd, tx_done with bytes written, then
+// tx_release once the monotonic clock passed tx_drained_at
+void modbus_rtu_tx_begin(modbus_rtu_t *self);
+void modbus_rtu_tx_done(modbus_rtu_t *self, int count);
+uint64_t modbus_rtu_tx_drained_at(modbus_rtu_t *self);
+void modbus_rtu_tx_release(modbus_rtu_t *self);
+
+// receiving: rx_read drains uart_fd without blocking, rx_frame cuts the next
+// frame from the buffer. silent tells that t3.5 elapsed since idle_at_us,
+// which ends frames whose length can't be found from the pdu. On DEVICE_OK
+// *fbytes is 0 if more bytes are needed, otherwise *frame points to the
+// frame in rx_buf, valid until the next rx_read/rx_frame.
+int modbus_rtu_rx_read(modbus_rtu_t *self);
+int modbus_rtu_rx_frame(modbus_rtu_t *self, bool silent, uint8_t **frame, int *fbytes);
+// same for requests, cut by request length, for the slave side (modbus_slave.h)
+int modbus_rtu_rx_request(modbus_rtu_t *self, bool silent, uint8_t **frame, int *fbytes);
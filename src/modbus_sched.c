@@ -0,0 +1,199 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "modbus_sched.h"
+#include "utils.h"
+
+
+static void sched_scan_done(mb_sched_t *self, mb_sched_group_t *group)
+{
+    uint64_t now = timer_monotonic_us();
+    uint64_t latency_us = now - group->release_us;
+    group->next_request = -1;
+    group->stats.scans++;
+    group->stats.last_latency_us = latency_us;
+    if (latency_us > group->stats.max_latency_us)
+        group->stats.max_latency_us = latency_us;
+    if (now > group->deadline_us)
+        group->stats.deadline_misses++;
+
+    if (self->on_scan)
+        self->on_scan(self, (int)(group - self->groups), group->scan_result, self->ctx);
+}
+
+static void sched_release(mb_sched_group_t *group, uint64_t now)
+{
+    uint64_t period_us = (uint64_t)group->period_ms * 1000;
+
+    if (group->next_request < 0) {
+        group->release_us = group->next_release_us;
+        group->deadline_us = group->release_us + period_us;
+        group->next_request = 0;
+        group->scan_result = DEVICE_OK;
+        group->next_release_us += period_us;
+    }
+
+    // releases that passed while the previous scan was still running, or
+    // while a long transaction blocked the bus, are skipped, not caught up
+    while (group->next_release_us <= now) {
+        group->stats.overruns++;
+        group->next_release_us += period_us;
+    }
+}
+
+// run the next request of the group's scan, requests of a plan share
+// plan->scratch so a scan runs its requests in order
+static void sched_run_request(mb_sched_t *self, mb_sched_group_t *group)
+{
+    modbus_plan_request_t *req = &group->plan->requests[group->next_request];
+    int err = mb_read_register(self->device, req->slave_id, req->reg_type, req->addr, req->quantity,
+                               group->plan->scratch, self->timeout_ms);
+    group->stats.transactions++;
+    if (err != DEVICE_OK) {
+        group->stats.errors++;
+        group->scan_result = err;
+    }
+    modbus_plan_scatter(group->plan, group->next_request, err);
+
+    if (++group->next_request == group->plan->nrequests)
+        sched_scan_done(self, group);
+}
+
+
+// --------------------- public interface ---------------------------------------
+
+mb_sched_t *mb_sched_create(modbus_device_t *device, int32_t timeout_ms)
+{
+    if (!device)
+        return NULL;
+
+    mb_sched_t *sched = (mb_sched_t *)calloc(1, sizeof(mb_sched_t));
+    sched->device = device;
+    sched->timeout_ms = timeout_ms;
+    sched->turnaround_us = MB_SCHED_TURNAROUND_US;
+    return sched;
+}
+
+void mb_sched_destroy(mb_sched_t *self)
+{
+    free(self);
+}
+
+void mb_sched_set_turnaround(mb_sched_t *self, uint32_t turnaround_us)
+{
+    self->turnaround_us = turnaround_us;
+}
+
+uint64_t mb_sched_request_us(mb_sched_t *self, const modbus_plan_request_t *req)
+{
+    // read request: slave id, fc, address, quantity, crc. Response: slave id,
+    // fc, byte count, data, crc
+    int bytes = 8 + 5;
+    if (req->reg_type == COIL || req->reg_type == DISCRETE_INPUT)
+        bytes += (req->quantity + 7) / 8;
+    else
+        bytes += 2 * req->quantity;
+
+    modbus_rtu_t *rtu = self->device->rtu;
+    if (!rtu) {
+        // no link speed to go by on tcp, only the server's answer time
+        return self->turnaround_us;
+    }
+    // frames, the t3.5 gap in front of the request and the slave's answer time
+    return (uint64_t)bytes * rtu->char_us + rtu->t35_us + self->turnaround_us;
+}
+
+double mb_sched_utilisation(mb_sched_t *self)
+{
+    double utilisation = 0;
+    for (int i = 0; i < self->ngroups; i++) {
+        mb_sched_group_t *group = &self->groups[i];
+        utilisation += (double)group->load_us / ((double)group->period_ms * 1000);
+    }
+    return utilisation;
+}
+
+int mb_sched_add_group(mb_sched_t *self, modbus_plan_t *plan, uint32_t period_ms)
+{
+    if (self->ngroups == MB_SCHED_MAX_GROUPS || !plan || plan->nrequests == 0 || period_ms == 0) {
+        return -1;
+    }
+
+    mb_sched_group_t *group = &self->groups[self->ngroups];
+    memset(group, 0, sizeof(*group));
+    group->plan = plan;
+    group->period_ms = period_ms;
+    group->next_request = -1;
+    for (int r = 0; r < plan->nrequests; r++)
+        group->load_us += mb_sched_request_us(self, &plan->requests[r]);
+    self->ngroups++;
+
+    double utilisation = mb_sched_utilisation(self);
+    Log_Debug("Scan group %d: %d requests, %.1f ms bus time every %u ms, bus utilisation %.0f%%\n",
+              self->ngroups - 1, plan->nrequests, group->load_us / 1e3, period_ms, utilisation * 100);
+    if (utilisation > 1.0)
+        Log_Debug("WARNING: scan groups need %.0f%% of the bus, scans will overrun\n", utilisation * 100);
+    return self->ngroups - 1;
+}
+
+int mb_sched_run(mb_sched_t *self, uint32_t duration_ms)
+{
+    if (self->ngroups == 0)
+        return DEVICE_E_INVALID;
+
+    uint64_t now = timer_monotonic_us();
+    uint64_t end_us = duration_ms ? now + (uint64_t)duration_ms * 1000 : UINT64_MAX;
+    self->start_us = now;
+    self->running = true;
+    for (int i = 0; i < self->ngroups; i++) {
+        mb_sched_group_t *group = &self->groups[i];
+        memset(&group->stats, 0, sizeof(group->stats));
+        group->next_request = -1;
+        group->next_release_us = now;
+    }
+
+    while (self->running) {
+        now = timer_monotonic_us();
+        if (now >= end_us)
+            break;
+
+        // release due scans and pick the one with the earliest deadline
+        mb_sched_group_t *next = NULL;
+        uint64_t wake_us = end_us;
+        for (int i = 0; i < self->ngroups; i++) {
+            mb_sched_group_t *group = &self->groups[i];
+            if (group->next_release_us <= now)
+                sched_release(group, now);
+            if (group->next_release_us < wake_us)
+                wake_us = group->next_release_us;
+            if (group->next_request >= 0 && (!next || group->deadline_us < next->deadline_us))
+                next = group;
+        }
+
+        if (next)
+            sched_run_request(self, next);
+        else
+            timer_sleep_us((long)(wake_us - now));
+    }
+
+    self->running = false;
+    return DEVICE_OK;
+}
+
+void mb_sched_stop(mb_sched_t *self)
+{
+    self->running = false;
+}
+
+void mb_sched_print_stats(mb_sched_t *self)
+{
+    Log_Debug("group period(ms) load  scans   err     overrun missed  latency(ms) max(ms)\n");
+    for (int i = 0; i < self->ngroups; i++) {
+        mb_sched_group_t *group = &self->groups[i];
+        mb_sched_stats_t *s = &group->stats;
+        Log_Debug("%-5d %-10u %3.0f%%  %-7lu %-7lu %-7lu %-7lu %-11.1f %.1f\n", i, group->period_ms,
+                  100.0 * (double)group->load_us / ((double)group->period_ms * 1000), s->scans, s->errors,
+                  s->overruns, s->deadline_misses, s->last_latency_us / 1e3, s->max_latency_us / 1e3);
+    }
+    Log_Debug("bus utilisation %.0f%%\n", mb_sched_utilisation(self) * 100);
+}
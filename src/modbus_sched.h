@@ -0,0 +1,89 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "modbus.h"
+#include "modbus_plan.h"
+
+// Cyclic scan scheduler for one bus. Each group is a plan scanned with its
+// own period, e.g. alarms every 100 ms and energy counters every minute. A
+// scan is released every period and must be done before the next release.
+// Requests of released scans run one at a time, earliest deadline first, so
+// a short period group overtakes a long scan between two of its requests.
+//
+//   mb_sched_t *sched = mb_sched_create(device, 1000);
+//   mb_sched_add_group(sched, alarm_plan, 100);
+//   mb_sched_add_group(sched, energy_plan, 60000);
+//   mb_sched_run(sched, 0);
+//
+// Adding a group estimates the bus time of its requests from baud rate and
+// frame sizes and warns when the load exceeds what the link can carry.
+// Scans that don't finish in time are counted as overruns and deadline misses.
+
+#define MB_SCHED_MAX_GROUPS 16
+
+// assumed time a slave takes to answer, part of the bus time of a request
+#define MB_SCHED_TURNAROUND_US 2000
+
+typedef struct mb_sched_stats_t mb_sched_stats_t;
+struct mb_sched_stats_t {
+    unsigned long scans;           // completed scans
+    unsigned long transactions;
+    unsigned long errors;          // failed transactions
+    unsigned long overruns;        // releases skipped, the previous scan was still running
+    unsigned long deadline_misses; // scans finished after their deadline
+    uint64_t last_latency_us;      // release to completion of the last scan
+    uint64_t max_latency_us;
+};
+
+typedef struct mb_sched_group_t mb_sched_group_t;
+struct mb_sched_group_t {
+    modbus_plan_t *plan;
+    uint32_t period_ms;
+    uint64_t load_us; // estimated bus time of one scan
+
+    uint64_t release_us;      // release of the current scan
+    uint64_t deadline_us;     // the current scan should be done by then
+    uint64_t next_release_us;
+    int next_request; // next plan request to run, -1 when no scan in progress
+    int scan_result;
+    mb_sched_stats_t stats;
+};
+
+typedef struct mb_sched_t mb_sched_t;
+struct mb_sched_t {
+    modbus_device_t *device;
+    int32_t timeout_ms;
+    uint32_t turnaround_us;
+    mb_sched_group_t groups[MB_SCHED_MAX_GROUPS];
+    int ngroups;
+    uint64_t start_us;
+    volatile bool running;
+
+    // called after each completed scan, result is DEVICE_OK if all requests
+    // of the scan succeeded
+    void (*on_scan)(mb_sched_t *sched, int group, int result, void *ctx);
+    void *ctx;
+};
+
+// the scheduler doesn't own device and plans
+mb_sched_t *mb_sched_create(modbus_device_t *device, int32_t timeout_ms);
+void mb_sched_destroy(mb_sched_t *self);
+
+// slave answer time assumed by the load estimate, default MB_SCHED_TURNAROUND_US.
+// Set it before adding groups.
+void mb_sched_set_turnaround(mb_sched_t *self, uint32_t turnaround_us);
+
+// scan plan every period_ms, return group index or -1
+int mb_sched_add_group(mb_sched_t *self, modbus_plan_t *plan, uint32_t period_ms);
+
+// estimated bus time of one request and the share of the bus all groups
+// need, above 1.0 the link can't keep up with the periods
+uint64_t mb_sched_request_us(mb_sched_t *self, const modbus_plan_request_t *req);
+double mb_sched_utilisation(mb_sched_t *self);
+
+// run scans for duration_ms, or until mb_sched_stop when 0. All groups are
+// released at start.
+int mb_sched_run(mb_sched_t *self, uint32_t duration_ms);
+void mb_sched_stop(mb_sched_t *self);
+
+void mb_sched_print_stats(mb_sched_t *self);
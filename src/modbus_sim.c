@@ -0,0 +1,420 @@
+#ifdef MODBUS_HOST
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "crc16.h"
+#include "modbus.h"
+#include "modbus_pdu.h"
+#include "modbus_sim.h"
+#include "modbus_slave.h"
+#include "utils.h"
+
+#define SIM_BUF_SIZE 512
+#define SIM_POLL_MS 50
+
+
+// length of the request adu at the head of buf, 0 if more bytes are needed,
+// -1 if the function code is unknown
+static int sim_request_len(const uint8_t *buf, int len)
+{
+    if (len < 2)
+        return 0;
+
+    // slave id + pdu + crc
+    int pdu_len = mb_request_pdu_len(buf + 1, len - 1);
+    return pdu_len > 0 ? pdu_len + 3 : pdu_len;
+}
+
+static bool sim_chance(modbus_sim_t *self, unsigned int ppm)
+{
+    return ppm && (unsigned int)(rand_r(&self->rand_state) % 1000000) < ppm;
+}
+
+static void sim_respond(modbus_sim_t *self, uint8_t *adu, int adu_len)
+{
+    uint16_t crc = crc16(adu, (size_t)adu_len);
+    adu[adu_len++] = (uint8_t)(crc & 0xFF);
+    adu[adu_len++] = (uint8_t)(crc >> 8);
+
+    if (sim_chance(self, self->config.crc_error_ppm)) {
+        adu[adu_len - 1] ^= 0x5A;
+        self->stats.injected_crc_errors++;
+    }
+    if (sim_chance(self, self->config.noise_ppm)) {
+        adu[rand_r(&self->rand_state) % adu_len] ^= (uint8_t)(1 + rand_r(&self->rand_state) % 255);
+        self->stats.injected_noise++;
+    }
+
+    long delay_us = (long)self->config.latency_us;
+    if (self->config.baud_rate) {
+        // 8N1, 10 bits per character
+        delay_us += (long)((uint64_t)adu_len * 10 * 1000000 / self->config.baud_rate);
+    }
+    timer_sleep_us(delay_us);
+
+    int total = 0;
+    while (total < adu_len) {
+        ssize_t n = write(self->master_fd, adu + total, (size_t)(adu_len - total));
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            Log_Debug("sim write error:%s\n", strerror(errno));
+            return;
+        }
+        total += (int)n;
+    }
+    self->stats.responses++;
+}
+
+// consume complete frames at the head of buf, return number of bytes consumed
+static int sim_process(modbus_sim_t *self, uint8_t *buf, int len)
+{
+    int consumed = 0;
+
+    while (consumed < len) {
+        uint8_t *frame = buf + consumed;
+        int frame_len = sim_request_len(frame, len - consumed);
+        if (frame_len < 0) {
+            // unknown frame, resync by dropping everything received
+            self->stats.bad_requests++;
+            return len;
+        }
+        if (frame_len == 0 || frame_len > len - consumed)
+            break;
+        consumed += frame_len;
+
+        uint16_t crc = (uint16_t)(frame[frame_len - 2] + (frame[frame_len - 1] << 8));
+        if (crc != crc16(frame, (size_t)(frame_len - 2))) {
+            // slave stays silent on crc error
+            self->stats.bad_requests++;
+            continue;
+        }
+
+        uint8_t slave_id = frame[0];
+        if (slave_id != self->config.slave_id && slave_id != 0)
+            continue;
+
+        self->stats.requests++;
+        uint8_t adu[MODBUS_MAX_ADU_SIZE];
+        int pdu_len = modbus_slave_handle_pdu(self->slave, frame + 1, frame_len - 3, adu + 1);
+        if (adu[1] & 0x80)
+            self->stats.exceptions++;
+
+        // no response to broadcast
+        if (slave_id != 0) {
+            adu[0] = slave_id;
+            sim_respond(self, adu, 1 + pdu_len);
+        }
+    }
+
+    return consumed;
+}
+
+static void sim_close_client(modbus_sim_client_t *client)
+{
+    close(client->fd);
+    client->fd = -1;
+    client->len = 0;
+}
+
+static int sim_write_all(int fd, const uint8_t *buf, int len)
+{
+    int total = 0;
+    while (total < len) {
+        ssize_t n = send(fd, buf + total, (size_t)(len - total), MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            return -1;
+        }
+        total += (int)n;
+    }
+    return 0;
+}
+
+// consume complete mbap frames from a tcp client, false if it must be dropped
+static bool sim_process_tcp(modbus_sim_t *self, modbus_sim_client_t *client)
+{
+    int consumed = 0;
+
+    while (client->len - consumed >= 7) {
+        uint8_t *frame = client->buf + consumed;
+        int length = (frame[4] << 8) + frame[5]; // unit id + pdu
+        if (frame[2] != 0 || frame[3] != 0 || length < 2 || length > MODBUS_MAX_PDU_SIZE + 1) {
+            self->stats.bad_requests++;
+            return false;
+        }
+        if (client->len - consumed < 6 + length)
+            break;
+        consumed += 6 + length;
+
+        uint8_t unit_id = frame[6];
+        if (unit_id != self->config.slave_id && unit_id != 0xFF)
+            continue;
+
+        self->stats.requests++;
+        uint8_t adu[MODBUS_MAX_ADU_SIZE];
+        int pdu_len = modbus_slave_handle_pdu(self->slave, frame + 7, length - 1, adu + 7);
+        if (adu[7] & 0x80)
+            self->stats.exceptions++;
+
+        // echo transaction id, protocol and unit id
+        memcpy(adu, frame, 7);
+        adu[4] = (uint8_t)((pdu_len + 1) >> 8);
+        adu[5] = (uint8_t)((pdu_len + 1) & 0xFF);
+
+        timer_sleep_us((long)self->config.latency_us);
+        if (sim_write_all(client->fd, adu, 7 + pdu_len) != 0)
+            return false;
+        self->stats.responses++;
+    }
+
+    client->len -= consumed;
+    memmove(client->buf, client->buf + consumed, (size_t)client->len);
+    return client->len < MODBUS_SIM_CLIENT_BUF_SIZE;
+}
+
+static void sim_accept(modbus_sim_t *self)
+{
+    int fd = accept4(self->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    // pipelined responses must not wait for the client's delayed ack
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    for (int i = 0; i < MODBUS_SIM_MAX_CLIENTS; i++) {
+        if (self->clients[i].fd < 0) {
+            self->clients[i].fd = fd;
+            self->clients[i].len = 0;
+            return;
+        }
+    }
+    Log_Debug("sim: too many tcp clients\n");
+    close(fd);
+}
+
+// pty master, tcp listen socket, tcp clients
+#define SIM_MAX_FDS (2 + MODBUS_SIM_MAX_CLIENTS)
+
+static void sim_poll_tcp(modbus_sim_t *self, struct pollfd *fds, int nfds)
+{
+    for (int i = 2; i < nfds; i++) {
+        modbus_sim_client_t *client = &self->clients[i - 2];
+        if (client->fd < 0 || !fds[i].revents)
+            continue;
+
+        ssize_t n = recv(client->fd, client->buf + client->len, (size_t)(MODBUS_SIM_CLIENT_BUF_SIZE - client->len), 0);
+        if (n <= 0) {
+            sim_close_client(client);
+            continue;
+        }
+        client->len += (int)n;
+        if (!sim_process_tcp(self, client))
+            sim_close_client(client);
+    }
+    if (nfds > 1 && (fds[1].revents & POLLIN))
+        sim_accept(self);
+}
+
+static void *sim_thread(void *arg)
+{
+    modbus_sim_t *self = (modbus_sim_t *)arg;
+    uint8_t buf[SIM_BUF_SIZE];
+    int len = 0;
+
+    struct pollfd fds[SIM_MAX_FDS];
+    fds[0].fd = self->master_fd;
+    fds[0].events = POLLIN;
+
+    while (self->running) {
+        int nfds = 1;
+        if (self->listen_fd >= 0) {
+            fds[1].fd = self->listen_fd;
+            fds[1].events = POLLIN;
+            for (int i = 0; i < MODBUS_SIM_MAX_CLIENTS; i++) {
+                // poll ignores negative fds
+                fds[2 + i].fd = self->clients[i].fd;
+                fds[2 + i].events = POLLIN;
+                fds[2 + i].revents = 0;
+            }
+            nfds = SIM_MAX_FDS;
+        }
+
+        int nevents = poll(fds, (nfds_t)nfds, SIM_POLL_MS);
+        if (nevents < 0) {
+            if (errno == EINTR)
+                continue;
+            Log_Debug("sim poll error:%s\n", strerror(errno));
+            break;
+        }
+        if (nevents == 0) {
+            // silence on the line ends any partial frame
+            len = 0;
+            continue;
+        }
+
+        sim_poll_tcp(self, fds, nfds);
+        if (!(fds[0].revents & POLLIN))
+            continue;
+
+        ssize_t n = read(self->master_fd, buf + len, sizeof(buf) - (size_t)len);
+        if (n <= 0)
+            continue;
+        len += (int)n;
+
+        int consumed = sim_process(self, buf, len);
+        memmove(buf, buf + consumed, (size_t)(len - consumed));
+        len -= consumed;
+        if (len == (int)sizeof(buf))
+            len = 0;
+    }
+
+    return NULL;
+}
+
+
+// --------------------- public interface ---------------------------------------
+
+modbus_sim_t *modbus_sim_create(const modbus_sim_config_t *config)
+{
+    modbus_sim_t *sim = (modbus_sim_t *)calloc(1, sizeof(modbus_sim_t));
+    sim->config = *config;
+    sim->rand_state = config->seed;
+    sim->slave_fd = -1;
+    sim->listen_fd = -1;
+    for (int i = 0; i < MODBUS_SIM_MAX_CLIENTS; i++)
+        sim->clients[i].fd = -1;
+
+    size_t n = config->nregs;
+    sim->coils = (uint8_t *)calloc(n ? n : 1, sizeof(uint8_t));
+    sim->discretes = (uint8_t *)calloc(n ? n : 1, sizeof(uint8_t));
+    sim->inputs = (uint16_t *)calloc(n ? n : 1, sizeof(uint16_t));
+    sim->holdings = (uint16_t *)calloc(n ? n : 1, sizeof(uint16_t));
+
+    // the slave engine answers from the four tables, addresses 0 to nregs - 1
+    sim->slave = modbus_slave_create(config->slave_id);
+    if (n) {
+        modbus_slave_map(sim->slave, COIL, 0, config->nregs, sim->coils);
+        modbus_slave_map(sim->slave, DISCRETE_INPUT, 0, config->nregs, sim->discretes);
+        modbus_slave_map(sim->slave, INPUT_REGISTER, 0, config->nregs, sim->inputs);
+        modbus_slave_map(sim->slave, HOLDING_REGISTER, 0, config->nregs, sim->holdings);
+    }
+
+    sim->master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (sim->master_fd < 0 || grantpt(sim->master_fd) != 0 || unlockpt(sim->master_fd) != 0 ||
+        ptsname_r(sim->master_fd, sim->path, sizeof(sim->path)) != 0) {
+        Log_Debug("Failed to create sim pty:%s\n", strerror(errno));
+        modbus_sim_destroy(sim);
+        return NULL;
+    }
+
+    sim->slave_fd = open(sim->path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    struct termios tio;
+    if (sim->slave_fd < 0 || tcgetattr(sim->slave_fd, &tio) != 0) {
+        Log_Debug("Failed to open sim pty %s:%s\n", sim->path, strerror(errno));
+        modbus_sim_destroy(sim);
+        return NULL;
+    }
+    cfmakeraw(&tio);
+    tcsetattr(sim->slave_fd, TCSANOW, &tio);
+
+    return sim;
+}
+
+int modbus_sim_start(modbus_sim_t *self)
+{
+    if (self->running)
+        return DEVICE_OK;
+
+    self->running = true;
+    if (pthread_create(&self->thread, NULL, sim_thread, self) != 0) {
+        self->running = false;
+        return DEVICE_E_INTERNAL;
+    }
+    return DEVICE_OK;
+}
+
+void modbus_sim_stop(modbus_sim_t *self)
+{
+    if (self->running) {
+        self->running = false;
+        pthread_join(self->thread, NULL);
+    }
+}
+
+void modbus_sim_destroy(modbus_sim_t *self)
+{
+    if (self) {
+        modbus_sim_stop(self);
+        if (self->slave_fd >= 0)
+            close(self->slave_fd);
+        if (self->master_fd >= 0)
+            close(self->master_fd);
+        if (self->listen_fd >= 0)
+            close(self->listen_fd);
+        for (int i = 0; i < MODBUS_SIM_MAX_CLIENTS; i++) {
+            if (self->clients[i].fd >= 0)
+                close(self->clients[i].fd);
+        }
+        free(self->coils);
+        free(self->discretes);
+        free(self->inputs);
+        free(self->holdings);
+        modbus_slave_destroy(self->slave);
+        free(self);
+    }
+}
+
+const char *modbus_sim_path(modbus_sim_t *self)
+{
+    return self->path;
+}
+
+int modbus_sim_listen_tcp(modbus_sim_t *self, uint16_t port)
+{
+    if (self->running || self->listen_fd >= 0)
+        return DEVICE_E_INVALID;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+
+    int one = 1;
+    self->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (self->listen_fd < 0 || setsockopt(self->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+        bind(self->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(self->listen_fd, MODBUS_SIM_MAX_CLIENTS) != 0 ||
+        getsockname(self->listen_fd, (struct sockaddr *)&addr, &addr_len) != 0) {
+        Log_Debug("Failed to listen on tcp port %u:%s\n", port, strerror(errno));
+        if (self->listen_fd >= 0)
+            close(self->listen_fd);
+        self->listen_fd = -1;
+        return DEVICE_E_IO;
+    }
+
+    self->tcp_port = ntohs(addr.sin_port);
+    return DEVICE_OK;
+}
+
+uint16_t modbus_sim_tcp_port(modbus_sim_t *self)
+{
+    return self->tcp_port;
+}
+
+#endif // MODBUS_HOST
@@ -0,0 +1,90 @@
+#pragma once
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// In-process Modbus RTU slave on a pty, for benchmarks and bring-up without
+// a device on the wire. Host build only. Requests are answered by the slave
+// engine (modbus_slave.h), the simulator adds the pty, pacing and error
+// injection.
+//
+//   modbus_sim_t *sim = modbus_sim_create(&config);
+//   modbus_sim_start(sim);
+//   modbus_device_t *device = modbus_create_device_tty(modbus_sim_path(sim), baud_rate);
+//
+// The same register tables can also be served as a Modbus TCP server on
+// loopback, call modbus_sim_listen_tcp before modbus_sim_start and connect
+// with modbus_create_device_tcp("127.0.0.1", modbus_sim_tcp_port(sim)).
+
+#define MODBUS_SIM_PATH_SIZE 64
+#define MODBUS_SIM_MAX_CLIENTS 4
+#define MODBUS_SIM_CLIENT_BUF_SIZE 512
+
+typedef struct modbus_sim_config_t modbus_sim_config_t;
+struct modbus_sim_config_t {
+    uint8_t slave_id;
+    uint16_t nregs;             // size of each of the four register tables
+    unsigned int baud_rate;     // pace responses as if sent at this rate, 0 for no pacing
+    unsigned int latency_us;    // slave processing time before responding
+    unsigned int crc_error_ppm; // responses sent with a bad crc, per million
+    unsigned int noise_ppm;     // responses with one corrupted byte, per million
+    unsigned int seed;          // seed of error injection
+};
+
+typedef struct modbus_sim_stats_t modbus_sim_stats_t;
+struct modbus_sim_stats_t {
+    unsigned long requests;
+    unsigned long responses;
+    unsigned long exceptions;
+    unsigned long bad_requests; // crc error or unknown frame
+    unsigned long injected_crc_errors;
+    unsigned long injected_noise;
+};
+
+typedef struct modbus_sim_client_t modbus_sim_client_t;
+struct modbus_sim_client_t {
+    int fd; // -1 if the slot is free
+    uint8_t buf[MODBUS_SIM_CLIENT_BUF_SIZE];
+    int len;
+};
+
+typedef struct modbus_sim_t modbus_sim_t;
+struct modbus_sim_t {
+    modbus_sim_config_t config;
+    int master_fd;
+    int slave_fd; // kept open so the pty survives client reopen
+    char path[MODBUS_SIM_PATH_SIZE];
+    int listen_fd; // tcp server socket, -1 if not listening
+    uint16_t tcp_port;
+    modbus_sim_client_t clients[MODBUS_SIM_MAX_CLIENTS];
+
+    pthread_t thread;
+    volatile bool running;
+    unsigned int rand_state;
+
+    uint8_t *coils;
+    uint8_t *discretes;
+    uint16_t *inputs;
+    uint16_t *holdings;
+    struct modbus_slave_t *slave; // answers requests from the tables above
+
+    modbus_sim_stats_t stats;
+};
+
+modbus_sim_t *modbus_sim_create(const modbus_sim_config_t *config);
+
+// start serving requests from a background thread
+int modbus_sim_start(modbus_sim_t *self);
+
+// stop the background thread, the pty stays open
+void modbus_sim_stop(modbus_sim_t *self);
+
+void modbus_sim_destroy(modbus_sim_t *self);
+
+// tty path of the client end of the pty
+const char *modbus_sim_path(modbus_sim_t *self);
+
+// also serve Modbus TCP on 127.0.0.1:port, port 0 picks a free one. Responses
+// are delayed by latency_us, baud rate pacing and error injection are rtu only.
+int modbus_sim_listen_tcp(modbus_sim_t *self, uint16_t port);
+uint16_t modbus_sim_tcp_port(modbus_sim_t *self);
@@ -0,0 +1,818 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc16.h"
+#include "modbus_pdu.h"
+#include "modbus_slave.h"
+#include "modbus_trace.h"
+#include "modbus_value.h"
+#include "utils.h"
+
+// event log bytes, FC 0x0C
+#define EVENT_RECEIVE 0x80
+#define EVENT_RECEIVE_COMM_ERROR 0x02
+#define EVENT_RECEIVE_BROADCAST 0x40
+#define EVENT_SEND 0x40
+#define EVENT_SEND_READ_EXCEPTION 0x01
+#define EVENT_SEND_ABORT_EXCEPTION 0x02
+
+// diagnostics sub-functions
+#define DIAG_RETURN_QUERY_DATA 0x00
+#define DIAG_RESTART_COMM 0x01
+#define DIAG_RETURN_REGISTER 0x02
+#define DIAG_CLEAR_COUNTERS 0x0A
+#define DIAG_BUS_MESSAGE_COUNT 0x0B
+#define DIAG_BUS_COMM_ERROR_COUNT 0x0C
+#define DIAG_EXCEPTION_ERROR_COUNT 0x0D
+#define DIAG_SERVER_MESSAGE_COUNT 0x0E
+#define DIAG_SERVER_NO_RESPONSE_COUNT 0x0F
+#define DIAG_SERVER_NAK_COUNT 0x10
+#define DIAG_SERVER_BUSY_COUNT 0x11
+#define DIAG_CHAR_OVERRUN_COUNT 0x12
+
+#define FILE_REFERENCE_TYPE 6
+#define FILE_MAX_RECORD 0x270F
+
+#define MEI_READ_DEVICE_ID 0x0E
+#define DEVICE_ID_CONFORMITY 0x81 // basic objects, stream and individual access
+
+
+static uint16_t get_u16(const uint8_t *p)
+{
+    return (uint16_t)((p[0] << 8) + p[1]);
+}
+
+static void put_u16(uint8_t *p, uint16_t value)
+{
+    p[0] = (uint8_t)(value >> 8);
+    p[1] = (uint8_t)(value & 0xFF);
+}
+
+static int slave_exception(modbus_slave_t *self, uint8_t *rsp, uint8_t function, uint8_t code)
+{
+    rsp[0] = (uint8_t)(function | 0x80);
+    rsp[1] = code;
+    self->counters.exceptions++;
+    return 2;
+}
+
+static void slave_log_event(modbus_slave_t *self, uint8_t event)
+{
+    int n = self->nevents < MB_SLAVE_EVENT_LOG_SIZE ? self->nevents : MB_SLAVE_EVENT_LOG_SIZE - 1;
+    memmove(self->events + 1, self->events, (size_t)n);
+    self->events[0] = event;
+    self->nevents = n + 1;
+}
+
+static void slave_notify(modbus_slave_t *self, uint8_t reg_type, uint16_t addr, uint16_t quantity)
+{
+    if (self->on_write)
+        self->on_write(self, reg_type, addr, quantity, self->ctx);
+}
+
+
+// --------------------- register map -------------------------------------------
+
+static mb_slave_range_t *slave_find(mb_slave_table_t *table, uint16_t addr)
+{
+    if (!table->pages)
+        return NULL;
+    int first = table->pages[addr >> MB_SLAVE_PAGE_BITS];
+    if (first == 0)
+        return NULL;
+
+    // ranges sharing the page, at most one per address of the page
+    mb_slave_range_t *end = table->ranges + table->nranges;
+    for (mb_slave_range_t *r = &table->ranges[first - 1]; r < end && r->start <= addr; r++) {
+        if (addr - r->start < r->count)
+            return r;
+    }
+    return NULL;
+}
+
+// all of quantity addresses from addr are mapped, adjacent ranges may be spanned
+static bool slave_mapped(mb_slave_table_t *table, uint16_t addr, uint16_t quantity)
+{
+    uint32_t end = (uint32_t)addr + quantity;
+    if (end > 0x10000)
+        return false;
+
+    uint32_t a = addr;
+    while (a < end) {
+        mb_slave_range_t *r = slave_find(table, (uint16_t)a);
+        if (!r)
+            return false;
+        a = (uint32_t)r->start + r->count;
+    }
+    return true;
+}
+
+// number of values from addr that are in range r
+static uint16_t range_run(const mb_slave_range_t *r, uint16_t addr, uint16_t quantity)
+{
+    uint32_t left = (uint32_t)r->start + r->count - addr;
+    return left < quantity ? (uint16_t)left : quantity;
+}
+
+// the copies below expect slave_mapped to have passed
+static void slave_get_bits(mb_slave_table_t *table, uint16_t addr, uint16_t quantity, uint8_t *packed)
+{
+    memset(packed, 0, (size_t)(quantity + 7) / 8);
+    int bit = 0;
+    while (quantity > 0) {
+        mb_slave_range_t *r = slave_find(table, addr);
+        uint16_t n = range_run(r, addr, quantity);
+        mb_pack_bits8((const uint8_t *)r->values + (addr - r->start), n, packed, bit);
+        bit += n;
+        addr = (uint16_t)(addr + n);
+        quantity = (uint16_t)(quantity - n);
+    }
+}
+
+static void slave_set_bits(mb_slave_table_t *table, uint16_t addr, uint16_t quantity, const uint8_t *packed)
+{
+    int bit = 0;
+    while (quantity > 0) {
+        mb_slave_range_t *r = slave_find(table, addr);
+        uint16_t n = range_run(r, addr, quantity);
+        mb_unpack_bits8(packed, bit, n, (uint8_t *)r->values + (addr - r->start));
+        bit += n;
+        addr = (uint16_t)(addr + n);
+        quantity = (uint16_t)(quantity - n);
+    }
+}
+
+static void slave_get_regs(mb_slave_table_t *table, uint16_t addr, uint16_t quantity, uint8_t *data)
+{
+    while (quantity > 0) {
+        mb_slave_range_t *r = slave_find(table, addr);
+        uint16_t n = range_run(r, addr, quantity);
+        const uint16_t *v = (const uint16_t *)r->values + (addr - r->start);
+        for (int i = 0; i < n; i++, data += 2)
+            put_u16(data, v[i]);
+        addr = (uint16_t)(addr + n);
+        quantity = (uint16_t)(quantity - n);
+    }
+}
+
+static void slave_set_regs(mb_slave_table_t *table, uint16_t addr, uint16_t quantity, const uint8_t *data)
+{
+    while (quantity > 0) {
+        mb_slave_range_t *r = slave_find(table, addr);
+        uint16_t n = range_run(r, addr, quantity);
+        uint16_t *v = (uint16_t *)r->values + (addr - r->start);
+        for (int i = 0; i < n; i++, data += 2)
+            v[i] = get_u16(data);
+        addr = (uint16_t)(addr + n);
+        quantity = (uint16_t)(quantity - n);
+    }
+}
+
+static void table_build_pages(mb_slave_table_t *table)
+{
+    memset(table->pages, 0, MB_SLAVE_PAGES);
+    // backwards, so a page shared by ranges points to the first of them
+    for (int i = table->nranges - 1; i >= 0; i--) {
+        mb_slave_range_t *r = &table->ranges[i];
+        int first = r->start >> MB_SLAVE_PAGE_BITS;
+        int last = (r->start + r->count - 1) >> MB_SLAVE_PAGE_BITS;
+        for (int p = first; p <= last; p++)
+            table->pages[p] = (uint8_t)(i + 1);
+    }
+}
+
+static mb_slave_file_t *slave_find_file(modbus_slave_t *self, uint16_t file_no)
+{
+    for (int i = 0; i < self->nfiles; i++) {
+        if (self->files[i].file_no == file_no)
+            return &self->files[i];
+    }
+    return NULL;
+}
+
+
+// --------------------- function codes -----------------------------------------
+
+static int slave_read_bits(modbus_slave_t *self, const uint8_t *req, uint8_t *rsp)
+{
+    uint8_t function = req[0];
+    uint16_t addr = get_u16(req + 1);
+    uint16_t quantity = get_u16(req + 3);
+    mb_slave_table_t *table = &self->tables[function == FC_READ_COILS ? COIL : DISCRETE_INPUT];
+
+    if (quantity == 0 || quantity > MODBUS_MAX_COIL_PER_READ)
+        return slave_exception(self, rsp, function, MB_EX_ILLEGAL_VALUE);
+    if (!slave_mapped(table, addr, quantity))
+        return slave_exception(self, rsp, function, MB_EX_ILLEGAL_ADDRESS);
+
+    rsp[0] = function;
+    rsp[1] = (uint8_t)((quantity + 7) / 8);
+    slave_get_bits(table, addr, quantity, rsp + 2);
+    return 2 + rsp[1];
+}
+
+static int slave_read_regs(modbus_slave_t *self, const uint8_t *req, uint8_t *rsp)
+{
+    uint8_t function = req[0];
+    uint16_t addr = get_u16(req + 1);
+    uint16_t quantity = get_u16(req + 3);
+    mb_slave_table_t *table = &self->tables[function == FC_READ_HOLDING_REGISTERS ? HOLDING_REGISTER : INPUT_REGISTER];
+
+    if (quantity == 0 || quantity > MODBUS_MAX_HOLDING_PER_READ)
+        return slave_exception(self, rsp, function, MB_EX_ILLEGAL_VALUE);
+    if (!slave_mapped(table, addr, quantity))
+        return slave_exception(self, rsp, function, MB_EX_ILLEGAL_ADDRESS);
+
+    rsp[0] = function;
+    rsp[1] = (uint8_t)(quantity * 2);
+    slave_get_regs(table, addr, quantity, rsp + 2);
+    return 2 + rsp[1];
+}
+
+static int slave_write_single_coil(modbus_slave_t *self, const uint8_t *req, uint8_t *rsp)
+{
+    uint16_t addr = get_u16(req + 1);
+    uint16_t value = get_u16(req + 3);
+
+    // 0xFF00 on, 0x0000 off
+    if (value != 0xFF00 && value != 0x0000)
+        return slave_exception(self, rsp, req[0], MB_EX_ILLEGAL_VALUE);
+    mb_slave_range_t *r = slave_find(&self->tables[COIL], addr);
+    if (!r)
+        return slave_exception(self, rsp, req[0], MB_EX_ILLEGAL_ADDRESS);
+
+    ((uint8_t *)r->values)[addr - r->start] = value ? 1 : 0;
+    slave_notify(self, COIL, addr, 1);
+    memcpy(rsp, req, 5);
+    return 5;
+}
+
+static int slave_write_single_register(modbus_slave_t *self, const uint8_t *req, uint8_t *rsp)
+{
+    uint16_t addr = get_u16(req + 1);
+    mb_slave_range_t *r = slave_find(&self->tables[HOLDING_REGISTER], addr);
+    if (!r)
+        return slave_exception(self, rsp, req[0], MB_EX_ILLEGAL_ADDRESS);
+
+    ((uint16_t *)r->values)[addr - r->start] = get_u16(req + 3);
+    slave_notify(self, HOLDING_REGISTER, addr, 1);
+    memcpy(rsp, req, 5);
+    return 5;
+}
+
+static int slave_write_coils(modbus_slave_t *self, const uint8_t *req, int req_len, uint8_t *rsp)
+{
+    uint16_t addr = get_u16(req + 1);
+    uint16_t quantity = get_u16(req + 3);
+
+    if (quantity == 0 || quantity > MODBUS_MAX_COIL_PER_WRITE || req[5] != (quantity + 7) / 8 ||
+        req_len < 6 + req[5])
+        return slave_exception(self, rsp, req[0], MB_EX_ILLEGAL_VALUE);
+    if (!slave_mapped(&self->tables[COIL], addr, quantity))
+        return slave_exception(self, rsp, req[0], MB_EX_ILLEGAL_ADDRESS);
+
+    slave_set_bits(&self->tables[COIL], addr, quantity, req + 6);
+    slave_notify(self, COIL, addr, quantity);
+    memcpy(rsp, req, 5);
+    return 5;
+}
+
+static int slave_write_registers(modbus_slave_t *self, const uint8_t *req, int req_len, uint8_t *rsp)
+{
+    uint16_t addr = get_u16(req + 1);
+    uint16_t quantity = get_u16(req + 3);
+
+    if (quantity == 0 || quantity > MODBUS_MAX_HOLDING_PER_WRITE || req[5] != quantity * 2 ||
+        req_len < 6 + req[5])
+        return slave_exception(self, rsp, req[0], MB_EX_ILLEGAL_VALUE);
+    if (!slave_mapped(&self->tables[HOLDING_REGISTER], addr, quantity))
+        return slave_exception(self, rsp, req[0], MB_EX_ILLEGAL_ADDRESS);
+
+    slave_set_regs(&self->tables[HOLDING_REGISTER], addr, quantity, req + 6);
+    slave_notify(self, HOLDING_REGISTER, addr, quantity);
+    memcpy(rsp, req, 5);
+    return 5;
+}
+
+static int slave_mask_write(modbus_slave_t *self, const uint8_t *req, uint8_t *rsp)
+{
+    uint16_t addr = get_u16(req + 1);
+    uint16_t and_mask = get_u16(req + 3);
+    uint16_t or_mask = get_u16(req + 5);
+    mb_slave_range_t *r = slave_find(&self->tables[HOLDING_REGISTER], addr);
+    if (!r)
+        return slave_exception(self, rsp, req[0], MB_EX_ILLEGAL_ADDRESS);
+
+    uint16_t *value = &((uint16_t *)r->values)[addr - r->start];
+    *value = (uint16_t)((*value & and_mask) | (or_mask & ~and_mask));
+    slave_notify(self, HOLDING_REGISTER, addr, 1);
+    memcpy(rsp, req, 7);
+    return 7;
+}
+
+static int slave_read_write_registers(modbus_slave_t *self, const uint8_t *req, int req_len, uint8_t *rsp)
+{
+    uint16_t read_addr = get_u16(req + 1);
+    uint16_t read_quantity = get_u16(req + 3);
+    uint16_t write_addr = get_u16(req + 5);
+    uint16_t write_quantity = get_u16(req + 7);
+    mb_slave_table_t *table = &self->tables[HOLDING_REGISTER];
+
+    if (read_quantity == 0 || read_quantity > MODBUS_MAX_HOLDING_PER_READ || write_quantity == 0 ||
+        write_quantity > MODBUS_MAX_HOLDING_PER_READ_WRITE || req[9] != write_quantity * 2 || req_len < 10 + req[9])
+        return slave_exception(self, rsp, req[0], MB_EX_ILLEGAL_VALUE);
+    if (!slave_mapped(table, read_addr, read_quantity) || !slave_mapped(table, write_addr, write_quantity))
+        return slave_exception(self, rsp, req[0], MB_EX_ILLEGAL_ADDRESS);
+
+    // the write goes first
+    slave_set_regs(table, write_addr, write_quantity, req + 10);
+    slave_notify(self, HOLDING_REGISTER, write_addr, write_quantity);
+    rsp[0] = req[0];
+    rsp[1] = (uint8_t)(read_quantity * 2);
+    slave_get_regs(table, read_addr, read_quantity, rsp + 2);
+    return 2 + rsp[1];
+}
+
+// fifo at a holding register: the register holds the count, the values follow
+static int slave_read_fifo(modbus_slave_t *self, const uint8_t *req, uint8_t *rsp)
+{
+    uint16_t addr = get_u16(req + 1);
+    mb_slave_table_t *table = &self->tables[HOLDING_REGISTER];
+    mb_slave_range_t *r = slave_find(table, addr);
+    if (!r)
+        return slave_exception(self, rsp, req[0], MB_EX_ILLEGAL_ADDRESS);
+
+    uint16_t count = ((uint16_t *)r->values)[addr - r->start];
+    if (count > 31)
+        return slave_exception(self, rsp, req[0], MB_EX_ILLEGAL_VALUE);
+    if (count > 0 && (addr == 0xFFFF || !slave_mapped(table, (uint16_t)(addr + 1), count)))
+        return slave_exception(self, rsp, req[0], MB_EX_ILLEGAL_ADDRESS);
+
+    rsp[0] = req[0];
+    put_u16(rsp + 1, (uint16_t)(2 + count * 2));
+    put_u16(rsp + 3, count);
+    if (count > 0)
+        slave_get_regs(table, (uint16_t)(addr + 1), count, rsp + 5);
+    return 5 + count * 2;
+}
+
+static int slave_read_file_record(modbus_slave_t *self, const uint8_t *req, int req_len, uint8_t *rsp)
+{
+    int byte_count = req[1];
+    if (byte_count < 7 || byte_count > 0xF5 || byte_count % 7 != 0 || req_len < 2 + byte_count)
+        return slave_exception(self, rsp, req[0], MB_EX_ILLEGAL_VALUE);
+
+    // check all sub-requests before answering any
+    int rsp_len = 2;
+    for (const uint8_t *sub = req + 2; sub < req + 2 + byte_count; sub += 7) {
+        mb_slave_file_t *file = slave_find_file(self, get_u16(sub + 1));
+        uint16_t record = get_u16(sub + 3);
+        uint16_t length = get_u16(sub + 5);
+        if (sub[0] != FILE_REFERENCE_TYPE)
+            return slave_exception(self, rsp, req[0], MB_EX_ILLEGAL_VALUE);
+        if (!file || record > FILE_MAX_RECORD || (uint32_t)record + length > file->nrecords)
+            return slave_exception(self, rsp, req[0], MB_EX_ILLEGAL_ADDRESS);
+        rsp_len += 2 + length * 2;
+        if (rsp_len > MODBUS_MAX_PDU_SIZE)
+            return slave_exception(self, rsp, req[0], MB_EX_ILLEGAL_VALUE);
+    }
+
+    uint8_t *p = rsp + 2;
+    for (const uint8_t *sub = req + 2; sub < req + 2 + byte_count; sub += 7) {
+        mb_slave_file_t *file = slave_find_file(self, get_u16(sub + 1));
+        uint16_t record = get_u16(sub + 3);
+        uint16_t length = get_u16(sub + 5);
+        *p++ = (uint8_t)(1 + length * 2);
+        *p++ = FILE_REFERENCE_TYPE;
+        for (int i = 0; i < length; i++, p += 2)
+            put_u16(p, file->records[record + i]);
+    }
+    rsp[0] = req[0];
+    rsp[1] = (uint8_t)(rsp_len - 2);
+    return rsp_len;
+}
+
+static int slave_write_file_record(modbus_slave_t *self, const uint8_t *req, int req_len, uint8_t *rsp)
+{
+    int byte_count = req[1];
+    if (byte_count < 9 || byte_count > 0xFB || req_len < 2 + byte_count)
+        return slave_exception(self, rsp, req[0], MB_EX_ILLEGAL_VALUE);
+
+    const uint8_t *end = req + 2 + byte_count;
+    for (const uint8_t *sub = req + 2; sub < end;) {
+        if (end - sub < 7 || sub[0] != FILE_REFERENCE_TYPE)
+            return slave_exception(self, rsp, req[0], MB_EX_ILLEGAL_VALUE);
+        mb_slave_file_t *file = slave_find_file(self, get_u16(sub + 1));
+        uint16_t record = get_u16(sub + 3);
+        uint16_t length = get_u16(sub + 5);
+        if (end - sub < 7 + length * 2)
+            return slave_exception(self, rsp, req[0], MB_EX_ILLEGAL_VALUE);
+        if (!file || record > FILE_MAX_RECORD || (uint32_t)record + length > file->nrecords)
+            return slave_exception(self, rsp, req[0], MB_EX_ILLEGAL_ADDRESS);
+        sub += 7 + length * 2;
+    }
+
+    for (const uint8_t *sub = req + 2; sub < end;) {
+        mb_slave_file_t *file = slave_find_file(self, get_u16(sub + 1));
+        uint16_t record = get_u16(sub + 3);
+        uint16_t length = get_u16(sub + 5);
+        for (int i = 0; i < length; i++)
+            file->records[record + i] = get_u16(sub + 7 + i * 2);
+        sub += 7 + length * 2;
+    }
+
+    // the response echoes the request
+    memcpy(rsp, req, (size_t)(2 + byte_count));
+    return 2 + byte_count;
+}
+
+static int slave_diagnostics(modbus_slave_t *self, const uint8_t *req, uint8_t *rsp)
+{
+    uint16_t sub_function = get_u16(req + 1);
+    modbus_slave_counters_t *c = &self->counters;
+    uint16_t value;
+
+    switch (sub_function) {
+    case DIAG_RETURN_QUERY_DATA:
+        memcpy(rsp, req, 5);
+        return 5;
+    case DIAG_RESTART_COMM:
+        memset(c, 0, sizeof(*c));
+        self->nevents = 0;
+        memcpy(rsp, req, 5);
+        return 5;
+    case DIAG_CLEAR_COUNTERS:
+        memset(c, 0, sizeof(*c));
+        memcpy(rsp, req, 5);
+        return 5;
+    case DIAG_RETURN_REGISTER:
+    case DIAG_SERVER_NAK_COUNT:
+    case DIAG_SERVER_BUSY_COUNT:
+    case DIAG_CHAR_OVERRUN_COUNT:
+        value = 0;
+        break;
+    case DIAG_BUS_MESSAGE_COUNT:
+        value = c->bus_messages;
+        break;
+    case DIAG_BUS_COMM_ERROR_COUNT:
+        value = c->comm_errors;
+        break;
+    case DIAG_EXCEPTION_ERROR_COUNT:
+        value = c->exceptions;
+        break;
+    case DIAG_SERVER_MESSAGE_COUNT:
+        value = c->server_messages;
+        break;
+    case DIAG_SERVER_NO_RESPONSE_COUNT:
+        value = c->no_responses;
+        break;
+    default:
+        return slave_exception(self, rsp, req[0], MB_EX_ILLEGAL_FUNCTION);
+    }
+
+    memcpy(rsp, req, 3);
+    put_u16(rsp + 3, value);
+    return 5;
+}
+
+static int slave_comm_event_log(modbus_slave_t *self, uint8_t *rsp)
+{
+    rsp[0] = FC_GET_COMM_EVENT_LOG;
+    rsp[1] = (uint8_t)(6 + self->nevents);
+    put_u16(rsp + 2, 0); // status, not busy
+    put_u16(rsp + 4, self->counters.event_count);
+    put_u16(rsp + 6, self->counters.bus_messages);
+    memcpy(rsp + 8, self->events, (size_t)self->nevents);
+    return 8 + self->nevents;
+}
+
+static int slave_report_server_id(modbus_slave_t *self, uint8_t *rsp)
+{
+    rsp[0] = FC_REPORT_SERVER_ID;
+    rsp[1] = (uint8_t)(self->server_id_len + 1);
+    memcpy(rsp + 2, self->server_id, (size_t)self->server_id_len);
+    rsp[2 + self->server_id_len] = 0xFF; // run indicator, on
+    return 3 + self->server_id_len;
+}
+
+static int slave_read_device_id(modbus_slave_t *self, const uint8_t *req, int req_len, uint8_t *rsp)
+{
+    if (req_len < 4 || req[1] != MEI_READ_DEVICE_ID)
+        return slave_exception(self, rsp, req[0], MB_EX_ILLEGAL_FUNCTION);
+
+    uint8_t read_code = req[2];
+    uint8_t object_id = req[3];
+    if (read_code < 1 || read_code > 4)
+        return slave_exception(self, rsp, req[0], MB_EX_ILLEGAL_VALUE);
+    if (read_code == 4 && object_id > 2)
+        return slave_exception(self, rsp, req[0], MB_EX_ILLEGAL_ADDRESS);
+    // only basic objects, streams start over when asked past them
+    if (object_id > 2)
+        object_id = 0;
+
+    rsp[0] = req[0];
+    rsp[1] = MEI_READ_DEVICE_ID;
+    rsp[2] = read_code;
+    rsp[3] = DEVICE_ID_CONFORMITY;
+    rsp[4] = 0; // no more follows
+    rsp[5] = 0; // next object id
+    rsp[6] = 0; // number of objects
+    int len = 7;
+    int last = read_code == 4 ? object_id : 2;
+    for (int id = object_id; id <= last; id++) {
+        const char *value = self->identity[id] ? self->identity[id] : "";
+        size_t value_len = strlen(value);
+        if (value_len > 64)
+            value_len = 64;
+        rsp[len++] = (uint8_t)id;
+        rsp[len++] = (uint8_t)value_len;
+        memcpy(rsp + len, value, value_len);
+        len += (int)value_len;
+        rsp[6]++;
+    }
+    return len;
+}
+
+static int slave_dispatch(modbus_slave_t *self, const uint8_t *req, int req_len, uint8_t *rsp)
+{
+    uint8_t function = req[0];
+    int len;
+
+    switch (function) {
+    case FC_READ_COILS:
+    case FC_READ_DISCRETE_INPUTS:
+        len = slave_read_bits(self, req, rsp);
+        break;
+    case FC_READ_HOLDING_REGISTERS:
+    case FC_READ_INPUT_REGISTERS:
+        len = slave_read_regs(self, req, rsp);
+        break;
+    case FC_WRITE_SINGLE_COIL:
+        len = slave_write_single_coil(self, req, rsp);
+        break;
+    case FC_WRITE_SINGLE_REGISTER:
+        len = slave_write_single_register(self, req, rsp);
+        break;
+    case FC_READ_EXCEPTION_STATUS:
+        rsp[0] = function;
+        rsp[1] = self->exception_status;
+        len = 2;
+        break;
+    case FC_DIAGNOSTICS:
+        len = slave_diagnostics(self, req, rsp);
+        break;
+    case FC_GET_COMM_EVENT_COUNTER:
+        rsp[0] = function;
+        put_u16(rsp + 1, 0); // status, not busy
+        put_u16(rsp + 3, self->counters.event_count);
+        len = 5;
+        break;
+    case FC_GET_COMM_EVENT_LOG:
+        len = slave_comm_event_log(self, rsp);
+        break;
+    case FC_WRITE_COILS:
+        len = slave_write_coils(self, req, req_len, rsp);
+        break;
+    case FC_WRITE_HOLDING_REGISTERS:
+        len = slave_write_registers(self, req, req_len, rsp);
+        break;
+    case FC_REPORT_SERVER_ID:
+        len = slave_report_server_id(self, rsp);
+        break;
+    case FC_READ_FILE_RECORD:
+        len = slave_read_file_record(self, req, req_len, rsp);
+        break;
+    case FC_WRITE_FILE_RECORD:
+        len = slave_write_file_record(self, req, req_len, rsp);
+        break;
+    case FC_MASK_WRITE_REGISTER:
+        len = slave_mask_write(self, req, rsp);
+        break;
+    case FC_READ_WRITE_REGISTERS:
+        len = slave_read_write_registers(self, req, req_len, rsp);
+        break;
+    case FC_READ_FIFO_QUEUE:
+        len = slave_read_fifo(self, req, rsp);
+        break;
+    case FC_MEI:
+        len = slave_read_device_id(self, req, req_len, rsp);
+        break;
+    default:
+        len = slave_exception(self, rsp, function, MB_EX_ILLEGAL_FUNCTION);
+        break;
+    }
+
+    return len;
+}
+
+// is a completed request counted by the comm event counter
+static bool slave_counts_event(uint8_t function)
+{
+    return function != FC_GET_COMM_EVENT_COUNTER && function != FC_GET_COMM_EVENT_LOG;
+}
+
+
+// --------------------- public interface ---------------------------------------
+
+modbus_slave_t *modbus_slave_create(uint8_t slave_id)
+{
+    modbus_slave_t *slave = (modbus_slave_t *)calloc(1, sizeof(modbus_slave_t));
+    slave->slave_id = slave_id;
+    return slave;
+}
+
+void modbus_slave_destroy(modbus_slave_t *self)
+{
+    if (self) {
+        for (int i = 0; i <= HOLDING_REGISTER; i++)
+            free(self->tables[i].pages);
+        free(self);
+    }
+}
+
+int modbus_slave_map(modbus_slave_t *self, uint8_t reg_type, uint16_t start, uint16_t count, void *values)
+{
+    if (reg_type > HOLDING_REGISTER || reg_type == INVALID || count == 0 || !values ||
+        (uint32_t)start + count > 0x10000)
+        return DEVICE_E_CONFIG;
+
+    mb_slave_table_t *table = &self->tables[reg_type];
+    if (table->nranges == MB_SLAVE_MAX_RANGES)
+        return DEVICE_E_CONFIG;
+
+    // keep ranges sorted, refuse overlaps
+    int at = 0;
+    while (at < table->nranges && table->ranges[at].start < start)
+        at++;
+    if (at > 0 && (uint32_t)table->ranges[at - 1].start + table->ranges[at - 1].count > start)
+        return DEVICE_E_CONFIG;
+    if (at < table->nranges && (uint32_t)start + count > table->ranges[at].start)
+        return DEVICE_E_CONFIG;
+
+    if (!table->pages)
+        table->pages = (uint8_t *)malloc(MB_SLAVE_PAGES);
+    memmove(&table->ranges[at + 1], &table->ranges[at], (size_t)(table->nranges - at) * sizeof(mb_slave_range_t));
+    table->ranges[at].start = start;
+    table->ranges[at].count = count;
+    table->ranges[at].values = values;
+    table->nranges++;
+    table_build_pages(table);
+    return DEVICE_OK;
+}
+
+void *modbus_slave_lookup(modbus_slave_t *self, uint8_t reg_type, uint16_t addr)
+{
+    if (reg_type > HOLDING_REGISTER)
+        return NULL;
+
+    mb_slave_range_t *r = slave_find(&self->tables[reg_type], addr);
+    if (!r)
+        return NULL;
+    size_t size = reg_type == COIL || reg_type == DISCRETE_INPUT ? sizeof(uint8_t) : sizeof(uint16_t);
+    return (uint8_t *)r->values + (addr - r->start) * size;
+}
+
+int modbus_slave_map_file(modbus_slave_t *self, uint16_t file_no, uint16_t *records, uint16_t nrecords)
+{
+    if (self->nfiles == MB_SLAVE_MAX_FILES || file_no == 0 || !records || slave_find_file(self, file_no))
+        return DEVICE_E_CONFIG;
+
+    mb_slave_file_t *file = &self->files[self->nfiles++];
+    file->file_no = file_no;
+    file->records = records;
+    file->nrecords = nrecords;
+    return DEVICE_OK;
+}
+
+void modbus_slave_set_server_id(modbus_slave_t *self, const uint8_t *id, int len)
+{
+    if (len > MB_SLAVE_SERVER_ID_SIZE)
+        len = MB_SLAVE_SERVER_ID_SIZE;
+    memcpy(self->server_id, id, (size_t)len);
+    self->server_id_len = len;
+}
+
+void modbus_slave_set_identity(modbus_slave_t *self, const char *vendor, const char *product_code,
+                               const char *revision)
+{
+    self->identity[0] = vendor;
+    self->identity[1] = product_code;
+    self->identity[2] = revision;
+}
+
+int modbus_slave_handle_pdu(modbus_slave_t *self, const uint8_t *req, int req_len, uint8_t *rsp)
+{
+    self->counters.server_messages++;
+
+    // a known function cut short gives 0 or more than req_len, -1 is an
+    // unknown function the dispatch rejects
+    int len;
+    uint8_t function = req_len > 0 ? req[0] : 0;
+    int need = mb_request_pdu_len(req, req_len);
+    if (req_len < 1 || need == 0 || need > req_len)
+        len = slave_exception(self, rsp, function, MB_EX_ILLEGAL_VALUE);
+    else
+        len = slave_dispatch(self, req, req_len, rsp);
+
+    if (rsp[0] & 0x80) {
+        slave_log_event(self, (uint8_t)(EVENT_SEND | (rsp[1] == MB_EX_SERVER_FAILURE ? EVENT_SEND_ABORT_EXCEPTION
+                                                                                    : EVENT_SEND_READ_EXCEPTION)));
+    } else {
+        if (slave_counts_event(function))
+            self->counters.event_count++;
+        if (function != FC_GET_COMM_EVENT_LOG)
+            slave_log_event(self, EVENT_SEND);
+    }
+    return len;
+}
+
+int modbus_slave_handle_adu(modbus_slave_t *self, const uint8_t *adu, int adu_len, modbus_adu_t *rsp)
+{
+    self->counters.bus_messages++;
+    if (adu_len < 4 || (uint16_t)(adu[adu_len - 2] + (adu[adu_len - 1] << 8)) != crc16(adu, (size_t)(adu_len - 2))) {
+        // a slave stays silent on a crc error
+        self->counters.comm_errors++;
+        slave_log_event(self, EVENT_RECEIVE | EVENT_RECEIVE_COMM_ERROR);
+        return 0;
+    }
+
+    uint8_t slave_id = adu[0];
+    if (slave_id != self->slave_id && slave_id != 0)
+        return 0;
+
+    slave_log_event(self, (uint8_t)(EVENT_RECEIVE | (slave_id == 0 ? EVENT_RECEIVE_BROADCAST : 0)));
+    int pdu_len = modbus_slave_handle_pdu(self, adu + 1, adu_len - 3, MODBUS_ADU_PDU(rsp));
+    if (slave_id == 0) {
+        self->counters.no_responses++;
+        return 0;
+    }
+    return pdu_len;
+}
+
+int modbus_slave_serve_rtu(modbus_slave_t *self, modbus_rtu_t *rtu, uint32_t duration_ms)
+{
+    struct pollfd fds[1];
+    fds[0].fd = rtu->uart_fd;
+    fds[0].events = POLLIN;
+
+    // poll has ms resolution, round t3.5 up
+    int silence_ms = (int)((rtu->t35_us + 999) / 1000);
+    uint64_t end_us = duration_ms ? timer_monotonic_us() + (uint64_t)duration_ms * 1000 : UINT64_MAX;
+    int result = DEVICE_OK;
+    modbus_adu_t rsp;
+
+    self->running = true;
+    while (self->running) {
+        uint64_t now = timer_monotonic_us();
+        if (now >= end_us)
+            break;
+        int wait_ms = end_us - now < (uint64_t)silence_ms * 1000 ? (int)((end_us - now + 999) / 1000) : silence_ms;
+
+        int nevents = poll(fds, 1, wait_ms);
+        if (nevents < 0) {
+            if (errno == EINTR)
+                continue;
+            Log_Debug("uart poll error:%s\n", strerror(errno));
+            result = DEVICE_E_IO;
+            break;
+        }
+        if (nevents > 0 && (fds[0].revents & (POLLHUP | POLLERR))) {
+            result = DEVICE_E_BROKEN;
+            break;
+        }
+        if (nevents > 0 && (result = modbus_rtu_rx_read(rtu)) != DEVICE_OK)
+            break;
+
+        // requests are cut as soon as their length is in, silence ends the
+        // frames of other slaves' responses and unknown function codes
+        bool silent = timer_monotonic_us() >= modbus_rtu_ready_at(rtu);
+        while (true) {
+            uint8_t *frame = NULL;
+            int fbytes = 0;
+            if (modbus_rtu_rx_request(rtu, silent, &frame, &fbytes) != DEVICE_OK) {
+                self->counters.comm_errors++;
+                break;
+            }
+            if (fbytes == 0)
+                break;
+
+            mb_trace_frame(MB_TRACE_RX, rtu->uart_fd, frame, fbytes);
+            int pdu_len = modbus_slave_handle_adu(self, frame, fbytes, &rsp);
+            if (pdu_len > 0) {
+                int err = modbus_rtu_send_adu(rtu, self->slave_id, &rsp, pdu_len, MB_SLAVE_SEND_TIMEOUT_MS);
+                if (err != DEVICE_OK)
+                    Log_Debug("Failed to send response:%s\n", strerr(err));
+            }
+        }
+    }
+
+    self->running = false;
+    return result;
+}
+
+void modbus_slave_stop(modbus_slave_t *self)
+{
+    self->running = false;
+}
@@ -0,0 +1,121 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "modbus.h"
+#include "modbus_rtu.h"
+
+// Modbus slave (server) engine, so the adapter can answer requests itself,
+// e.g. as a concentrator polled by PLCs on a downstream bus.
+//
+//   uint16_t holdings[100];
+//   modbus_slave_t *slave = modbus_slave_create(1);
+//   modbus_slave_map(slave, HOLDING_REGISTER, 1000, 100, holdings);
+//   modbus_slave_serve_rtu(slave, rtu, 0);
+//
+// Coils, discrete inputs, input and holding registers are ranges of
+// addresses mapped onto caller arrays, one byte per coil and one uint16_t per
+// register. A page table per register type finds the range of an address in
+// constant time. All function codes of the FC_* enum are answered, read and
+// write file record on files added with modbus_slave_map_file.
+//
+// The engine doesn't lock, values are read and written from the thread
+// serving requests. on_write tells the application what a master changed.
+
+#define MB_SLAVE_MAX_RANGES 32 // per register type
+#define MB_SLAVE_PAGE_BITS 4   // 16 addresses per page table entry
+#define MB_SLAVE_PAGES (0x10000 >> MB_SLAVE_PAGE_BITS)
+#define MB_SLAVE_MAX_FILES 8
+#define MB_SLAVE_EVENT_LOG_SIZE 64
+#define MB_SLAVE_SERVER_ID_SIZE 32
+#define MB_SLAVE_SEND_TIMEOUT_MS 100
+
+typedef struct mb_slave_range_t mb_slave_range_t;
+struct mb_slave_range_t {
+    uint16_t start;
+    uint16_t count;
+    void *values; // uint8_t per coil or uint16_t per register
+};
+
+// ranges of one register type, sorted by start. pages[addr >> MB_SLAVE_PAGE_BITS]
+// is 1 + index of the first range reaching into the page, 0 if none does.
+typedef struct mb_slave_table_t mb_slave_table_t;
+struct mb_slave_table_t {
+    mb_slave_range_t ranges[MB_SLAVE_MAX_RANGES];
+    int nranges;
+    uint8_t *pages;
+};
+
+typedef struct mb_slave_file_t mb_slave_file_t;
+struct mb_slave_file_t {
+    uint16_t file_no;
+    uint16_t nrecords;
+    uint16_t *records;
+};
+
+// diagnostics counters, FC 0x08 sub-functions 0x0B to 0x12
+typedef struct modbus_slave_counters_t modbus_slave_counters_t;
+struct modbus_slave_counters_t {
+    uint16_t bus_messages;    // frames seen on the bus
+    uint16_t comm_errors;     // frames with a crc error
+    uint16_t exceptions;      // exception responses sent
+    uint16_t server_messages; // requests addressed to the slave, broadcast included
+    uint16_t no_responses;    // requests not answered, broadcast
+    uint16_t event_count;     // requests completed without exception, FC 0x0B
+};
+
+typedef struct modbus_slave_t modbus_slave_t;
+struct modbus_slave_t {
+    uint8_t slave_id;
+    mb_slave_table_t tables[HOLDING_REGISTER + 1]; // by register type
+    mb_slave_file_t files[MB_SLAVE_MAX_FILES];
+    int nfiles;
+
+    uint8_t exception_status; // FC 0x07
+    uint8_t server_id[MB_SLAVE_SERVER_ID_SIZE]; // FC 0x11
+    int server_id_len;
+    const char *identity[3]; // FC 0x2B objects vendor name, product code, revision
+
+    modbus_slave_counters_t counters;
+    uint8_t events[MB_SLAVE_EVENT_LOG_SIZE]; // FC 0x0C event log, latest first
+    int nevents;
+    volatile bool running;
+
+    // called after a master wrote quantity values at addr
+    void (*on_write)(modbus_slave_t *slave, uint8_t reg_type, uint16_t addr, uint16_t quantity, void *ctx);
+    void *ctx;
+};
+
+modbus_slave_t *modbus_slave_create(uint8_t slave_id);
+void modbus_slave_destroy(modbus_slave_t *self);
+
+// map count addresses from start of reg_type onto values, which the caller
+// keeps alive. Ranges of a type must not overlap. Return DEVICE_E_CONFIG if
+// they do or the table is full.
+int modbus_slave_map(modbus_slave_t *self, uint8_t reg_type, uint16_t start, uint16_t count, void *values);
+
+// value of addr, NULL if unmapped
+void *modbus_slave_lookup(modbus_slave_t *self, uint8_t reg_type, uint16_t addr);
+
+// file file_no of nrecords records for read/write file record
+int modbus_slave_map_file(modbus_slave_t *self, uint16_t file_no, uint16_t *records, uint16_t nrecords);
+
+// answers of report server id and read device identification, strings are
+// kept by the caller
+void modbus_slave_set_server_id(modbus_slave_t *self, const uint8_t *id, int len);
+void modbus_slave_set_identity(modbus_slave_t *self, const char *vendor, const char *product_code,
+                               const char *revision);
+
+// handle a request pdu of any transport, write the response pdu to rsp,
+// which needs MODBUS_MAX_PDU_SIZE bytes, and return its length
+int modbus_slave_handle_pdu(modbus_slave_t *self, const uint8_t *req, int req_len, uint8_t *rsp);
+
+// handle a received rtu adu, check crc and slave id and build the response
+// pdu at MODBUS_ADU_PDU(rsp). Return the response pdu length, 0 when nothing
+// must be sent: not for us, broadcast or crc error.
+int modbus_slave_handle_adu(modbus_slave_t *self, const uint8_t *adu, int adu_len, modbus_adu_t *rsp);
+
+// serve requests on an open rtu link for duration_ms, or until
+// modbus_slave_stop when 0. Frames are cut by request length, so responses go
+// out right after the t3.5 gap instead of waiting for silence.
+int modbus_slave_serve_rtu(modbus_slave_t *self, modbus_rtu_t *rtu, uint32_t duration_ms);
+void modbus_slave_stop(modbus_slave_t *self);
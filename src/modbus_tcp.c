@@ -0,0 +1,315 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "modbus_tcp.h"
+#include "modbus_trace.h"
+#include "utils.h"
+
+
+// wait for events on the socket, return DEVICE_OK when they are there
+static int tcp_wait(modbus_tcp_t *self, short events, int timeout)
+{
+    struct pollfd fds[1];
+    fds[0].fd = self->fd;
+    fds[0].events = events;
+
+    int nevents;
+    do {
+        nevents = poll(fds, 1, timeout < 0 ? 0 : timeout);
+    } while (nevents < 0 && errno == EINTR);
+
+    if (nevents < 0) {
+        Log_Debug("tcp poll error:%s\n", strerror(errno));
+        return DEVICE_E_IO;
+    } else if (nevents == 0) {
+        return DEVICE_E_TIMEOUT;
+    } else if (fds[0].revents & (POLLHUP | POLLERR)) {
+        Log_Debug("tcp connection broken\n");
+        return DEVICE_E_BROKEN;
+    }
+    return DEVICE_OK;
+}
+
+static int tcp_write(modbus_tcp_t *self, const uint8_t *buf, int count, int timeout)
+{
+    struct timespec poll_sw;
+    timer_stopwatch_start(&poll_sw);
+
+    int total = 0;
+    int err = DEVICE_OK;
+    while (total < count) {
+        ssize_t nwrite = send(self->fd, buf + total, (size_t)(count - total), MSG_NOSIGNAL);
+        if (nwrite >= 0) {
+            total += (int)nwrite;
+            continue;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            Log_Debug("tcp write error:%s\n", strerror(errno));
+            err = errno == EPIPE || errno == ECONNRESET ? DEVICE_E_BROKEN : DEVICE_E_IO;
+            break;
+        }
+
+        err = tcp_wait(self, POLLOUT, timeout - (int)timer_stopwatch_stop(&poll_sw));
+        if (err)
+            break;
+    }
+
+    // the server would take the next request for the rest of this frame,
+    // only a new connection gets the stream back in step
+    if (err && total > 0) {
+        Log_Debug("tcp frame cut after %d of %d bytes\n", total, count);
+        modbus_tcp_close(self);
+        return DEVICE_E_BROKEN;
+    }
+    return err;
+}
+
+// drop the frame returned by the previous recv, keep what follows it
+static void tcp_rx_consume(modbus_tcp_t *self)
+{
+    if (self->rx_frame_len > 0) {
+        self->rx_len -= self->rx_frame_len;
+        memmove(self->rx_buf, self->rx_buf + self->rx_frame_len, (size_t)self->rx_len);
+        self->rx_frame_len = 0;
+    }
+}
+
+static modbus_tcp_inflight_t *tcp_find(modbus_tcp_t *self, uint16_t tid)
+{
+    for (int i = 0; i < MODBUS_TCP_MAX_INFLIGHT; i++) {
+        if (self->inflight[i].used && self->inflight[i].tid == tid)
+            return &self->inflight[i];
+    }
+    return NULL;
+}
+
+
+// ------------------------ public interface --------------------------------
+
+int modbus_tcp_open(modbus_tcp_t *self)
+{
+    // don't try to open again
+    if (self->fd >= 0)
+        return 0;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(self->port);
+    if (inet_pton(AF_INET, self->host, &addr.sin_addr) != 1) {
+        Log_Debug("ERROR: Invalid ipv4 address %s\n", self->host);
+        return DEVICE_E_CONFIG;
+    }
+
+    self->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (self->fd < 0) {
+        Log_Debug("ERROR: Could not create socket: %s\n", strerror(errno));
+        return DEVICE_E_IO;
+    }
+
+    int err = DEVICE_OK;
+    if (connect(self->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        if (errno != EINPROGRESS) {
+            err = DEVICE_E_BROKEN;
+        } else if ((err = tcp_wait(self, POLLOUT, MODBUS_TCP_CONNECT_TIMEOUT_MS)) == DEVICE_OK) {
+            int so_error = 0;
+            socklen_t len = sizeof(so_error);
+            getsockopt(self->fd, SOL_SOCKET, SO_ERROR, &so_error, &len);
+            if (so_error != 0) {
+                errno = so_error;
+                err = DEVICE_E_BROKEN;
+            }
+        }
+    }
+    if (err) {
+        Log_Debug("ERROR: Could not connect to %s:%u: %s\n", self->host, self->port, strerror(errno));
+        close(self->fd);
+        self->fd = -1;
+        return err;
+    }
+
+    // requests are small and latency bound, don't let nagle hold them back
+    int one = 1;
+    setsockopt(self->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return DEVICE_OK;
+}
+
+int modbus_tcp_close(modbus_tcp_t *self)
+{
+    int result = 0;
+    if (self->fd >= 0) {
+        result = close(self->fd);
+        self->fd = -1;
+    }
+    modbus_tcp_cancel(self);
+    self->rx_len = 0;
+    self->rx_frame_len = 0;
+    return result;
+}
+
+void modbus_tcp_cancel(modbus_tcp_t *self)
+{
+    memset(self->inflight, 0, sizeof(self->inflight));
+    self->ninflight = 0;
+}
+
+int modbus_tcp_send_adu(modbus_tcp_t *self, uint8_t unit_id, modbus_adu_t *adu, int pdu_len, uint16_t *tid,
+                        int timeout)
+{
+    if (self->fd < 0)
+        return DEVICE_E_BROKEN;
+
+    modbus_tcp_inflight_t *slot = NULL;
+    for (int i = 0; i < MODBUS_TCP_MAX_INFLIGHT && !slot; i++) {
+        if (!self->inflight[i].used)
+            slot = &self->inflight[i];
+    }
+    if (!slot)
+        return DEVICE_E_BUSY;
+
+    // mbap header: transaction id, protocol 0, length of unit id + pdu, unit id
+    uint16_t id = self->next_tid++;
+    uint8_t *frame = adu->data;
+    frame[0] = (uint8_t)(id >> 8);
+    frame[1] = (uint8_t)(id & 0xFF);
+    frame[2] = 0;
+    frame[3] = 0;
+    frame[4] = (uint8_t)((pdu_len + 1) >> 8);
+    frame[5] = (uint8_t)((pdu_len + 1) & 0xFF);
+    frame[6] = unit_id;
+
+    int adu_len = MODBUS_TCP_MBAP_SIZE + pdu_len;
+    int err = tcp_write(self, frame, adu_len, timeout);
+    if (err) {
+        Log_Debug("Failed to write request:%s\n", strerr(err));
+        return err;
+    }
+    mb_trace_frame(MB_TRACE_TX, self->fd, frame, adu_len);
+
+    slot->used = true;
+    slot->tid = id;
+    slot->unit_id = unit_id;
+    slot->sent_us = timer_monotonic_us();
+    memcpy(slot->request, MODBUS_ADU_PDU(adu), sizeof(slot->request));
+    self->ninflight++;
+    *tid = id;
+    return DEVICE_OK;
+}
+
+int modbus_tcp_recv_pdu(modbus_tcp_t *self, uint16_t *tid, const uint8_t **request, const uint8_t **pdu,
+                        int *ppdu_len, int timeout)
+{
+    if (self->fd < 0)
+        return DEVICE_E_BROKEN;
+
+    struct timespec poll_sw;
+    timer_stopwatch_start(&poll_sw);
+
+    while (1) {
+        tcp_rx_consume(self);
+
+        if (self->rx_len >= MODBUS_TCP_MBAP_SIZE) {
+            const uint8_t *frame = self->rx_buf;
+            uint16_t id = (uint16_t)((frame[0] << 8) + frame[1]);
+            uint16_t protocol = (uint16_t)((frame[2] << 8) + frame[3]);
+            int length = (frame[4] << 8) + frame[5]; // unit id + pdu
+
+            if (protocol != 0 || length < 2 || length > MODBUS_MAX_PDU_SIZE + 1) {
+                // a byte stream can't resync, start over on a new connection
+                Log_Debug("Invalid mbap header:%s\n", hex(frame, MODBUS_TCP_MBAP_SIZE));
+                modbus_tcp_close(self);
+                return DEVICE_E_BROKEN;
+            }
+
+            int frame_len = MODBUS_TCP_MBAP_SIZE - 1 + length;
+            if (self->rx_len >= frame_len) {
+                self->rx_frame_len = frame_len;
+                mb_trace_frame(MB_TRACE_RX, self->fd, frame, frame_len);
+
+                modbus_tcp_inflight_t *slot = tcp_find(self, id);
+                if (!slot) {
+                    Log_Debug("Discard response to unknown transaction %u\n", id);
+                    continue;
+                }
+                if (frame[6] != slot->unit_id) {
+                    Log_Debug("Discard response from unit %d, expected %d\n", frame[6], slot->unit_id);
+                    continue;
+                }
+
+                self->rx_request = *slot;
+                slot->used = false;
+                self->ninflight--;
+
+                *tid = id;
+                *request = self->rx_request.request;
+                *pdu = frame + MODBUS_TCP_MBAP_SIZE;
+                *ppdu_len = length - 1;
+                return DEVICE_OK;
+            }
+        }
+
+        if (self->rx_len == MODBUS_TCP_RX_BUF_SIZE) {
+            Log_Debug("tcp receive buffer overflow\n");
+            modbus_tcp_close(self);
+            return DEVICE_E_BROKEN;
+        }
+
+        ssize_t nread = recv(self->fd, self->rx_buf + self->rx_len, (size_t)(MODBUS_TCP_RX_BUF_SIZE - self->rx_len), 0);
+        if (nread > 0) {
+            self->rx_len += (int)nread;
+            continue;
+        }
+        if (nread == 0) {
+            Log_Debug("tcp connection closed by peer\n");
+            return DEVICE_E_BROKEN;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            Log_Debug("tcp read error:%s\n", strerror(errno));
+            return errno == ECONNRESET ? DEVICE_E_BROKEN : DEVICE_E_IO;
+        }
+
+        int elapse_ms = (int)timer_stopwatch_stop(&poll_sw);
+        if (elapse_ms >= timeout) {
+            Log_Debug("tcp receiving timeout\n");
+            return DEVICE_E_TIMEOUT;
+        }
+        int err = tcp_wait(self, POLLIN, timeout - elapse_ms);
+        if (err)
+            return err;
+    }
+}
+
+
+void modbus_tcp_destroy(modbus_tcp_t *self)
+{
+    if (self) {
+        modbus_tcp_close(self);
+        free(self);
+    }
+}
+
+
+modbus_tcp_t *modbus_tcp_create(const char *host, uint16_t port)
+{
+    if (!host || strlen(host) >= MODBUS_TCP_HOST_SIZE) {
+        Log_Debug("Invalid tcp host\n");
+        return NULL;
+    }
+
+    modbus_tcp_t *tcp = (modbus_tcp_t *)calloc(1, sizeof(modbus_tcp_t));
+    strcpy(tcp->host, host);
+    tcp->port = port;
+    tcp->fd = -1;
+    return tcp;
+}
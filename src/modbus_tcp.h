@@ -0,0 +1,66 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "modbus_rtu.h"
+
+// Modbus TCP client, MBAP framing on a persistent socket. Every request
+// carries a transaction id, so up to MODBUS_TCP_MAX_INFLIGHT requests can be
+// in flight on one connection and responses are matched by id, not order.
+
+#define MODBUS_TCP_DEFAULT_PORT 502
+#define MODBUS_TCP_HOST_SIZE 64
+#define MODBUS_TCP_MBAP_SIZE 7
+#define MODBUS_TCP_MAX_INFLIGHT 8
+#define MODBUS_TCP_CONNECT_TIMEOUT_MS 3000
+
+// several pipelined max size responses
+#define MODBUS_TCP_RX_BUF_SIZE 1024
+
+// request sent and waiting for its response
+typedef struct modbus_tcp_inflight_t {
+    bool used;
+    uint16_t tid;
+    uint8_t unit_id;
+    uint64_t sent_us; // monotonic time the request was sent
+    uint8_t request[MODBUS_READ_REQUEST_FRAME_LENGTH]; // enough of the pdu to check the response
+} modbus_tcp_inflight_t;
+
+typedef struct modbus_tcp_t modbus_tcp_t;
+struct modbus_tcp_t {
+    int fd;
+    char host[MODBUS_TCP_HOST_SIZE]; // ipv4 address
+    uint16_t port;
+    uint16_t next_tid;
+
+    modbus_tcp_inflight_t inflight[MODBUS_TCP_MAX_INFLIGHT];
+    int ninflight;
+
+    // the socket is drained into rx_buf and frames are cut from its head
+    uint8_t rx_buf[MODBUS_TCP_RX_BUF_SIZE];
+    int rx_len;
+    int rx_frame_len;
+    modbus_tcp_inflight_t rx_request; // request of the last returned frame
+};
+
+
+modbus_tcp_t *modbus_tcp_create(const char *host, uint16_t port);
+void modbus_tcp_destroy(modbus_tcp_t *self);
+int modbus_tcp_open(modbus_tcp_t *self);
+// close the socket, requests in flight are forgotten
+int modbus_tcp_close(modbus_tcp_t *self);
+
+// send the pdu_len bytes pdu already encoded at MODBUS_ADU_PDU(adu), *tid is
+// set to its transaction id. DEVICE_E_BUSY when MODBUS_TCP_MAX_INFLIGHT
+// requests are already in flight.
+int modbus_tcp_send_adu(modbus_tcp_t *self, uint8_t unit_id, modbus_adu_t *adu, int pdu_len, uint16_t *tid,
+                        int timeout);
+
+// receive the next response of any request in flight. *tid tells which,
+// *request points to the start of its request pdu and *pdu into the receive
+// buffer, both valid until the next send or receive. Responses to unknown
+// transaction ids, e.g. late ones after a timeout, are dropped.
+int modbus_tcp_recv_pdu(modbus_tcp_t *self, uint16_t *tid, const uint8_t **request, const uint8_t **pdu,
+                        int *ppdu_len, int timeout);
+
+// forget all requests in flight, their late responses will be dropped
+void modbus_tcp_cancel(modbus_tcp_t *self);
@@ -0,0 +1,207 @@
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "modbus_trace.h"
+#include "utils.h"
+
+// records are stored back to back and wrap around the end of the ring
+static struct {
+    uint8_t buf[MB_TRACE_RING_SIZE];
+    size_t head; // offset of the oldest record
+    size_t used; // bytes of records
+    int count;
+    bool disabled;
+} ring;
+
+
+static void ring_write(size_t at, const void *data, size_t len)
+{
+    at %= MB_TRACE_RING_SIZE;
+    size_t first = MB_TRACE_RING_SIZE - at < len ? MB_TRACE_RING_SIZE - at : len;
+    memcpy(ring.buf + at, data, first);
+    memcpy(ring.buf, (const uint8_t *)data + first, len - first);
+}
+
+static void ring_read(size_t at, void *data, size_t len)
+{
+    at %= MB_TRACE_RING_SIZE;
+    size_t first = MB_TRACE_RING_SIZE - at < len ? MB_TRACE_RING_SIZE - at : len;
+    memcpy(data, ring.buf + at, first);
+    memcpy((uint8_t *)data + first, ring.buf, len - first);
+}
+
+static const char *direction_name(uint8_t direction)
+{
+    return direction == MB_TRACE_TX ? "ADU-->" : direction == MB_TRACE_RX ? "ADU<--" : "DROP<-";
+}
+
+static void ring_drop_oldest(void)
+{
+    mb_trace_record_t record;
+    ring_read(ring.head, &record, sizeof(record));
+    size_t size = sizeof(record) + record.len;
+    ring.head = (ring.head + size) % MB_TRACE_RING_SIZE;
+    ring.used -= size;
+    ring.count--;
+}
+
+
+// --------------------- public interface ---------------------------------------
+
+void mb_trace_frame(uint8_t direction, int channel, const uint8_t *frame, int len)
+{
+    Log_Trace("%s%s\n", direction_name(direction), hex(frame, (size_t)len));
+
+    if (ring.disabled || len < 0)
+        return;
+    int orig_len = len;
+    if (len > MB_TRACE_MAX_FRAME)
+        len = MB_TRACE_MAX_FRAME;
+
+    size_t size = sizeof(mb_trace_record_t) + (size_t)len;
+
+    while (ring.used + size > MB_TRACE_RING_SIZE)
+        ring_drop_oldest();
+
+    mb_trace_record_t record;
+    record.timestamp_us = timer_monotonic_us();
+    record.len = (uint16_t)len;
+    record.orig_len = (uint16_t)orig_len;
+    record.direction = direction;
+    record.channel = (uint8_t)channel;
+
+    size_t tail = ring.head + ring.used;
+    ring_write(tail, &record, sizeof(record));
+    ring_write(tail + sizeof(record), frame, (size_t)len);
+    ring.used += size;
+    ring.count++;
+}
+
+void mb_trace_enable(bool enable)
+{
+    ring.disabled = !enable;
+}
+
+void mb_trace_clear(void)
+{
+    ring.head = 0;
+    ring.used = 0;
+    ring.count = 0;
+}
+
+int mb_trace_foreach(mb_trace_callback_t cb, void *ctx)
+{
+    size_t at = ring.head;
+    int count = ring.count;
+    for (int i = 0; i < count; i++) {
+        mb_trace_record_t record;
+        uint8_t frame[MB_TRACE_MAX_FRAME];
+        ring_read(at, &record, sizeof(record));
+        ring_read(at + sizeof(record), frame, record.len);
+        at += sizeof(record) + record.len;
+        cb(&record, frame, ctx);
+    }
+    return count;
+}
+
+static void dump_record(const mb_trace_record_t *record, const uint8_t *frame, void *ctx)
+{
+    Log_Debug("%llu.%06llu %3u %s%s\n", (unsigned long long)(record->timestamp_us / 1000000),
+              (unsigned long long)(record->timestamp_us % 1000000), record->channel,
+              direction_name(record->direction), hex(frame, record->len));
+}
+
+void mb_trace_dump(void)
+{
+    Log_Debug("%d traced frames\n", mb_trace_foreach(dump_record, NULL));
+}
+
+// pcap file and record headers, written in host byte order as the format
+// allows, readers tell by the magic
+typedef struct pcap_file_header_t {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+} pcap_file_header_t;
+
+typedef struct pcap_record_header_t {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+} pcap_record_header_t;
+
+typedef struct pcap_writer_t {
+    int fd;
+    int64_t wall_offset_us; // wall clock minus monotonic clock
+    int err;
+} pcap_writer_t;
+
+static int write_all(int fd, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            Log_Debug("Failed to write pcap:%s\n", strerror(errno));
+            return DEVICE_E_IO;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return DEVICE_OK;
+}
+
+static void write_pcap_record(const mb_trace_record_t *record, const uint8_t *frame, void *ctx)
+{
+    pcap_writer_t *writer = (pcap_writer_t *)ctx;
+    if (writer->err)
+        return;
+
+    uint8_t buf[sizeof(pcap_record_header_t) + MB_TRACE_PCAP_HEADER + MB_TRACE_MAX_FRAME];
+    pcap_record_header_t header;
+    uint64_t us = (uint64_t)((int64_t)record->timestamp_us + writer->wall_offset_us);
+    header.ts_sec = (uint32_t)(us / 1000000);
+    header.ts_usec = (uint32_t)(us % 1000000);
+    header.incl_len = MB_TRACE_PCAP_HEADER + record->len;
+    header.orig_len = MB_TRACE_PCAP_HEADER + record->orig_len;
+
+    memcpy(buf, &header, sizeof(header));
+    buf[sizeof(header)] = record->direction;
+    buf[sizeof(header) + 1] = record->channel;
+    memcpy(buf + sizeof(header) + MB_TRACE_PCAP_HEADER, frame, record->len);
+    writer->err = write_all(writer->fd, buf, sizeof(header) + header.incl_len);
+}
+
+int mb_trace_write_pcap(int fd)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    pcap_writer_t writer;
+    writer.fd = fd;
+    writer.wall_offset_us = ((int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000) - (int64_t)timer_monotonic_us();
+    writer.err = DEVICE_OK;
+
+    pcap_file_header_t header;
+    header.magic = 0xA1B2C3D4; // us timestamps
+    header.version_major = 2;
+    header.version_minor = 4;
+    header.thiszone = 0;
+    header.sigfigs = 0;
+    header.snaplen = MB_TRACE_PCAP_HEADER + MB_TRACE_MAX_FRAME;
+    header.linktype = MB_TRACE_PCAP_LINKTYPE;
+
+    writer.err = write_all(fd, &header, sizeof(header));
+    if (writer.err == DEVICE_OK)
+        mb_trace_foreach(write_pcap_record, &writer);
+    return writer.err;
+}
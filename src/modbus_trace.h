@@ -0,0 +1,56 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+// Binary trace of the last ADUs sent and received, and of bytes dropped as
+// garbage. Frames are copied into a static ring as they are, oldest ones are
+// overwritten, and only formatted when the ring is dumped or exported, so
+// tracing stays on in production at the cost of a memcpy. With
+// LOG_LEVEL_TRACE frames are logged as hex right away as well.
+// Not thread safe, like the devices writing to it.
+
+#define MB_TRACE_RING_SIZE 8192
+#define MB_TRACE_MAX_FRAME 260 // largest adu, rtu or tcp
+
+enum {
+    MB_TRACE_TX = 0,
+    MB_TRACE_RX = 1,
+    MB_TRACE_DISCARD = 2, // received bytes dropped, out of sync or unexpected
+};
+
+// pcap export: DLT_USER0 with a 2 byte pseudo header, direction and channel,
+// in front of each frame. In Wireshark map User 0 to mbrtu (or mbtcp) with
+// header size 2.
+#define MB_TRACE_PCAP_LINKTYPE 147
+#define MB_TRACE_PCAP_HEADER 2
+
+// record header in the ring, followed by len frame bytes
+typedef struct mb_trace_record_t mb_trace_record_t;
+struct mb_trace_record_t {
+    uint64_t timestamp_us; // monotonic clock
+    uint16_t len;      // bytes recorded
+    uint16_t orig_len; // bytes of the frame, more than len if it was cut
+    uint8_t direction; // MB_TRACE_*
+    uint8_t channel;   // fd of the uart or socket, tells buses apart
+};
+
+typedef void (*mb_trace_callback_t)(const mb_trace_record_t *record, const uint8_t *frame, void *ctx);
+
+// record a frame, the hot path call. Frames longer than MB_TRACE_MAX_FRAME
+// are cut.
+void mb_trace_frame(uint8_t direction, int channel, const uint8_t *frame, int len);
+
+// ring recording is on by default
+void mb_trace_enable(bool enable);
+void mb_trace_clear(void);
+
+// call cb for every frame in the ring, oldest first. cb must not trace.
+// Return number of frames.
+int mb_trace_foreach(mb_trace_callback_t cb, void *ctx);
+
+// log all frames in the ring as hex
+void mb_trace_dump(void);
+
+// write the ring as a pcap file to fd, e.g. a file or socket, with the
+// monotonic timestamps turned into wall clock time
+int mb_trace_write_pcap(int fd);
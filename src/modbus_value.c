@@ -0,0 +1,332 @@
+#include <string.h>
+
+// lanes are loaded from memory, only a little endian layout is handled
+#if defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define MB_VALUE_NEON
+#include <arm_neon.h>
+#endif
+
+#include "modbus_value.h"
+#include "utils.h"
+
+
+// the value of one 32 bit point, the compiler turns the shifts into a load
+// and a byte reverse instruction
+static uint32_t decode_u32(const uint8_t *p, uint8_t order)
+{
+    uint32_t v = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    if (order & MB_ORDER_BADC)
+        v = ((v & 0x00FF00FFu) << 8) | ((v >> 8) & 0x00FF00FFu);
+    if (order & MB_ORDER_CDAB)
+        v = (v << 16) | (v >> 16);
+    return v;
+}
+
+static uint64_t decode_u64(const uint8_t *p, uint8_t order)
+{
+    uint64_t hi = decode_u32(p, order & MB_ORDER_BADC);
+    uint64_t lo = decode_u32(p + 4, order & MB_ORDER_BADC);
+    if (order & MB_ORDER_CDAB) {
+        // registers in reverse order: 4 3 2 1
+        hi = (hi << 16 | hi >> 16) & 0xFFFFFFFFu;
+        lo = (lo << 16 | lo >> 16) & 0xFFFFFFFFu;
+        return lo << 32 | hi;
+    }
+    return hi << 32 | lo;
+}
+
+// one loop per order with the order constant, so each is a plain byte
+// reverse loop the compiler can vectorize
+#define DECODE_BLOCK(type, size, fn, order)                                                                         \
+    for (; i < n; i++) {                                                                                            \
+        type v = fn(data + (size) * i, order);                                                                      \
+        memcpy((uint8_t *)out + (size) * i, &v, (size));                                                            \
+    }
+
+// 4 uint16_t values of 0 or 1 per nibble, in memory order: bit k of the
+// nibble is out[k]
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define LANE(k) (48 - 16 * (k))
+#else
+#define LANE(k) (16 * (k))
+#endif
+#define NIBBLE(n)                                                                                                    \
+    ((uint64_t)((n) & 1) << LANE(0) | (uint64_t)((n) >> 1 & 1) << LANE(1) | (uint64_t)((n) >> 2 & 1) << LANE(2) |     \
+     (uint64_t)((n) >> 3 & 1) << LANE(3))
+
+static const uint64_t nibble_lanes[16] = {
+    NIBBLE(0), NIBBLE(1), NIBBLE(2),  NIBBLE(3),  NIBBLE(4),  NIBBLE(5),  NIBBLE(6),  NIBBLE(7),
+    NIBBLE(8), NIBBLE(9), NIBBLE(10), NIBBLE(11), NIBBLE(12), NIBBLE(13), NIBBLE(14), NIBBLE(15),
+};
+
+// byte k in memory order of the result is bit k of b: replicate b to all
+// bytes, keep bit k in byte k and turn any nonzero byte into 0x01
+static uint64_t spread_bits(uint8_t b)
+{
+    uint64_t x = (b * 0x0101010101010101ull) & 0x8040201008040201ull;
+    x = ((x + 0x7F7F7F7F7F7F7F7Full) >> 7) & 0x0101010101010101ull;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    return x;
+}
+
+// bit k of the result is set if byte k of v is nonzero
+static uint8_t gather_bits(const uint8_t *v)
+{
+    uint64_t x;
+    memcpy(&x, v, sizeof(x));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    // 0x01 in each nonzero byte, then move byte k to bit 56 + k
+    x = (((x & 0x7F7F7F7F7F7F7F7Full) + 0x7F7F7F7F7F7F7F7Full) | x) >> 7 & 0x0101010101010101ull;
+    return (uint8_t)((x * 0x0102040810204080ull) >> 56);
+}
+
+static void set_bit(uint8_t *bits, int bit, int on)
+{
+    uint8_t mask = (uint8_t)(1 << (bit % 8));
+    bits[bit / 8] = (uint8_t)(on ? bits[bit / 8] | mask : bits[bit / 8] & ~mask);
+}
+
+
+// --------------------- public interface ---------------------------------------
+
+void mb_decode_u16(const uint8_t *data, int n, uint16_t *out)
+{
+    int i = 0;
+#ifdef MB_VALUE_NEON
+    // 8 registers per step, swap the bytes of each 16 bit lane
+    for (; i + 8 <= n; i += 8)
+        vst1q_u16(out + i, vreinterpretq_u16_u8(vrev16q_u8(vld1q_u8(data + 2 * i))));
+#endif
+    for (; i < n; i++)
+        out[i] = (uint16_t)((data[2 * i] << 8) | data[2 * i + 1]);
+}
+
+void mb_decode_u32(const uint8_t *data, int n, uint8_t order, void *out)
+{
+    int i = 0;
+#ifdef MB_VALUE_NEON
+    // 4 values per step: ABCD reverses the bytes of each 32 bit lane, BADC
+    // swaps the 16 bit halves, CDAB swaps the bytes of each 16 bit lane
+    if (order == MB_ORDER_ABCD) {
+        for (; i + 4 <= n; i += 4)
+            vst1q_u8((uint8_t *)out + 4 * i, vrev32q_u8(vld1q_u8(data + 4 * i)));
+    } else if (order == MB_ORDER_CDAB) {
+        for (; i + 4 <= n; i += 4)
+            vst1q_u8((uint8_t *)out + 4 * i, vrev16q_u8(vld1q_u8(data + 4 * i)));
+    } else if (order == MB_ORDER_BADC) {
+        for (; i + 4 <= n; i += 4)
+            vst1q_u16((uint16_t *)((uint8_t *)out + 4 * i), vrev32q_u16(vreinterpretq_u16_u8(vld1q_u8(data + 4 * i))));
+    }
+#endif
+    switch (order) {
+    case MB_ORDER_ABCD:
+        DECODE_BLOCK(uint32_t, 4, decode_u32, MB_ORDER_ABCD);
+        break;
+    case MB_ORDER_BADC:
+        DECODE_BLOCK(uint32_t, 4, decode_u32, MB_ORDER_BADC);
+        break;
+    case MB_ORDER_CDAB:
+        DECODE_BLOCK(uint32_t, 4, decode_u32, MB_ORDER_CDAB);
+        break;
+    default:
+        DECODE_BLOCK(uint32_t, 4, decode_u32, MB_ORDER_DCBA);
+        break;
+    }
+}
+
+void mb_decode_u64(const uint8_t *data, int n, uint8_t order, void *out)
+{
+    int i = 0;
+    switch (order) {
+    case MB_ORDER_ABCD:
+        DECODE_BLOCK(uint64_t, 8, decode_u64, MB_ORDER_ABCD);
+        break;
+    case MB_ORDER_BADC:
+        DECODE_BLOCK(uint64_t, 8, decode_u64, MB_ORDER_BADC);
+        break;
+    case MB_ORDER_CDAB:
+        DECODE_BLOCK(uint64_t, 8, decode_u64, MB_ORDER_CDAB);
+        break;
+    default:
+        DECODE_BLOCK(uint64_t, 8, decode_u64, MB_ORDER_DCBA);
+        break;
+    }
+}
+
+void mb_unpack_bits(const uint8_t *bits, int first, int n, uint16_t *out)
+{
+    int i = 0;
+    for (; i < n && (first + i) % 8; i++)
+        out[i] = (bits[(first + i) / 8] >> ((first + i) % 8)) & 0x01;
+
+    const uint8_t *p = bits + (first + i) / 8;
+    for (; i + 8 <= n; i += 8, p++) {
+        memcpy(out + i, &nibble_lanes[*p & 0x0F], sizeof(uint64_t));
+        memcpy(out + i + 4, &nibble_lanes[*p >> 4], sizeof(uint64_t));
+    }
+
+    for (; i < n; i++)
+        out[i] = (bits[(first + i) / 8] >> ((first + i) % 8)) & 0x01;
+}
+
+void mb_unpack_bits8(const uint8_t *bits, int first, int n, uint8_t *out)
+{
+    int i = 0;
+    for (; i < n && (first + i) % 8; i++)
+        out[i] = (bits[(first + i) / 8] >> ((first + i) % 8)) & 0x01;
+
+    const uint8_t *p = bits + (first + i) / 8;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t x = spread_bits(*p++);
+        memcpy(out + i, &x, sizeof(x));
+    }
+
+    for (; i < n; i++)
+        out[i] = (bits[(first + i) / 8] >> ((first + i) % 8)) & 0x01;
+}
+
+void mb_pack_bits(const uint16_t *values, int n, uint8_t *bits, int first)
+{
+    int i = 0;
+    for (; i < n && (first + i) % 8; i++)
+        set_bit(bits, first + i, values[i] != 0);
+
+    uint8_t *p = bits + (first + i) / 8;
+    for (; i + 8 <= n; i += 8) {
+        uint8_t b = 0;
+        for (int k = 0; k < 8; k++)
+            b |= (uint8_t)((values[i + k] != 0) << k);
+        *p++ = b;
+    }
+
+    for (; i < n; i++)
+        set_bit(bits, first + i, values[i] != 0);
+}
+
+void mb_pack_bits8(const uint8_t *values, int n, uint8_t *bits, int first)
+{
+    int i = 0;
+    for (; i < n && (first + i) % 8; i++)
+        set_bit(bits, first + i, values[i] != 0);
+
+    uint8_t *p = bits + (first + i) / 8;
+    for (; i + 8 <= n; i += 8)
+        *p++ = gather_bits(values + i);
+
+    for (; i < n; i++)
+        set_bit(bits, first + i, values[i] != 0);
+}
+
+int mb_value_registers(const mb_value_point_t *point)
+{
+    switch (point->type) {
+    case MB_VALUE_UINT16:
+    case MB_VALUE_INT16:
+    case MB_VALUE_SCALED_INT16:
+        return point->count;
+    case MB_VALUE_UINT32:
+    case MB_VALUE_INT32:
+    case MB_VALUE_FLOAT32:
+        return 2 * point->count;
+    case MB_VALUE_UINT64:
+    case MB_VALUE_INT64:
+        return 4 * point->count;
+    case MB_VALUE_ASCII:
+        return (point->count + 1) / 2;
+    default:
+        return -1;
+    }
+}
+
+int mb_check_values(const mb_value_point_t *points, int npoints, uint16_t nregs)
+{
+    for (int i = 0; i < npoints; i++) {
+        int nregs_point = mb_value_registers(&points[i]);
+        if (nregs_point < 0 || !points[i].value || points[i].offset + nregs_point > nregs) {
+            Log_Debug("Invalid value point %d\n", i);
+            return DEVICE_E_INVALID;
+        }
+    }
+    return DEVICE_OK;
+}
+
+int mb_decode_values(const uint8_t *data, uint16_t nregs, const mb_value_point_t *points, int npoints)
+{
+    int err = mb_check_values(points, npoints, nregs);
+    if (err)
+        return err;
+
+    for (int i = 0; i < npoints; i++) {
+        const mb_value_point_t *point = &points[i];
+        const uint8_t *p = data + 2 * point->offset;
+        int count = point->count;
+
+        switch (point->type) {
+        case MB_VALUE_UINT16:
+        case MB_VALUE_INT16:
+            // two's complement, int16_t has the layout of uint16_t
+            mb_decode_u16(p, count, (uint16_t *)point->value);
+            break;
+        case MB_VALUE_SCALED_INT16: {
+            float *value = (float *)point->value;
+            for (int k = 0; k < count; k++)
+                value[k] = (float)(int16_t)((p[2 * k] << 8) | p[2 * k + 1]) * point->scale;
+            break;
+        }
+        case MB_VALUE_UINT32:
+        case MB_VALUE_INT32:
+        case MB_VALUE_FLOAT32:
+            // float is copied as its ieee 754 bits
+            mb_decode_u32(p, count, point->order, point->value);
+            break;
+        case MB_VALUE_UINT64:
+        case MB_VALUE_INT64:
+            mb_decode_u64(p, count, point->order, point->value);
+            break;
+        case MB_VALUE_ASCII: {
+            char *value = (char *)point->value;
+            int swap = point->order & MB_ORDER_BADC;
+            for (int k = 0; k < count; k++)
+                value[k] = (char)p[k ^ swap];
+            value[count] = 0;
+            break;
+        }
+        }
+    }
+    return DEVICE_OK;
+}
+
+int mb_read_values(modbus_device_t *self, uint8_t slave_id, uint8_t reg_type, uint16_t addr, uint16_t quantity,
+                   const mb_value_point_t *points, int npoints, int32_t timeout)
+{
+    uint16_t max_quantity = reg_type == INPUT_REGISTER ? MODBUS_MAX_INPUT_PER_READ : MODBUS_MAX_HOLDING_PER_READ;
+    if ((reg_type != INPUT_REGISTER && reg_type != HOLDING_REGISTER) || quantity == 0 || quantity > max_quantity)
+        return DEVICE_E_INVALID;
+    int err = mb_check_values(points, npoints, quantity);
+    if (err)
+        return err;
+
+    if (self->cache) {
+        // values are kept per register, go through them
+        uint16_t regs[MODBUS_MAX_HOLDING_PER_READ];
+        uint8_t data[2 * MODBUS_MAX_HOLDING_PER_READ];
+        err = mb_read_register(self, slave_id, reg_type, addr, quantity, regs, timeout);
+        if (err)
+            return err;
+        for (int i = 0; i < quantity; i++) {
+            data[2 * i] = (uint8_t)(regs[i] >> 8);
+            data[2 * i + 1] = (uint8_t)regs[i];
+        }
+        return mb_decode_values(data, quantity, points, npoints);
+    }
+
+    const uint8_t *data;
+    err = mb_read_register_raw(self, slave_id, reg_type, addr, quantity, &data, timeout);
+    if (err)
+        return err;
+    return mb_decode_values(data, quantity, points, npoints);
+}
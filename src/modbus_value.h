@@ -0,0 +1,88 @@
+#pragma once
+#include <stdint.h>
+#include "modbus.h"
+
+// Typed values spread over registers, decoded straight from the register
+// bytes of a read response instead of from a uint16_t copy:
+//
+//   float power[3];
+//   uint64_t energy;
+//   char serial[17];
+//   mb_value_point_t points[] = {
+//       {.offset = 0, .type = MB_VALUE_FLOAT32, .order = MB_ORDER_CDAB, .count = 3, .value = power},
+//       {.offset = 6, .type = MB_VALUE_UINT64, .order = MB_ORDER_ABCD, .count = 1, .value = &energy},
+//       {.offset = 10, .type = MB_VALUE_ASCII, .count = 16, .value = serial},
+//   };
+//   mb_read_values(device, 1, HOLDING_REGISTER, 3000, 18, points, 3, 1000);
+//
+// A point with count > 1 is an array of values at consecutive registers,
+// decoded by one byte swap kernel over the block. NEON is used when the
+// compiler targets it, otherwise the plain loops are left to the
+// auto-vectorizer.
+
+enum {
+    MB_VALUE_UINT16,
+    MB_VALUE_INT16,
+    MB_VALUE_SCALED_INT16, // float, raw * scale
+    MB_VALUE_UINT32,
+    MB_VALUE_INT32,
+    MB_VALUE_FLOAT32,
+    MB_VALUE_UINT64,
+    MB_VALUE_INT64,
+    MB_VALUE_ASCII, // count characters, 2 per register, 0 terminated
+};
+
+// Order of the bytes of a 32 bit value ABCD, A most significant, as they
+// come on the wire. Bit 0 swaps the bytes of each register, bit 1 reverses
+// the register order, so the same orders apply to 64 bit values, e.g.
+// MB_ORDER_CDAB is the low register first. MB_ORDER_BADC also reads ASCII
+// low byte first.
+enum {
+    MB_ORDER_ABCD = 0, // big endian, the modbus default
+    MB_ORDER_BADC = 1, // bytes of each register swapped
+    MB_ORDER_CDAB = 2, // registers swapped
+    MB_ORDER_DCBA = 3, // little endian
+};
+
+typedef struct mb_value_point_t mb_value_point_t;
+struct mb_value_point_t {
+    uint16_t offset; // first register, from the address read
+    uint8_t type;    // MB_VALUE_*
+    uint8_t order;   // MB_ORDER_*
+    uint16_t count;  // values at consecutive registers, characters for MB_VALUE_ASCII
+    float scale;     // MB_VALUE_SCALED_INT16
+    void *value;     // count values of the type, count + 1 chars for MB_VALUE_ASCII
+};
+
+// registers taken by a point
+int mb_value_registers(const mb_value_point_t *point);
+
+// DEVICE_E_INVALID if a point has an unknown type or reaches past nregs
+int mb_check_values(const mb_value_point_t *points, int npoints, uint16_t nregs);
+
+// decode points from the nregs big endian registers at data, e.g. the
+// payload of a read response
+int mb_decode_values(const uint8_t *data, uint16_t nregs, const mb_value_point_t *points, int npoints);
+
+// block kernels, n values from big endian register bytes at data. out of
+// the 32 and 64 bit kernels may be integers or floats of that size.
+void mb_decode_u16(const uint8_t *data, int n, uint16_t *out);
+void mb_decode_u32(const uint8_t *data, int n, uint8_t order, void *out);
+void mb_decode_u64(const uint8_t *data, int n, uint8_t order, void *out);
+
+// Coils and discrete inputs packed 8 per byte, lowest address in bit 0 as on
+// the wire. Whole bytes are spread to and gathered from 8 values at once
+// with 64 bit arithmetic, only the bits before the first and after the last
+// whole byte go one by one. Unpack sets out[i] to 0 or 1 from bit first + i,
+// pack sets bits first..first + n - 1 from values, nonzero is on, and keeps
+// the other bits of bits.
+void mb_unpack_bits(const uint8_t *bits, int first, int n, uint16_t *out);
+void mb_unpack_bits8(const uint8_t *bits, int first, int n, uint8_t *out);
+void mb_pack_bits(const uint16_t *values, int n, uint8_t *bits, int first);
+void mb_pack_bits8(const uint8_t *values, int n, uint8_t *bits, int first);
+
+// read quantity input or holding registers with one request and decode the
+// points from the response. With a register cache the values go through it
+// like mb_read_register.
+int mb_read_values(struct modbus_device_t *self, uint8_t slave_id, uint8_t reg_type, uint16_t addr,
+                   uint16_t quantity, const mb_value_point_t *points, int npoints, int32_t timeout_ms);
@@ -0,0 +1,34 @@
+#pragma once
+
+// MODBUS_HOST is defined by CMakeLists.txt when building outside the Azure
+// Sphere SDK, e.g. for plain Linux against a serial tty or pty.
+#ifdef MODBUS_HOST
+#include <stdio.h>
+#define Log_Debug(...) fprintf(stderr, __VA_ARGS__)
+#else
+#include <applibs/log.h>
+#endif
+
+// Log levels. MODBUS_LOG_LEVEL is the most verbose level compiled in, lower
+// levels compile to nothing. log_level is the runtime threshold. Arguments
+// are only evaluated when the level is on, so Log_Trace("%s", hex(...))
+// doesn't format anything when tracing is off.
+enum { LOG_LEVEL_ERROR = 0, LOG_LEVEL_WARN = 1, LOG_LEVEL_INFO = 2, LOG_LEVEL_DEBUG = 3, LOG_LEVEL_TRACE = 4 };
+
+#ifndef MODBUS_LOG_LEVEL
+#define MODBUS_LOG_LEVEL LOG_LEVEL_TRACE
+#endif
+
+extern int log_level; // default LOG_LEVEL_DEBUG, see log_set_level
+
+#define LOG_ENABLED(level) ((level) <= MODBUS_LOG_LEVEL && (level) <= log_level)
+#define Log_Level(level, ...)         \
+    do {                              \
+        if (LOG_ENABLED(level))       \
+            Log_Debug(__VA_ARGS__);   \
+    } while (0)
+
+#define Log_Error(...) Log_Level(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define Log_Warn(...) Log_Level(LOG_LEVEL_WARN, __VA_ARGS__)
+#define Log_Info(...) Log_Level(LOG_LEVEL_INFO, __VA_ARGS__)
+#define Log_Trace(...) Log_Level(LOG_LEVEL_TRACE, __VA_ARGS__)
@@ -0,0 +1,25 @@
+#pragma once
+#include <stdbool.h>
+#include "modbus_rtu.h"
+
+// Transport backend under modbus_rtu_t. A backend only opens/closes the port
+// and drives the RS-485 transmitter, uart_fd must be a non blocking fd so the
+// RTU framing code can poll/read/write it directly.
+typedef struct rtu_transport_t rtu_transport_t;
+struct rtu_transport_t {
+    const char *name;
+    // open port with self->baud_rate/parity/stop_bits, set self->uart_fd
+    int (*open)(modbus_rtu_t *self);
+    // close port and release everything open() acquired
+    int (*close)(modbus_rtu_t *self);
+    // drive tx enable of the transceiver, no-op if not available
+    void (*set_tx_enable)(modbus_rtu_t *self, bool enable);
+};
+
+#ifndef MODBUS_HOST
+// Azure Sphere applibs UART, port is self->uart_port
+extern const rtu_transport_t rtu_transport_applibs;
+#endif
+
+// termios tty, /dev/ttyS*, /dev/ttyUSB* or a pty, port is self->tty_path
+extern const rtu_transport_t rtu_transport_posix;
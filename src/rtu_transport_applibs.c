@@ -0,0 +1,81 @@
+#ifndef MODBUS_HOST
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#define UART_STRUCTS_VERSION 1
+#include <applibs/uart.h>
+#include <applibs/gpio.h>
+
+#include "rtu_transport.h"
+#include "utils.h"
+
+#include <hw/sample_hardware.h>
+
+
+static int applibs_open(modbus_rtu_t *self)
+{
+    UART_Config config;
+    UART_InitConfig(&config);
+    config.blockingMode = UART_BlockingMode_NonBlocking;
+    config.dataBits = UART_DataBits_Eight;
+    config.parity = self->parity == RTU_PARITY_EVEN ? UART_Parity_Even
+                  : self->parity == RTU_PARITY_ODD  ? UART_Parity_Odd
+                                                    : UART_Parity_None;
+    config.stopBits = self->stop_bits == 2 ? UART_StopBits_Two : UART_StopBits_One;
+    config.baudRate = self->baud_rate;
+
+    self->uart_fd = UART_Open(self->uart_port, &config);
+    if (self->uart_fd < 0) {
+        Log_Debug("ERROR: Could not open UART: %s (%d).\n", strerror(errno), errno);
+        return -1;
+    }
+#ifdef TX_ENABLE
+    GPIO_Id gpio = self->tx_enable_gpio >= 0 ? (GPIO_Id)self->tx_enable_gpio : SAMPLE_AILINK_UART_ENABLE;
+    self->tx_enable_fd = GPIO_OpenAsOutput(gpio, GPIO_OutputMode_PushPull, GPIO_Value_Low);
+
+    if (self->tx_enable_fd < 0) {
+        Log_Debug("ERROR: Could not open tx enable GPIO\n");
+        return DEVICE_E_IO;
+    }
+#endif    
+
+    return 0;
+}
+
+static int applibs_close(modbus_rtu_t *self)
+{
+    int result = 0;
+    if (self->uart_fd >= 0) {
+        result = close(self->uart_fd);
+        self->uart_fd = -1;
+    }
+#ifdef TX_ENABLE
+    if (self->tx_enable_fd >= 0) {
+        result = close(self->tx_enable_fd);
+        self->tx_enable_fd = -1;
+    }
+#endif    
+
+    return result;
+}
+
+static void applibs_set_tx_enable(modbus_rtu_t *self, bool enable)
+{
+#ifdef TX_ENABLE
+    if (self->tx_enable_fd >= 0) {
+        GPIO_SetValue(self->tx_enable_fd, enable ? GPIO_Value_High : GPIO_Value_Low);
+    }
+#endif
+}
+
+
+const rtu_transport_t rtu_transport_applibs = {
+    .name = "applibs",
+    .open = applibs_open,
+    .close = applibs_close,
+    .set_tx_enable = applibs_set_tx_enable,
+};
+
+#endif // MODBUS_HOST
@@ -0,0 +1,123 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "rtu_transport.h"
+#include "utils.h"
+
+
+static int baud_to_speed(unsigned int baud_rate, speed_t *speed)
+{
+    switch (baud_rate) {
+    case 1200: *speed = B1200; break;
+    case 2400: *speed = B2400; break;
+    case 4800: *speed = B4800; break;
+    case 9600: *speed = B9600; break;
+    case 19200: *speed = B19200; break;
+    case 38400: *speed = B38400; break;
+    case 57600: *speed = B57600; break;
+    case 115200: *speed = B115200; break;
+    case 230400: *speed = B230400; break;
+#ifdef B460800
+    case 460800: *speed = B460800; break;
+#endif
+#ifdef B921600
+    case 921600: *speed = B921600; break;
+#endif
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+static int posix_open(modbus_rtu_t *self)
+{
+    speed_t speed;
+    if (baud_to_speed(self->baud_rate, &speed) != 0) {
+        Log_Debug("ERROR: Unsupported baud rate %u\n", self->baud_rate);
+        return DEVICE_E_CONFIG;
+    }
+
+    self->uart_fd = open(self->tty_path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (self->uart_fd < 0) {
+        Log_Debug("ERROR: Could not open %s: %s (%d).\n", self->tty_path, strerror(errno), errno);
+        return -1;
+    }
+
+    struct termios tio;
+    if (tcgetattr(self->uart_fd, &tio) != 0) {
+        Log_Debug("ERROR: %s is not a tty: %s\n", self->tty_path, strerror(errno));
+        close(self->uart_fd);
+        self->uart_fd = -1;
+        return DEVICE_E_CONFIG;
+    }
+
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~(CSIZE | PARENB | PARODD | CSTOPB | CRTSCTS);
+    tio.c_cflag |= CS8;
+    if (self->parity != RTU_PARITY_NONE) {
+        tio.c_cflag |= PARENB;
+        if (self->parity == RTU_PARITY_ODD)
+            tio.c_cflag |= PARODD;
+    }
+    if (self->stop_bits == 2)
+        tio.c_cflag |= CSTOPB;
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+
+    if (tcsetattr(self->uart_fd, TCSANOW, &tio) != 0) {
+        Log_Debug("ERROR: Could not configure %s: %s\n", self->tty_path, strerror(errno));
+        close(self->uart_fd);
+        self->uart_fd = -1;
+        return DEVICE_E_CONFIG;
+    }
+    tcflush(self->uart_fd, TCIOFLUSH);
+
+#ifdef TX_ENABLE
+    // drive transceiver tx enable with RTS when the tty has modem lines,
+    // pty and most USB adapters with auto direction don't
+    int lines;
+    self->tx_enable_fd = ioctl(self->uart_fd, TIOCMGET, &lines) == 0 ? self->uart_fd : -1;
+#endif
+
+    return 0;
+}
+
+static int posix_close(modbus_rtu_t *self)
+{
+    int result = 0;
+    if (self->uart_fd >= 0) {
+        result = close(self->uart_fd);
+        self->uart_fd = -1;
+    }
+#ifdef TX_ENABLE
+    // tx_enable_fd is an alias of uart_fd
+    self->tx_enable_fd = -1;
+#endif
+
+    return result;
+}
+
+static void posix_set_tx_enable(modbus_rtu_t *self, bool enable)
+{
+#ifdef TX_ENABLE
+    if (self->tx_enable_fd >= 0) {
+        int rts = TIOCM_RTS;
+        ioctl(self->tx_enable_fd, enable ? TIOCMBIS : TIOCMBIC, &rts);
+    }
+#endif
+}
+
+
+const rtu_transport_t rtu_transport_posix = {
+    .name = "posix",
+    .open = posix_open,
+    .close = posix_close,
+    .set_tx_enable = posix_set_tx_enable,
+};
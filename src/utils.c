@@ -5,11 +5,19 @@
 #include <signal.h>
 #include <stdint.h>
 #include <ctype.h>
+#include <errno.h>
 
 
-#include <applibs/log.h>
+#include "platform.h"
 #include "utils.h"
 
+int log_level = LOG_LEVEL_DEBUG;
+
+void log_set_level(int level)
+{
+    log_level = level;
+}
+
 static const char* error_name[] = {
     "DEVICE_OK",
     "DEVICE_E_INVALID",
@@ -18,14 +26,15 @@ static const char* error_name[] = {
     "DEVICE_E_PROTOCOL",
     "DEVICE_E_TIMEOUT",
     "DEVICE_E_INTERNAL",
-    "DEVICE_E_CONFIG"
+    "DEVICE_E_CONFIG",
+    "DEVICE_E_BUSY"
 };
 
 
 const char* strerr(int err)
 {
     static char *unknown = "E_UNKNOWN";
-    if (err >= 0 || err <= DEVICE_E_CONFIG)
+    if (err >= 0 && err < DEVICE_E_COUNT)
         return error_name[err];
     else
         return unknown;
@@ -42,83 +51,168 @@ char* strcat_grow(char* msg, size_t *psize, size_t inc, const char* token)
     if (!token) return msg;
 
     size_t old_len = msg ? strlen(msg) : 0;
-    size_t new_len = old_len + strlen(token) + 1;
+    size_t token_len = strlen(token);
+    size_t new_len = old_len + token_len + 1;
 
-    while (*psize < new_len)
-        *psize += inc;
-
-    char *msg2 = malloc(*psize);
-    *msg2 = 0;
-    if (msg) strcpy(msg2, msg);
+    // only grow when full, in place when realloc can
+    if (!msg || *psize < new_len) {
+        size_t size = msg ? *psize : 0;
+        while (size < new_len)
+            size += inc ? inc : new_len;
+        char *msg2 = realloc(msg, size);
+        if (!msg2)
+            return msg;
+        msg = msg2;
+        *psize = size;
+    }
 
-    // start with old_len to improve performance
-    strcat(msg2 + old_len, token);
-    free(msg);
-    return msg2;
+    memcpy(msg + old_len, token, token_len + 1);
+    return msg;
 }
 
-
-// return current timestamp string, not thread safe.
-const char* get_timestamp(time_t t)
+// write value as width digits, leading zeros
+static char *put_digits(char *p, unsigned long value, int width)
 {
-    // timestamp
-    static char timestamp[40];
-    time_t s = 0;
-    long ms = 0;
-
-    if (t) {
-        s = t;
-        ms = 0;
-    } else {
-        struct timespec spec;
-        clock_gettime(CLOCK_REALTIME, &spec);
-        s = spec.tv_sec;
-        ms = (spec.tv_nsec + 500000) / 1000000;
-        if (ms > 999) { s++; ms = 0; }
+    for (int i = width - 1; i >= 0; i--) {
+        p[i] = (char)('0' + value % 10);
+        value /= 10;
     }
-    struct tm *tm = gmtime(&s);
-    snprintf(timestamp, sizeof(timestamp), "%04d-%02d-%02d %02d:%02d:%02d.%03ld",
-        tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec, ms);
-    return timestamp;
+    return p + width;
 }
 
-const char* format_timestamp(struct timespec spec)
+// format s and ms without snprintf, which can't prove the fields fit
+static size_t timestamp_r(char *buf, size_t size, time_t s, long ms)
 {
-    static char timestamp[40];
+    if (size == 0)
+        return 0;
+
+    struct tm tm;
+    char timestamp[TIMESTAMP_SIZE];
+    char *p = timestamp;
+    gmtime_r(&s, &tm);
+    p = put_digits(p, (unsigned long)(tm.tm_year + 1900) % 10000, 4);
+    *p++ = '-';
+    p = put_digits(p, (unsigned long)tm.tm_mon + 1, 2);
+    *p++ = '-';
+    p = put_digits(p, (unsigned long)tm.tm_mday, 2);
+    *p++ = ' ';
+    p = put_digits(p, (unsigned long)tm.tm_hour, 2);
+    *p++ = ':';
+    p = put_digits(p, (unsigned long)tm.tm_min, 2);
+    *p++ = ':';
+    p = put_digits(p, (unsigned long)tm.tm_sec, 2);
+    *p++ = '.';
+    p = put_digits(p, (unsigned long)ms, 3);
+
+    size_t len = (size_t)(p - timestamp);
+    if (len > size - 1)
+        len = size - 1;
+    memcpy(buf, timestamp, len);
+    buf[len] = 0;
+    return len;
+}
 
+size_t format_timestamp_r(char *buf, size_t size, struct timespec spec)
+{
     time_t s = spec.tv_sec;
     long ms = (spec.tv_nsec + 500000) / 1000000;
     if (ms > 999) { s++; ms = 0; }
+    return timestamp_r(buf, size, s, ms);
+}
+
+// timestamp of t, or the current time with ms when t is 0
+size_t get_timestamp_r(char *buf, size_t size, time_t t)
+{
+    if (t)
+        return timestamp_r(buf, size, t, 0);
+
+    struct timespec spec;
+    clock_gettime(CLOCK_REALTIME, &spec);
+    return format_timestamp_r(buf, size, spec);
+}
+
+size_t hex_r(char *buf, size_t size, const unsigned char *data, size_t len)
+{
+    static const char digits[] = "0123456789abcdef";
+
+    if (size < HEX_SIZE(0)) {
+        if (size)
+            *buf = 0;
+        return 0;
+    }
+    if (len > (size - HEX_SIZE(0)) / 3)
+        len = (size - HEX_SIZE(0)) / 3;
+
+    char *p = buf;
+    *p++ = '[';
+    for (size_t i = 0; i < len; i++) {
+        *p++ = digits[data[i] >> 4];
+        *p++ = digits[data[i] & 0x0F];
+        *p++ = ' ';
+    }
+    *p++ = ']';
+    *p = 0;
+    return (size_t)(p - buf);
+}
+
+// printable bytes as they are, control characters as \nn
+size_t chr_r(char *buf, size_t size, const unsigned char *data, size_t len)
+{
+    if (size < 3) {
+        if (size)
+            *buf = 0;
+        return 0;
+    }
+
+    // room for the closing bracket and 0
+    char *end = buf + size - 2;
+    char *p = buf;
+    *p++ = '[';
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] >= 32) {
+            if (p + 1 > end)
+                break;
+            *p++ = (char)data[i];
+        } else {
+            int width = data[i] < 10 ? 1 : 2;
+            if (p + 1 + width > end)
+                break;
+            *p++ = '\\';
+            p = put_digits(p, data[i], width);
+        }
+    }
+    *p++ = ']';
+    *p = 0;
+    return (size_t)(p - buf);
+}
+
+const char* get_timestamp(time_t t)
+{
+    static _Thread_local char timestamp[TIMESTAMP_SIZE];
+    get_timestamp_r(timestamp, sizeof(timestamp), t);
+    return timestamp;
+}
 
-    struct tm *tm = gmtime(&s);
-    snprintf(timestamp, sizeof(timestamp), "%04d-%02d-%02d %02d:%02d:%02d.%03ld",
-        tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec, ms);
+const char* format_timestamp(struct timespec spec)
+{
+    static _Thread_local char timestamp[TIMESTAMP_SIZE];
+    format_timestamp_r(timestamp, sizeof(timestamp), spec);
     return timestamp;
 }
 
 const char* hex(const unsigned char* data, size_t len)
 {
-    static char buf[400];
-    int n = snprintf(buf, sizeof(buf), "[");
-    for (size_t i = 0; i < len; i++)
-        n += snprintf(buf + n, (size_t)(sizeof(buf) - n), "%02x ", data[i]);
-    snprintf(buf + n, (size_t)(sizeof(buf) - n), "]");
+    // one max size frame, longer data is cut
+    static _Thread_local char buf[HEX_SIZE(256)];
+    hex_r(buf, sizeof(buf), data, len);
     return buf;
 }
 
 const char* chr(const unsigned char* data, size_t len)
 {
-    static char buf[400];
-    int n = snprintf(buf, sizeof(buf), "[");
-    for (size_t i = 0; i < len; i++) {
-        if (data[i] < 32)
-            n += snprintf(buf + n, (size_t)(sizeof(buf) - n), "\%d", data[i]);
-        else
-            n += snprintf(buf + n, (size_t)(sizeof(buf) - n), "%c", data[i]);
-    }
-    snprintf(buf + n, (size_t)(sizeof(buf) - n), "]");
+    static _Thread_local char buf[3 * 256 + 3];
+    chr_r(buf, sizeof(buf), data, len);
     return buf;
-
 }
 
 
@@ -150,3 +244,23 @@ inline long timer_stopwatch_stop(struct timespec *s)
     return ms;
 }
 
+// monotonic clock in us
+uint64_t timer_monotonic_us(void)
+{
+    struct timespec now = { 0, 0 };
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+// sleep for us microseconds, return immediately if us <= 0
+void timer_sleep_us(long us)
+{
+    if (us <= 0)
+        return;
+
+    struct timespec delay;
+    delay.tv_sec = us / 1000000;
+    delay.tv_nsec = (us % 1000000) * 1000;
+    while (nanosleep(&delay, &delay) != 0 && errno == EINTR)
+        ;
+}
@@ -1,7 +1,8 @@
 #pragma once
 #include <stddef.h> /* size_t */
+#include <stdint.h>
 #include <time.h>
-#include <applibs/log.h>
+#include "platform.h"
 
 enum {
     DEVICE_OK,
@@ -12,15 +13,35 @@ enum {
     DEVICE_E_TIMEOUT,    // timeout
     DEVICE_E_INTERNAL,   // internal logic error, assert
     DEVICE_E_CONFIG,     // device configuration error
-    DEVICE_E_BUSY,       // Garbage data on link
+    DEVICE_E_BUSY,       // queue full, or garbage data on link
 };
 
+#define DEVICE_E_COUNT (DEVICE_E_BUSY + 1)
+
 
 const char *strerr(int err);
 
+// runtime log threshold, LOG_LEVEL_* from platform.h
+void log_set_level(int level);
+
 
 
 char* strcat_grow(char* msg, size_t *msg_size, size_t inc_size, const char* token);
+
+// "YYYY-MM-DD HH:MM:SS.mmm" in UTC, with the terminating 0
+#define TIMESTAMP_SIZE 24
+// "[xx xx ]" for len bytes, with the terminating 0
+#define HEX_SIZE(len) (3 * (len) + 3)
+
+// Formatting into a caller buffer, safe from any thread and allocation free.
+// Output is cut to fit size and always terminated, return its length.
+size_t get_timestamp_r(char *buf, size_t size, time_t t);
+size_t format_timestamp_r(char *buf, size_t size, struct timespec spec);
+size_t hex_r(char *buf, size_t size, const unsigned char *data, size_t len);
+size_t chr_r(char *buf, size_t size, const unsigned char *data, size_t len);
+
+// Same into a thread local buffer, valid until the next call of the
+// function on the same thread. hex and chr cut data after 256 bytes.
 const char* get_timestamp(time_t t);
 const char* format_timestamp(struct timespec spec);
 
@@ -34,6 +55,12 @@ void timer_stopwatch_start(struct timespec *s);
 // stop stopwatch and return ms
 long timer_stopwatch_stop(struct timespec *s);
 
+// monotonic clock in us
+uint64_t timer_monotonic_us(void);
+
+// sleep for us microseconds, return immediately if us <= 0
+void timer_sleep_us(long us);
+
 // none inplace trim, caller need to release memory
 char* trim(char * s);
 